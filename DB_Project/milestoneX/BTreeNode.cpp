@@ -3,6 +3,7 @@
 //
 
 #include "BTreeNode.h"
+#include <algorithm>
 
 /************************
  * BTreeNode base class *
@@ -28,6 +29,11 @@ void BTreeNode::save() {
 	this->file.put(this->block);
 }
 
+// Is less than half of the block in use? (Only meaningful right after a save.)
+bool BTreeNode::is_underfull() const {
+	return this->block->unused_bytes() > DB_BLOCK_SZ / 2;
+}
+
 // Get the record and turn it into a block ID.
 BlockID BTreeNode::get_block_id(RecordID record_id) const {
 	Dbt *dbt = this->block->get(record_id);
@@ -48,36 +54,9 @@ Handle BTreeNode::get_handle(RecordID record_id) const {
 // Get the record and turn it into a KeyValue.
 KeyValue *BTreeNode::get_key(RecordID record_id) const {
 	Dbt *dbt = this->block->get(record_id);
-	char *bytes = (char*)dbt->get_data();
-	KeyValue *key_value = new KeyValue();
-	Value value;
-	uint offset = 0;
-	for (auto const& data_type : this->key_profile) {
-		value.data_type = data_type;
-		if (data_type == ColumnAttribute::DataType::INT) {
-			value.n = *(int32_t*)(bytes + offset);
-			offset += sizeof(int32_t);
-		}
-		else if (data_type == ColumnAttribute::DataType::TEXT) {
-			uint16_t size = *(uint16_t *)(bytes + offset);
-			offset += sizeof(uint16_t);
-			char buffer[DB_BLOCK_SZ];
-			memcpy(buffer, bytes + offset, size);
-			buffer[size] = '\0';
-			value.s = std::string(buffer);  // assume ascii for now
-			offset += size;
-		}
-		else if (data_type == ColumnAttribute::DataType::BOOLEAN) {
-			value.n = *(uint8_t*)(bytes + offset);
-			offset += sizeof(uint8_t);
-		}
-		else {
-			throw DbRelationError("Only know how to unmarshal INT, TEXT, or BOOLEAN");
-		}
-		key_value->push_back(value);
-	}
+	std::string bytes((char *)dbt->get_data(), dbt->get_size());
 	delete dbt;
-	return key_value;
+	return new KeyValue(BTreeKey::decode(bytes, this->key_profile));
 }
 
 // Convert block_id into bytes.
@@ -97,87 +76,189 @@ Dbt *BTreeNode::marshal_handle(Handle handle) {
 	return dbt;
 }
 
-// Convert KeyValue into bytes.
+// Convert KeyValue into bytes: its BTreeKey encoding, so probe can compare keys right on the block.
 Dbt *BTreeNode::marshal_key(const KeyValue *key) {
-	char *bytes = new char[DB_BLOCK_SZ]; // more than we need
-	uint offset = 0;
-	uint col_num = 0;
-	for (auto const& data_type : this->key_profile) {
-		Value value = (*key)[col_num];
+	std::string encoded = BTreeKey::encode(*key);
+	if (encoded.size() > DB_BLOCK_SZ)
+		throw DbRelationError("index key too big to marshal");
+	char *bytes = new char[encoded.size()];
+	memcpy(bytes, encoded.data(), encoded.size());
+	return new Dbt(bytes, (u_int32_t)encoded.size());
+}
 
-		if (data_type == ColumnAttribute::DataType::INT) {
-			if (offset + 4 > DB_BLOCK_SZ - 4)
-				throw DbRelationError("index key too big to marshal");
 
-			*(int32_t*)(bytes + offset) = value.n;
-			offset += sizeof(int32_t);
+/******************************
+ * BTreeStat statistics block *
+ ******************************/
 
-		}
-		else if (data_type == ColumnAttribute::DataType::TEXT) {
-			u_long size = (uint16_t)value.s.length();
-			if (size > UINT16_MAX)
-				throw DbRelationError("text field too long to marshal");
-			if (offset + 2 + size > DB_BLOCK_SZ)
-				throw DbRelationError("index key too big to marshal");
+BTreeStat::BTreeStat(HeapFile &file, BlockID stat_id, BlockID new_root, const KeyProfile& key_profile)
+	: BTreeNode(file, stat_id, key_profile, false), root_id(new_root), height(1), bloom_first(0), bloom_blocks(0) {
+	save();
+}
 
-			*(uint16_t*)(bytes + offset) = (uint16_t)size;
-			offset += sizeof(uint16_t);
-			memcpy(bytes + offset, value.s.c_str(), size); // assume ascii for now
-			offset += size;
+// Indices from before the Bloom filter was added just don't have one.
+BTreeStat::BTreeStat(HeapFile &file, BlockID stat_id, const KeyProfile& key_profile)
+	: BTreeNode(file, stat_id, key_profile, false), root_id(get_block_id(ROOT)), height(get_block_id(HEIGHT)),
+	bloom_first(0), bloom_blocks(0) {
+	if (this->block->size() >= BLOOM_BLOCKS) {
+		this->bloom_first = get_block_id(BLOOM_FIRST);
+		this->bloom_blocks = get_block_id(BLOOM_BLOCKS);
+	}
+}
 
-		}
-		else if (data_type == ColumnAttribute::DataType::BOOLEAN) {
-			if (offset + 1 > DB_BLOCK_SZ - 1)
-				throw DbRelationError("index key too big to marshal");
+void BTreeStat::save() {
+	// height and bloom_blocks aren't really block IDs but they fit
+	BlockID values[] = { this->root_id, this->height, this->bloom_first, this->bloom_blocks };
+	for (RecordID record_id = ROOT; record_id <= BLOOM_BLOCKS; record_id++) {
+		Dbt *dbt = marshal_block_id(values[record_id - ROOT]);
+		if (record_id > this->block->size())
+			this->block->add(dbt);
+		else
+			this->block->put(record_id, *dbt);
+		delete[](char*)dbt->get_data();
+		delete dbt;
+	}
 
-			*(uint8_t*)(bytes + offset) = (uint8_t)value.n;
-			offset += sizeof(uint8_t);
+	BTreeNode::save();
+}
 
-		}
-		else {
-			throw DbRelationError("only know how to marshal INT, TEXT, or BOOLEAN for BTree index");
-		}
+
+/**************
+ * BTreeBloom *
+ **************/
+
+BTreeBloom::BTreeBloom(HeapFile &file) : file(file), block_ids(), bits(), ones() {
+}
+
+// Make a new, empty filter sized for twice as many keys as we have now (and no smaller than the one we had).
+// It goes in the blocks of the filter we had, if any, and new blocks at the end of the file for the rest.
+void BTreeBloom::create(u_long keys) {
+	uint blocks = (uint)((2 * keys + KEYS_PER_BLOCK - 1) / KEYS_PER_BLOCK);
+	if (blocks < this->block_ids.size())
+		blocks = (uint)this->block_ids.size();
+	if (blocks == 0)
+		blocks = 1;
+	std::vector<BlockID> block_ids = this->block_ids;
+	clear();
+	this->bits.assign(blocks, std::string(BYTES, '\0'));
+	this->ones.assign(blocks, 0);
+	while (block_ids.size() < blocks) {
+		// filter bytes, then the link to the next block
+		SlottedPage *page = this->file.get_new();
+		block_ids.push_back(page->get_block_id());
+		Dbt dbt((void *)this->bits[0].data(), BYTES);
+		page->add(&dbt);
+		BlockID next = 0;
+		Dbt link(&next, sizeof(next));
+		page->add(&link);
+		this->file.put(page);
+		delete page;
 	}
-	char *right_size_bytes = new char[offset];
-	memcpy(right_size_bytes, bytes, offset);
-	delete[] bytes;
-	Dbt *data = new Dbt(right_size_bytes, offset);
-	return data;
+	this->block_ids = block_ids;
+	save();
 }
 
+// Read the filter in from its blocks, following the links from first.
+void BTreeBloom::load(BlockID first, uint blocks) {
+	clear();
+	BlockID block_id = first;
+	for (uint i = 0; i < blocks; i++) {
+		SlottedPage *page = this->file.get(block_id);
+		this->block_ids.push_back(block_id);
+		Dbt *dbt = page->get(1);
+		std::string block((char *)dbt->get_data(), BYTES);
+		delete dbt;
+		dbt = page->get(2);
+		block_id = *(BlockID *)dbt->get_data();
+		delete dbt;
+		delete page;
+		uint set = 0;
+		for (unsigned char byte : block)
+			for (; byte != 0; byte &= byte - 1)
+				set++;
+		this->bits.push_back(block);
+		this->ones.push_back(set);
+	}
+}
 
-/******************************
- * BTreeStat statistics block *
- ******************************/
+// Forget the filter (lookups go back to always descending).
+void BTreeBloom::clear() {
+	this->block_ids.clear();
+	this->bits.clear();
+	this->ones.clear();
+}
 
-BTreeStat::BTreeStat(HeapFile &file, BlockID stat_id, BlockID new_root, const KeyProfile& key_profile)
-	: BTreeNode(file, stat_id, key_profile, false), root_id(new_root), height(1) {
-	save();
+// Write out the whole filter.
+void BTreeBloom::save() {
+	for (uint i = 0; i < this->bits.size(); i++)
+		save(i);
 }
 
-BTreeStat::BTreeStat(HeapFile &file, BlockID stat_id, const KeyProfile& key_profile)
-	: BTreeNode(file, stat_id, key_profile, false), root_id(get_block_id(ROOT)), height(get_block_id(HEIGHT)) {
+// Write out one block of the filter (and its link to the next one).
+void BTreeBloom::save(uint block) {
+	SlottedPage *page = this->file.get(this->block_ids[block]);
+	Dbt dbt((void *)this->bits[block].data(), BYTES);
+	page->put(1, dbt);
+	BlockID next = block + 1 < this->block_ids.size() ? this->block_ids[block + 1] : 0;
+	Dbt link(&next, sizeof(next));
+	page->put(2, link);
+	this->file.put(page);
+	delete page;
 }
 
-void BTreeStat::save() {
-	Dbt *dbt = marshal_block_id(this->root_id);
-	bool is_new = (this->block->size() == 0);
-	if (is_new)
-		this->block->add(dbt);
-	else
-		this->block->put(ROOT, *dbt);
-	delete[](char*)dbt->get_data();
-	delete dbt;
+// FNV-1a, then mixed some more (MurmurHash3's finalizer) since the block and the bits all come from it.
+uint64_t BTreeBloom::hash(const std::string& key) {
+	uint64_t h = 14695981039346656037ULL;
+	for (unsigned char c : key) {
+		h ^= c;
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
 
-	dbt = marshal_block_id(this->height);  // not really a block ID but it fits
-	if (is_new)
-		this->block->add(dbt);
-	else
-		this->block->put(HEIGHT, *dbt);
-	delete[](char*)dbt->get_data();
-	delete dbt;
+// Set the key's bits (writing out their block if any were new). The filter is too full once any block has
+// half its bits set.
+bool BTreeBloom::add(const std::string& key, bool save) {
+	if (this->bits.empty())
+		return true;
+	uint64_t h = hash(key);
+	uint block = (uint)((h >> 32) % this->bits.size());
+	uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) * 2654435761U | 1;
+	std::string &bytes = this->bits[block];
+	bool changed = false;
+	for (uint i = 0; i < HASHES; i++) {
+		uint bit = (h1 + i * h2) % BITS;
+		char mask = (char)(1 << (bit % 8));
+		if ((bytes[bit / 8] & mask) == 0) {
+			bytes[bit / 8] |= mask;
+			this->ones[block]++;
+			changed = true;
+		}
+	}
+	if (changed && save)
+		this->save(block);
+	return this->ones[block] <= BITS / 2;
+}
 
-	BTreeNode::save();
+// Could the key be in the tree? False means definitely not.
+bool BTreeBloom::might_contain(const std::string& key) const {
+	if (this->bits.empty())
+		return true;
+	uint64_t h = hash(key);
+	uint block = (uint)((h >> 32) % this->bits.size());
+	uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) * 2654435761U | 1;
+	const std::string &bytes = this->bits[block];
+	for (uint i = 0; i < HASHES; i++) {
+		uint bit = (h1 + i * h2) % BITS;
+		if ((bytes[bit / 8] & (1 << (bit % 8))) == 0)
+			return false;
+	}
+	return true;
 }
 
 
@@ -185,13 +266,24 @@ void BTreeStat::save() {
  * BTreeInterior *
  *****************/
 
-BTreeInterior::BTreeInterior(HeapFile &file, BlockID block_id, const KeyProfile& key_profile, bool create)
-	: BTreeNode(file, block_id, key_profile, create), first(0), pointers(), boundaries() {
-	if (!create) {
+BTreeInterior::BTreeInterior(HeapFile &file, BlockID block_id, const KeyProfile& key_profile, bool create,
+	bool decode)
+	: BTreeNode(file, block_id, key_profile, create), first(0), pointers(), boundaries(), int_boundaries(),
+	encoded_boundaries() {
+	if (!create && decode) {
 		RecordIDs *record_id_list = this->block->ids();
+
+		// prefix shared by all the boundaries is the final record
+		Dbt *dbt = this->block->get((RecordID)record_id_list->size());
+		std::string prefix((char *)dbt->get_data(), dbt->get_size());
+		delete dbt;
+
 		RecordID i = 1;
 		for (auto const& record_id : *record_id_list) {
-			if (i == 1) {
+			if (i == record_id_list->size()) {
+				; // prefix, already done
+			}
+			else if (i == 1) {
 				// first pointer
 				this->first = get_block_id(i);
 			}
@@ -201,12 +293,15 @@ BTreeInterior::BTreeInterior(HeapFile &file, BlockID block_id, const KeyProfile&
 			}
 			else {
 				// key
-				KeyValue *key_value = get_key(i);
-				this->boundaries.push_back(key_value);
+				dbt = this->block->get(i);
+				std::string bytes = prefix + std::string((char *)dbt->get_data(), dbt->get_size());
+				delete dbt;
+				this->boundaries.push_back(new KeyValue(BTreeKey::decode(bytes, this->key_profile)));
 			}
 			i++;
 		}
 		delete record_id_list;
+		flatten_boundaries();
 	}
 }
 
@@ -218,35 +313,130 @@ BTreeInterior::~BTreeInterior() {
 
 // Get next block down in tree where key must be.
 BlockID BTreeInterior::find(const KeyValue* key) const {
-	if (key == nullptr)
-		return first;
-	BlockID down = this->pointers.back();  // last pointer is correct if we don't find an earlier boundary
-	for (uint i = 0; i < this->boundaries.size(); i++) {
-		KeyValue *boundary = this->boundaries[i];
-		if (*boundary > *key) {
-			if (i > 0)
-				down = this->pointers[i - 1];
-			else
-				down = this->first;
-			break;
+	return get_child(find_child(key));
+}
+
+// Get next block down in tree where key must be, without unmarshaling the whole node: binary search
+// the boundaries (records 2, 4, ...) for the first one greater than key and follow the pointer before it.
+// The boundaries are compared as bytes with the encoded key, the shared prefix just once up front.
+BlockID BTreeInterior::probe(const KeyValue* key) const {
+	uint n = (this->block->size() - 2U) / 2U;  // first pointer and the prefix aren't boundaries
+	Dbt *dbt = this->block->get((RecordID)(2 * n + 2));
+	std::string prefix((char *)dbt->get_data(), dbt->get_size());
+	delete dbt;
+
+	std::string k = BTreeKey::encode(*key);
+	uint lo = 0, hi = n;
+	int cmp = memcmp(prefix.data(), k.data(), std::min(prefix.size(), k.size()));
+	if (cmp > 0 || (cmp == 0 && k.size() < prefix.size()))
+		hi = 0;  // every boundary is greater than key
+	else if (cmp < 0)
+		lo = n;  // every boundary is less than key
+	while (lo < hi) {
+		uint mid = (lo + hi) / 2;
+		dbt = this->block->get((RecordID)(2 * mid + 2));
+		cmp = BTreeKey::compare(dbt->get_data(), dbt->get_size(), k.data() + prefix.size(), k.size() - prefix.size());
+		delete dbt;
+		if (cmp > 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return get_block_id((RecordID)(2 * lo + 1));
+}
+
+// Bytes the boundaries take up on the block: each one's suffix (records 2, 4, ...) plus the prefix they share.
+uint BTreeInterior::stored_boundary_bytes() const {
+	uint n = (this->block->size() - 2U) / 2U;
+	uint bytes = 0;
+	for (uint i = 0; i <= n; i++) {
+		Dbt *dbt = this->block->get((RecordID)(2 * i + 2));
+		bytes += dbt->get_size();
+		delete dbt;
+	}
+	return bytes;
+}
+
+// Get the position of the child where key must be.
+// This is the first boundary greater than key (or the last child if there isn't one), found by binary search.
+uint BTreeInterior::find_child(const KeyValue* key) const {
+	if (key == nullptr || this->boundaries.empty())
+		return 0;
+	if (this->int_boundaries.size() == this->boundaries.size() && (*key)[0].data_type == ColumnAttribute::INT) {
+		// the halving step is a conditional move rather than a branch, so there are no mispredictions
+		int32_t k = (*key)[0].n;
+		const int32_t *base = this->int_boundaries.data();
+		size_t n = this->int_boundaries.size();
+		while (n > 1) {
+			size_t half = n / 2;
+			base += (base[half] <= k) ? half : 0;
+			n -= half;
 		}
+		return (uint)(base - this->int_boundaries.data()) + (*base <= k);
 	}
-	return down;
+	std::string k = BTreeKey::encode(*key);
+	auto it = std::upper_bound(this->encoded_boundaries.begin(), this->encoded_boundaries.end(), k,
+		[](const std::string &a, const std::string &b) { return BTreeKey::compare(a, b) < 0; });
+	return (uint)(it - this->encoded_boundaries.begin());
 }
 
-// Save the pointers and boundaries in the correct order
+// Get the position of the last child that can hold a key starting with prefix (encoded): the one just before
+// the first boundary past every such key.
+uint BTreeInterior::find_last_child(const std::string& prefix) const {
+	uint lo = 0, hi = (uint)this->boundaries.size();
+	while (lo < hi) {
+		uint mid = (lo + hi) / 2;
+		std::string boundary = this->encoded_boundaries.empty() ? BTreeKey::encode(*this->boundaries[mid])
+			: this->encoded_boundaries[mid];
+		if (BTreeKey::compare_prefix(boundary, prefix) > 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+// Lay the boundaries out for find_child: flat in int_boundaries when the key is a single INT,
+// otherwise encoded in encoded_boundaries. Called whenever the boundaries are loaded or saved
+// (every change to them is followed by a save).
+void BTreeInterior::flatten_boundaries() {
+	this->int_boundaries.clear();
+	this->encoded_boundaries.clear();
+	if (this->key_profile.size() == 1 && this->key_profile[0] == ColumnAttribute::INT) {
+		for (auto const& boundary : this->boundaries)
+			this->int_boundaries.push_back((*boundary)[0].n);
+	}
+	else {
+		for (auto const& boundary : this->boundaries)
+			this->encoded_boundaries.push_back(BTreeKey::encode(*boundary));
+	}
+}
+
+// Save the pointers and boundaries in the correct order.
+// The bytes that all the boundaries start with are stored just once, as the final record.
 void BTreeInterior::save() {
+	flatten_boundaries();
+	std::vector<std::string> keys;
+	for (auto const& boundary : this->boundaries)
+		keys.push_back(BTreeKey::encode(*boundary));
+	size_t prefix_len = keys.empty() ? 0 : keys[0].size();
+	for (auto const& key : keys) {
+		size_t n = 0;
+		while (n < prefix_len && n < key.size() && key[n] == keys[0][n])
+			n++;
+		prefix_len = n;
+	}
+
 	Dbt *dbt;
 	this->block->clear();
 	dbt = marshal_block_id(this->first);
+	this->block->add(dbt);
 	delete[](char *) dbt->get_data();
 	delete dbt;
 	for (uint i = 0; i < this->boundaries.size(); i++) {
-		// key
-		dbt = marshal_key(this->boundaries[i]);
-		this->block->add(dbt);
-		delete[](char *) dbt->get_data();
-		delete dbt;
+		// key (without the shared prefix)
+		Dbt suffix((void *)(keys[i].data() + prefix_len), (u_int32_t)(keys[i].size() - prefix_len));
+		this->block->add(&suffix);
 
 		// boundary
 		dbt = marshal_block_id(this->pointers[i]);
@@ -254,48 +444,24 @@ void BTreeInterior::save() {
 		delete[](char *) dbt->get_data();
 		delete dbt;
 	}
+	Dbt prefix((void *)(keys.empty() ? "" : keys[0].data()), (u_int32_t)prefix_len);
+	this->block->add(&prefix);
 	BTreeNode::save();
 }
 
 // Insert boundary, block_id pair into block.
 Insertion BTreeInterior::insert(const KeyValue* boundary, BlockID block_id) {
-	Dbt *dbt;
-
-	bool inserted = false;
-	for (uint i = 0; i < this->boundaries.size(); i++) {
-		KeyValue *check = this->boundaries[i];
-		if (*boundary == *check) {
-			this->boundaries.insert(this->boundaries.begin() + i, new KeyValue(*boundary));
-			this->pointers.insert(this->pointers.begin() + i, block_id);
-			inserted = true;
-			break;
-		}
-	}
-	if (!inserted) {
-		// must go at the end
-		this->boundaries.push_back(new KeyValue(*boundary));
-		this->pointers.push_back(block_id);
-	}
-	dbt = marshal_block_id(block_id);
+	// goes just before the first boundary greater than it (or at the end)
+	uint i = find_child(boundary);
+	this->boundaries.insert(this->boundaries.begin() + i, new KeyValue(*boundary));
+	this->pointers.insert(this->pointers.begin() + i, block_id);
 	try {
-		// following is just a check for size (the save method will redo this in the right order)
-		this->block->add(dbt);
-		delete[](char *) dbt->get_data();
-		delete dbt;
-		dbt = marshal_key(boundary);
-		this->block->add(dbt);
-		delete[](char *) dbt->get_data();
-		delete dbt;
-
-		// that worked, so no need to split
+		// the shared prefix may have gotten shorter, so the only real check for size is to save
 		save();
 		return BTreeNode::insertion_none();
 
 	}
 	catch (DbBlockNoRoomError &e) {
-		delete[](char *) dbt->get_data();
-		delete dbt;
-
 		// too big, so split
 
 		// create the sister
@@ -324,6 +490,153 @@ Insertion BTreeInterior::insert(const KeyValue* boundary, BlockID block_id) {
 	}
 }
 
+// Replace the boundary to the left of child i.
+void BTreeInterior::set_boundary(uint i, const KeyValue& boundary) {
+	*this->boundaries[i - 1] = boundary;
+}
+
+// Remove child i (which must not be the first) along with the boundary to its left.
+void BTreeInterior::remove_child(uint i) {
+	delete this->boundaries[i - 1];
+	this->boundaries.erase(this->boundaries.begin() + (i - 1));
+	this->pointers.erase(this->pointers.begin() + (i - 1));
+}
+
+// Absorb the right sibling, pulling down the separator between us from the parent.
+// Returns false, leaving both nodes as they were, if it doesn't all fit in this block.
+bool BTreeInterior::merge(const KeyValue* separator, BTreeInterior *right) {
+	u_long n = this->boundaries.size();
+	this->boundaries.push_back(new KeyValue(*separator));
+	this->pointers.push_back(right->first);
+	for (u_long i = 0; i < right->boundaries.size(); i++) {
+		this->boundaries.push_back(new KeyValue(*right->boundaries[i]));
+		this->pointers.push_back(right->pointers[i]);
+	}
+	try {
+		save();
+		return true;
+	}
+	catch (DbBlockNoRoomError &e) {
+		for (u_long i = n; i < this->boundaries.size(); i++)
+			delete this->boundaries[i];
+		this->boundaries.erase(this->boundaries.begin() + n, this->boundaries.end());
+		this->pointers.erase(this->pointers.begin() + n, this->pointers.end());
+		save();
+		return false;
+	}
+}
+
+// Even out the entries between this node and its right sibling.
+// Returns the new separator for the parent.
+KeyValue BTreeInterior::redistribute(const KeyValue* separator, BTreeInterior *right) {
+	// line everything up as if it were one node
+	KeyValues keys(this->boundaries);
+	keys.push_back(new KeyValue(*separator));
+	keys.insert(keys.end(), right->boundaries.begin(), right->boundaries.end());
+	BlockPointers kids(1, this->first);
+	kids.insert(kids.end(), this->pointers.begin(), this->pointers.end());
+	kids.push_back(right->first);
+	kids.insert(kids.end(), right->pointers.begin(), right->pointers.end());
+
+	// the middle boundary moves up to the parent, like in a split
+	u_long split = keys.size() / 2;
+	KeyValue ret = *keys[split];
+	delete keys[split];
+	this->boundaries.assign(keys.begin(), keys.begin() + split);
+	this->pointers.assign(kids.begin() + 1, kids.begin() + split + 1);
+	right->first = kids[split + 1];
+	right->boundaries.assign(keys.begin() + split + 1, keys.end());
+	right->pointers.assign(kids.begin() + split + 2, kids.end());
+
+	right->save();
+	this->save();
+	return ret;
+}
+
+
+
+/************
+ * BTreeKey *
+ ************/
+
+// Encode the key so that byte order is key order: INT is big-endian with the sign bit flipped,
+// TEXT is the characters followed by a null (so a shorter string sorts before anything it is a prefix of),
+// and BOOLEAN is a single byte. A key with fewer columns sorts before all the keys it is a prefix of,
+// just like the KeyValue comparison.
+std::string BTreeKey::encode(const KeyValue& key) {
+	std::string bytes;
+	for (auto const& value : key) {
+		if (value.data_type == ColumnAttribute::DataType::INT) {
+			uint32_t u = (uint32_t)value.n ^ 0x80000000U;
+			bytes.push_back((char)(u >> 24));
+			bytes.push_back((char)(u >> 16));
+			bytes.push_back((char)(u >> 8));
+			bytes.push_back((char)u);
+		}
+		else if (value.data_type == ColumnAttribute::DataType::TEXT) {
+			bytes.append(value.s);  // assume ascii (no embedded nulls) for now
+			bytes.push_back('\0');
+		}
+		else if (value.data_type == ColumnAttribute::DataType::BOOLEAN) {
+			bytes.push_back((char)(uint8_t)value.n);
+		}
+		else {
+			throw DbRelationError("Only know how to encode INT, TEXT, or BOOLEAN");
+		}
+	}
+	return bytes;
+}
+
+// Turn the bytes from encode back into the key, given the data type of each column. The bytes may run out
+// before the columns do, as they do for an interior boundary cut down to the columns that tell its neighbors
+// apart; the key then has just the columns that are there.
+KeyValue BTreeKey::decode(const std::string& bytes, const KeyProfile& key_profile) {
+	KeyValue key;
+	size_t offset = 0;
+	for (auto const& data_type : key_profile) {
+		if (offset >= bytes.size())
+			break;
+		Value value;
+		value.data_type = data_type;
+		if (data_type == ColumnAttribute::DataType::INT) {
+			uint32_t u = 0;
+			for (int i = 0; i < 4; i++)
+				u = (u << 8) | (uint8_t)bytes[offset++];
+			value.n = (int32_t)(u ^ 0x80000000U);
+		}
+		else if (data_type == ColumnAttribute::DataType::TEXT) {
+			size_t end = bytes.find('\0', offset);
+			value.s = bytes.substr(offset, end - offset);
+			offset = end + 1;
+		}
+		else if (data_type == ColumnAttribute::DataType::BOOLEAN) {
+			value.n = (uint8_t)bytes[offset++];
+		}
+		else {
+			throw DbRelationError("Only know how to decode INT, TEXT, or BOOLEAN");
+		}
+		key.push_back(value);
+	}
+	return key;
+}
+
+// Compare two encoded keys: negative, zero, or positive like memcmp.
+int BTreeKey::compare(const std::string& a, const std::string& b) {
+	return compare(a.data(), a.size(), b.data(), b.size());
+}
+
+// The same for encoded keys that are just bytes, e.g. right on a block.
+int BTreeKey::compare(const void *a, size_t a_size, const void *b, size_t b_size) {
+	int cmp = memcmp(a, b, a_size < b_size ? a_size : b_size);
+	if (cmp != 0)
+		return cmp;
+	return a_size < b_size ? -1 : (a_size > b_size ? 1 : 0);
+}
+
+// Compare just as much of the encoded key as the encoded prefix has (a prefix may be fewer columns).
+int BTreeKey::compare_prefix(const std::string& key, const std::string& prefix) {
+	return memcmp(key.data(), prefix.data(), key.size() < prefix.size() ? key.size() : prefix.size());
+}
 
 
 /*************
@@ -331,7 +644,33 @@ Insertion BTreeInterior::insert(const KeyValue* boundary, BlockID block_id) {
  *************/
 
 BTreeLeafBase::BTreeLeafBase(HeapFile &file, BlockID block_id, const KeyProfile& key_profile, bool create)
-	: BTreeNode(file, block_id, key_profile, create), next_leaf(0), key_map() {
+	: BTreeNode(file, block_id, key_profile, create), next_leaf(0), prev_leaf(0), key_map(), loaded(create) {
+}
+
+// Unmarshal all the entries and the leaf links from the block.
+// (Subclasses call this from their constructors, once get_value is theirs.)
+void BTreeLeafBase::load() {
+	RecordIDs *record_id_list = this->block->ids();
+	RecordID i = 1;
+	for (auto const& record_id : *record_id_list) {
+		if (i == record_id_list->size()) {
+			// previous leaf block
+			this->prev_leaf = get_block_id(i);
+		}
+		else if (i == record_id_list->size() - 1) {
+			// next leaf block
+			this->next_leaf = get_block_id(i);
+		}
+		else if (i % 2 == 0) {
+			// record i-1: handle, record i: key
+			KeyValue *key_value = get_key(i);
+			this->key_map[*key_value] = get_value(i - 1);
+			delete key_value;
+		}
+		i++;
+	}
+	delete record_id_list;
+	this->loaded = true;
 }
 
 BTreeLeafBase::~BTreeLeafBase() {
@@ -342,8 +681,43 @@ BTreeLeafValue BTreeLeafBase::find_eq(const KeyValue* key) const {
 	return this->key_map.at(*key);
 }
 
-// Save the key_map and next_leaf data in the correct order
+// Find the value for key. If the entries haven't been unmarshaled, this works right on the block: the keys
+// are in order in the even-numbered records, so binary search them (as bytes, against the encoded key) and
+// unmarshal only the matching value.
+// Any ValueDict in value is a copy for the caller to delete.
+bool BTreeLeafBase::probe(const KeyValue* key, BTreeLeafValue &value) {
+	if (this->loaded) {
+		LeafMap::const_iterator entry = this->key_map.find(*key);
+		if (entry == this->key_map.end())
+			return false;
+		value = entry->second;
+		if (value.vd != nullptr)
+			value.vd = new ValueDict(*value.vd);
+		return true;
+	}
+	std::string k = BTreeKey::encode(*key);
+	uint lo = 0, hi = (this->block->size() - 2U) / 2U;  // last two records are the leaf links
+	while (lo < hi) {
+		uint mid = (lo + hi) / 2;
+		Dbt *dbt = this->block->get((RecordID)(2 * mid + 2));
+		int cmp = BTreeKey::compare(dbt->get_data(), dbt->get_size(), k.data(), k.size());
+		delete dbt;
+		if (cmp == 0) {
+			value = get_value((RecordID)(2 * mid + 1));
+			return true;
+		}
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return false;
+}
+
+// Save the key_map, next_leaf, and prev_leaf data in the correct order
 void BTreeLeafBase::save() {
+	if (!this->loaded)
+		throw DbRelationError("cannot save a leaf that was never loaded");
 	Dbt *dbt;
 	this->block->clear();
 	for (auto const& item : this->key_map) {
@@ -354,20 +728,36 @@ void BTreeLeafBase::save() {
 		delete dbt;
 
 		// key
-		dbt = marshal_key(&item.first);
+		dbt = marshal_key(&item.first.value);
 		this->block->add(dbt);
 		delete[](char *) dbt->get_data();
 		delete dbt;
 	}
-	// next leaf pointer is final record
+	// next and previous leaf pointers are the final two records
 	dbt = marshal_block_id(this->next_leaf);
 	this->block->add(dbt);
 	delete[](char *) dbt->get_data();
 	delete dbt;
+	dbt = marshal_block_id(this->prev_leaf);
+	this->block->add(dbt);
+	delete[](char *) dbt->get_data();
+	delete dbt;
 
 	BTreeNode::save();
 }
 
+// Point the given leaf's prev_leaf link somewhere else. Works right on the block, since we don't know
+// how to construct the leaf (and all we need is its final record).
+void BTreeLeafBase::set_prev_leaf(BlockID leaf_id, BlockID prev_leaf) {
+	SlottedPage *leaf_block = this->file.get(leaf_id);
+	Dbt *dbt = marshal_block_id(prev_leaf);
+	leaf_block->put(leaf_block->size(), *dbt);
+	this->file.put(leaf_block);
+	delete[](char *) dbt->get_data();
+	delete dbt;
+	delete leaf_block;
+}
+
 // Insert key, handle pair into block.
 Insertion BTreeLeafBase::insert(const KeyValue* key, BTreeLeafValue value) {
 	// check unique
@@ -399,10 +789,21 @@ Insertion BTreeLeafBase::insert(const KeyValue* key, BTreeLeafValue value) {
 	}
 }
 
+// Remove key from block.
+void BTreeLeafBase::del(const KeyValue* key, bool save) {
+	if (this->key_map.erase(*key) == 0)
+		throw DbRelationError("key to be deleted not found in index");
+	if (save)
+		this->save();
+}
+
 // too big, so split
 Insertion BTreeLeafBase::split(BTreeLeafBase *nleaf, const KeyValue *key, BTreeLeafValue value) {
 	// put the new sister to the right
 	nleaf->next_leaf = this->next_leaf;
+	nleaf->prev_leaf = this->id;
+	if (this->next_leaf != 0)
+		set_prev_leaf(this->next_leaf, nleaf->id);
 	this->next_leaf = nleaf->id;
 
 	// move half of the entries to the sister
@@ -411,20 +812,14 @@ Insertion BTreeLeafBase::split(BTreeLeafBase *nleaf, const KeyValue *key, BTreeL
 	u_long split = key_list.size() / 2;  // figure out how many to keep (the rest move to nleaf)
 	this->key_map.clear();               // empty my list
 	u_long i = 0;
-	KeyValue boundary;
 	for (auto const& item : key_list) {
-		if (i < split) {
+		if (i < split)
 			this->key_map[item.first] = item.second;
-		}
-		else if (i == split) {
-			boundary = item.first;
-			nleaf->key_map[boundary] = item.second;
-		}
-		else {
+		else
 			nleaf->key_map[item.first] = item.second;
-		}
 		i++;
 	}
+	KeyValue boundary = separator(this->key_map.rbegin()->first.value, nleaf->key_map.begin()->first.value);
 
 	nleaf->save();
 	this->save();
@@ -432,26 +827,78 @@ Insertion BTreeLeafBase::split(BTreeLeafBase *nleaf, const KeyValue *key, BTreeL
 
 }
 
+// Absorb all the entries of the right sibling and take over its next_leaf link.
+// Returns false, leaving both leaves as they were, if they don't all fit in this block.
+bool BTreeLeafBase::merge(BTreeLeafBase *right) {
+	LeafMap key_list = this->key_map;    // keep a copy in case it doesn't fit
+	BlockID next_leaf = this->next_leaf;
+	this->key_map.insert(right->key_map.begin(), right->key_map.end());
+	this->next_leaf = right->next_leaf;
+	try {
+		save();
+	}
+	catch (DbBlockNoRoomError &e) {
+		this->key_map = key_list;
+		this->next_leaf = next_leaf;
+		save();
+		return false;
+	}
+	right->key_map.clear();  // the entries belong to me now
+	if (this->next_leaf != 0)
+		set_prev_leaf(this->next_leaf, this->id);
+	return true;
+}
 
-BTreeLeafIndex::BTreeLeafIndex(HeapFile &file, BlockID block_id, const KeyProfile& key_profile, bool create)
-	: BTreeLeafBase(file, block_id, key_profile, create) {
-	if (!create) {
-		RecordIDs *record_id_list = this->block->ids();
-		RecordID i = 1;
-		for (auto const& record_id : *record_id_list) {
-			if (i == record_id_list->size()) {
-				// next leaf block
-				this->next_leaf = get_block_id(i);
-			}
-			else if (i % 2 == 0) {
-				// record i-1: handle, record i: key
-				KeyValue *key_value = get_key(i);
-				this->key_map[*key_value] = get_value(i - 1);
+// Even out the entries between this leaf and its right sibling.
+// Returns the new boundary for the parent.
+KeyValue BTreeLeafBase::redistribute(BTreeLeafBase *right) {
+	auto key_list = this->key_map;
+	key_list.insert(right->key_map.begin(), right->key_map.end());
+	u_long split = key_list.size() / 2;
+	this->key_map.clear();
+	right->key_map.clear();
+	u_long i = 0;
+	for (auto const& item : key_list) {
+		if (i < split)
+			this->key_map[item.first] = item.second;
+		else
+			right->key_map[item.first] = item.second;
+		i++;
+	}
+
+	right->save();
+	this->save();
+	return separator(this->key_map.rbegin()->first.value, right->key_map.begin()->first.value);
+}
+
+// Shortest boundary that is greater than left and no greater than right (assumes left < right).
+// Columns past the first one that differs are dropped, and if that column is TEXT it is cut down
+// to just enough characters to tell the two apart.
+KeyValue BTreeLeafBase::separator(const KeyValue& left, const KeyValue& right) {
+	KeyValue boundary;
+	for (uint i = 0; i < right.size(); i++) {
+		Value value = right[i];
+		if (left[i] != value) {
+			if (value.data_type == ColumnAttribute::DataType::TEXT && left[i].data_type == value.data_type) {
+				size_t n = 0;
+				while (n < left[i].s.size() && left[i].s[n] == value.s[n])
+					n++;
+				value.s = value.s.substr(0, n + 1);
 			}
-			i++;
+			boundary.push_back(value);
+			break;
 		}
-		delete record_id_list;
+		boundary.push_back(value);
 	}
+	return boundary;
+}
+
+
+BTreeLeafIndex::BTreeLeafIndex(HeapFile &file, BlockID block_id, const KeyProfile& key_profile, bool create,
+	bool decode)
+	: BTreeLeafBase(file, block_id, key_profile, create) {
+	if (!create && decode)
+		load();
 }
 
 BTreeLeafIndex::~BTreeLeafIndex() {
@@ -468,27 +915,13 @@ Dbt *BTreeLeafIndex::marshal_value(BTreeLeafValue value) {
 
 BTreeLeafFile::BTreeLeafFile(HeapFile &file, BlockID block_id, const KeyProfile& key_profile,
 	ColumnNames non_indexed_column_names, ColumnAttributes column_attributes,
-	bool create)
+	bool create, bool with_handle, bool decode)
 	: BTreeLeafBase(file, block_id, key_profile, create),
 	column_names(non_indexed_column_names),
-	column_attributes(column_attributes) {
-	if (!create) {
-		RecordIDs *record_id_list = this->block->ids();
-		RecordID i = 1;
-		for (auto const& record_id : *record_id_list) {
-			if (i == record_id_list->size()) {
-				// next leaf block
-				this->next_leaf = get_block_id(i);
-			}
-			else if (i % 2 == 0) {
-				// record i-1: handle, record i: key
-				KeyValue *key_value = get_key(i);
-				this->key_map[*key_value] = get_value(i - 1);
-			}
-			i++;
-		}
-		delete record_id_list;
-	}
+	column_attributes(column_attributes),
+	with_handle(with_handle) {
+	if (!create && decode)
+		load();
 }
 
 BTreeLeafFile::~BTreeLeafFile() {
@@ -501,8 +934,14 @@ BTreeLeafValue BTreeLeafFile::get_value(RecordID record_id) {
 	char *bytes = (char*)dbt->get_data();
 	ValueDict *row = new ValueDict();
 	Value value;
+	Handle handle;
 	uint offset = 0;
 	uint col_num = 0;
+	if (this->with_handle) {
+		handle.block_id = *(BlockID *)bytes;
+		handle.record_id = *(RecordID *)(bytes + sizeof(BlockID));
+		offset += sizeof(BlockID) + sizeof(RecordID);
+	}
 	for (auto const& cn : this->column_names) {
 		ColumnAttribute ca = this->column_attributes[col_num++];
 		value.data_type = ca.get_data_type();
@@ -529,7 +968,7 @@ BTreeLeafValue BTreeLeafFile::get_value(RecordID record_id) {
 		(*row)[cn] = value;
 	}
 	delete dbt;
-	return BTreeLeafValue(row);
+	return BTreeLeafValue(handle, row);
 }
 
 Dbt *BTreeLeafFile::marshal_value(BTreeLeafValue btvalue) {
@@ -538,6 +977,11 @@ Dbt *BTreeLeafFile::marshal_value(BTreeLeafValue btvalue) {
 	ValueDict *row = btvalue.vd;
 	uint offset = 0;
 	uint col_num = 0;
+	if (this->with_handle) {
+		*(BlockID *)bytes = btvalue.h.block_id;
+		*(RecordID *)(bytes + sizeof(BlockID)) = btvalue.h.record_id;
+		offset += sizeof(BlockID) + sizeof(RecordID);
+	}
 	for (auto const& column_name : this->column_names) {
 		ColumnAttribute ca = this->column_attributes[col_num++];
 		ValueDict::const_iterator column = row->find(column_name);
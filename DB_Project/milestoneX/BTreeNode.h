@@ -18,6 +18,7 @@ public:
     static Insertion insertion_none() { return Insertion(0, KeyValue()); }
 
     virtual void save();
+    virtual bool is_underfull() const;
 
     BlockID get_id() const { return this->id; }
 
@@ -41,6 +42,8 @@ class BTreeStat : public BTreeNode {
 public:
     static const RecordID ROOT = 1;  // where we store the root id in the stat block
     static const RecordID HEIGHT = ROOT + 1;  // where we store the height in the stat block
+    static const RecordID BLOOM_FIRST = HEIGHT + 1;  // first block of the Bloom filter (if any)
+    static const RecordID BLOOM_BLOCKS = BLOOM_FIRST + 1;  // how many blocks it has (0 for none)
 
     BTreeStat(HeapFile &file, BlockID stat_id, BlockID new_root, const KeyProfile& key_profile);
     BTreeStat(HeapFile &file, BlockID stat_id, const KeyProfile& key_profile);
@@ -52,29 +55,88 @@ public:
     void set_root_id(BlockID root_id) { this->root_id = root_id; }
     uint get_height() const { return this->height; }
     void set_height(uint height) { this->height = height; }
+    BlockID get_bloom_first() const { return this->bloom_first; }
+    uint get_bloom_blocks() const { return this->bloom_blocks; }
+    void set_bloom(BlockID first, uint blocks) { this->bloom_first = first; this->bloom_blocks = blocks; }
 
 protected:
     BlockID root_id;
     uint height;
+    BlockID bloom_first;
+    uint bloom_blocks;
 
 };
 
 
+// Bloom filter over the keys of a B-tree, so lookups of keys that aren't there can mostly skip the descent.
+// It is blocked: all of a key's bits are in one block, so adding a key rewrites at most one block. Each block
+// of the index file that holds part of the filter links to the next one (BTreeStat has the first), and the whole
+// filter is kept in memory while open. Deleted keys stay in the filter; they only cost a wasted descent.
+class BTreeBloom {
+public:
+    static const uint BYTES = 4000;  // filter bytes per block
+    static const uint BITS = BYTES * 8;
+    static const uint HASHES = 7;
+    static const uint KEYS_PER_BLOCK = BITS / 10;  // 10 bits per key is about 1% false positives
+
+    BTreeBloom(HeapFile &file);
+
+    void create(u_long keys);  // new, empty filter with room for twice this many keys, in the old one's blocks
+    void load(BlockID first, uint blocks);
+    void clear();  // forget it (in memory only)
+    void save();  // write out every block
+
+    bool add(const std::string& key, bool save = true);  // returns false once the filter is too full to be much use
+    bool might_contain(const std::string& key) const;  // always true if there is no filter
+
+    BlockID get_first() const { return this->block_ids.empty() ? 0 : this->block_ids[0]; }
+    uint get_blocks() const { return (uint)this->block_ids.size(); }
+
+protected:
+    HeapFile &file;
+    std::vector<BlockID> block_ids;  // the blocks the filter is in, in order
+    std::vector<std::string> bits;  // each block's filter bytes
+    std::vector<uint> ones;  // how many bits are set in each block
+
+    static uint64_t hash(const std::string& key);
+    void save(uint block);
+};
+
+
 class BTreeInterior : public BTreeNode {
 public:
-    BTreeInterior(HeapFile &file, BlockID block_id, const KeyProfile& key_profile, bool create);
+    // decode=false leaves the boundaries on the block (good only for probe)
+    BTreeInterior(HeapFile &file, BlockID block_id, const KeyProfile& key_profile, bool create,
+                  bool decode = true);
     virtual ~BTreeInterior();
 
     BlockID find(const KeyValue* key) const;
+    BlockID probe(const KeyValue* key) const;  // same as find, but right off the block
     Insertion insert(const KeyValue* boundary, BlockID block_id);
     virtual void save();
 
+    // children are numbered 0 (first) through child_count()-1; boundary i separates child i-1 from child i
+    uint find_child(const KeyValue* key) const;
+    uint find_last_child(const std::string& prefix) const;  // last child that can hold a key starting with prefix
+    uint child_count() const { return (uint)this->pointers.size() + 1; }
+    BlockID get_child(uint i) const { return i == 0 ? this->first : this->pointers[i - 1]; }
+    const KeyValue* get_boundary(uint i) const { return this->boundaries[i - 1]; }
+    void set_boundary(uint i, const KeyValue& boundary);
+    void remove_child(uint i);
+    bool merge(const KeyValue* separator, BTreeInterior *right);
+    KeyValue redistribute(const KeyValue* separator, BTreeInterior *right);
+
     void set_first(BlockID first) { this->first = first; }
+    uint stored_boundary_bytes() const;  // bytes the boundaries take up on the block, shared prefix included
 
 protected:
     BlockID first;
     BlockPointers pointers;
     KeyValues boundaries;
+    std::vector<int32_t> int_boundaries;  // copy of boundaries laid out flat for find, when the key is one INT
+    std::vector<std::string> encoded_boundaries;  // otherwise, copy of boundaries as BTreeKey::encode bytes
+
+    void flatten_boundaries();
 };
 
 
@@ -86,11 +148,35 @@ public:
     BTreeLeafValue() : h(0,0), vd(nullptr) {}
     BTreeLeafValue(Handle h) : h(h), vd(nullptr) {}
     BTreeLeafValue(ValueDict *vd) : h(0,0), vd(vd) {}
+    BTreeLeafValue(Handle h, ValueDict *vd) : h(h), vd(vd) {}
     ~BTreeLeafValue() {}
 };
 
 
-typedef std::map<KeyValue,BTreeLeafValue> LeafMap;
+// A key along with its order-preserving encoding, so that comparing two keys is a single memcmp
+// of the bytes however many columns (and whatever types) the key has.
+class BTreeKey {
+public:
+    KeyValue value;
+    std::string bytes;
+
+    BTreeKey() : value(), bytes() {}
+    BTreeKey(const KeyValue& value) : value(value), bytes(encode(value)) {}
+
+    bool operator<(const BTreeKey& other) const { return compare(this->bytes, other.bytes) < 0; }
+    bool operator==(const BTreeKey& other) const { return compare(this->bytes, other.bytes) == 0; }
+
+    static std::string encode(const KeyValue& key);
+    static KeyValue decode(const std::string& bytes, const KeyProfile& key_profile);
+    static int compare(const std::string& a, const std::string& b);
+    static int compare(const void *a, size_t a_size, const void *b, size_t b_size);
+    // compare just as much of key as prefix has, so every key that starts with prefix compares equal
+    static int compare_prefix(const std::string& key, const std::string& prefix);
+};
+
+
+typedef std::map<BTreeKey,BTreeLeafValue> LeafMap;
+typedef std::vector<BTreeKey> BTreeKeys;
 
 class BTreeLeafBase : public BTreeNode {
 public:
@@ -98,16 +184,28 @@ public:
     virtual ~BTreeLeafBase();
 
     BTreeLeafValue find_eq(const KeyValue* key) const;  // throws if not found
+    bool probe(const KeyValue* key, BTreeLeafValue &value);  // works even if not loaded
     Insertion insert(const KeyValue* key, BTreeLeafValue value);
+    void del(const KeyValue* key, bool save = true);  // throws if not found
     virtual void save();
 
     virtual Insertion split(BTreeLeafBase *new_leaf, const KeyValue* key, BTreeLeafValue value);
+    virtual bool merge(BTreeLeafBase *right);
+    virtual KeyValue redistribute(BTreeLeafBase *right);
     virtual LeafMap& get_key_map() { return this->key_map; }
     virtual BlockID get_next_leaf() const { return this->next_leaf; }
+    virtual BlockID get_prev_leaf() const { return this->prev_leaf; }
 
 protected:
     BlockID next_leaf;
+    BlockID prev_leaf;
     LeafMap key_map;
+    bool loaded;  // have the entries been unmarshaled into key_map?
+
+    void load();
+    void set_prev_leaf(BlockID leaf_id, BlockID prev_leaf);
+
+    static KeyValue separator(const KeyValue& left, const KeyValue& right);
 
     virtual BTreeLeafValue get_value(RecordID record_id) = 0;
     virtual Dbt *marshal_value(BTreeLeafValue value) = 0;
@@ -116,7 +214,9 @@ protected:
 
 class BTreeLeafIndex : public BTreeLeafBase {
 public:
-    BTreeLeafIndex(HeapFile &file, BlockID block_id, const KeyProfile& key_profile, bool create);
+    // decode=false leaves the entries on the block (good only for probe)
+    BTreeLeafIndex(HeapFile &file, BlockID block_id, const KeyProfile& key_profile, bool create,
+                   bool decode = true);
     virtual ~BTreeLeafIndex();
 
 protected:
@@ -132,12 +232,15 @@ public:
                   const KeyProfile& key_profile,
                   ColumnNames non_indexed_column_names,
                   ColumnAttributes column_attributes,
-                  bool create);
+                  bool create,
+                  bool with_handle = false,  // with_handle: also keep a row handle (for covering indices)
+                  bool decode = true);  // decode=false leaves the entries on the block (good only for probe)
     virtual ~BTreeLeafFile();
 
 protected:
     ColumnNames column_names;
     ColumnAttributes column_attributes;
+    bool with_handle;
 
     virtual BTreeLeafValue get_value(RecordID record_id);
     virtual Dbt *marshal_value(BTreeLeafValue value);
@@ -0,0 +1,475 @@
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include "EvalExpr.h"
+
+bool EvalExpr::specialize = true;
+
+static std::string type_name(ColumnAttribute::DataType data_type) {
+    switch (data_type) {
+        case ColumnAttribute::INT:
+            return "INT";
+        case ColumnAttribute::TEXT:
+            return "TEXT";
+        default:
+            return "BOOLEAN";
+    }
+}
+
+EvalExpr::EvalExpr(const Identifier &column, ColumnAttribute::DataType data_type)
+        : type(Column), op(EQ), data_type(data_type), column(column), value(), left(nullptr), right(nullptr),
+          third(nullptr) {
+}
+
+EvalExpr::EvalExpr(const Value &value)
+        : type(Literal), op(EQ), data_type(value.data_type), column(), value(value), left(nullptr), right(nullptr),
+          third(nullptr) {
+}
+
+EvalExpr::EvalExpr(Operator op, EvalExpr *left, EvalExpr *right)
+        : type(op <= GE ? Compare : Arithmetic), op(op), data_type(ColumnAttribute::BOOLEAN), column(), value(),
+          left(left), right(right), third(nullptr) {
+    check();
+}
+
+EvalExpr::EvalExpr(ExprType type, EvalExpr *left, EvalExpr *right)
+        : type(type), op(EQ), data_type(ColumnAttribute::BOOLEAN), column(), value(), left(left), right(right),
+          third(nullptr) {
+    check();
+}
+
+EvalExpr::EvalExpr(EvalExpr *expr, EvalExpr *low, EvalExpr *high)
+        : type(Between), op(EQ), data_type(ColumnAttribute::BOOLEAN), column(), value(), left(expr), right(low),
+          third(high) {
+    check();
+}
+
+EvalExpr::EvalExpr(const EvalExpr *other)
+        : type(other->type), op(other->op), data_type(other->data_type), column(other->column), value(other->value),
+          left(other->left == nullptr ? nullptr : new EvalExpr(other->left)),
+          right(other->right == nullptr ? nullptr : new EvalExpr(other->right)),
+          third(other->third == nullptr ? nullptr : new EvalExpr(other->third)), kernel(other->kernel) {
+}
+
+EvalExpr::~EvalExpr() {
+    delete left;
+    delete right;
+    delete third;
+}
+
+// Work out the data type from the operands' (or complain if they don't fit the operator), then if the operands
+// are all literals, turn this into the literal it comes to. The operands are ours even if we throw.
+void EvalExpr::check() {
+    try {
+        switch (this->type) {
+            case Compare:
+            case Between:
+                if (this->left->data_type != this->right->data_type
+                    || (this->third != nullptr && this->third->data_type != this->left->data_type))
+                    throw DbRelationError("can't compare " + type_name(this->left->data_type) + " with "
+                                          + type_name(this->left->data_type != this->right->data_type
+                                                      ? this->right->data_type : this->third->data_type));
+                this->data_type = ColumnAttribute::BOOLEAN;
+                break;
+            case Arithmetic:
+            case Negate:
+                if (this->left->data_type != ColumnAttribute::INT
+                    || (this->right != nullptr && this->right->data_type != ColumnAttribute::INT))
+                    throw DbRelationError("arithmetic needs INT values");
+                this->data_type = ColumnAttribute::INT;
+                break;
+            case And:
+            case Or:
+            case Not:
+                if (this->left->data_type != ColumnAttribute::BOOLEAN
+                    || (this->right != nullptr && this->right->data_type != ColumnAttribute::BOOLEAN))
+                    throw DbRelationError("AND, OR and NOT need true or false values");
+                this->data_type = ColumnAttribute::BOOLEAN;
+                break;
+            default:
+                break;
+        }
+
+        for (auto const& operand : {this->left, this->right, this->third})
+            if (operand != nullptr && operand->type != Literal) {
+                pick_kernel();
+                return;
+            }
+        ValueDict none;
+        std::vector<Value> values;
+        evaluate(ValueDicts{&none}, values);
+        this->value = values[0];
+    } catch (...) {
+        delete this->left;
+        delete this->right;
+        delete this->third;
+        this->left = this->right = this->third = nullptr;
+        throw;
+    }
+    delete this->left;
+    delete this->right;
+    delete this->third;
+    this->left = this->right = this->third = nullptr;
+    this->type = Literal;
+}
+
+// The comparison that says the same thing with its operands swapped, e.g. a < b is b > a.
+static EvalExpr::Operator swapped(EvalExpr::Operator op) {
+    switch (op) {
+        case EvalExpr::LT:
+            return EvalExpr::GT;
+        case EvalExpr::LE:
+            return EvalExpr::GE;
+        case EvalExpr::GT:
+            return EvalExpr::LT;
+        case EvalExpr::GE:
+            return EvalExpr::LE;
+        default:
+            return op;
+    }
+}
+
+// The part of a Value that holds a T.
+template<typename T> static const T &payload(const Value &value);
+template<> inline const int32_t &payload<int32_t>(const Value &value) {
+    return value.n;
+}
+template<> inline const std::string &payload<std::string>(const Value &value) {
+    return value.s;
+}
+
+// The kernels: one loop over the batch each, with the operator and data type fixed by the instantiation.
+template<typename T, typename Compare>
+void EvalExpr::column_literal(const EvalExpr &expr, const ValueDicts &rows, std::vector<char> &matches) {
+    const Identifier &column = expr.left->column;
+    const T &literal = payload<T>(expr.right->value);
+    Compare compare;
+    matches.resize(rows.size());
+    for (u_long i = 0; i < rows.size(); i++)
+        matches[i] = compare(payload<T>(rows[i]->at(column)), literal);
+}
+
+template<typename T, typename Compare>
+void EvalExpr::column_column(const EvalExpr &expr, const ValueDicts &rows, std::vector<char> &matches) {
+    const Identifier &left_column = expr.left->column, &right_column = expr.right->column;
+    Compare compare;
+    matches.resize(rows.size());
+    for (u_long i = 0; i < rows.size(); i++)
+        matches[i] = compare(payload<T>(rows[i]->at(left_column)), payload<T>(rows[i]->at(right_column)));
+}
+
+template<typename T>
+void EvalExpr::column_between(const EvalExpr &expr, const ValueDicts &rows, std::vector<char> &matches) {
+    const Identifier &column = expr.left->column;
+    const T &low = payload<T>(expr.right->value), &high = payload<T>(expr.third->value);
+    matches.resize(rows.size());
+    for (u_long i = 0; i < rows.size(); i++) {
+        const T &value = payload<T>(rows[i]->at(column));
+        matches[i] = !(value < low) && !(high < value);
+    }
+}
+
+template<typename T>
+EvalExpr::Kernel EvalExpr::kernel_for(Operator op, bool with_column) {
+    switch (op) {
+        case EQ:
+            return with_column ? &column_column<T, std::equal_to<T>> : &column_literal<T, std::equal_to<T>>;
+        case NE:
+            return with_column ? &column_column<T, std::not_equal_to<T>> : &column_literal<T, std::not_equal_to<T>>;
+        case LT:
+            return with_column ? &column_column<T, std::less<T>> : &column_literal<T, std::less<T>>;
+        case LE:
+            return with_column ? &column_column<T, std::less_equal<T>> : &column_literal<T, std::less_equal<T>>;
+        case GT:
+            return with_column ? &column_column<T, std::greater<T>> : &column_literal<T, std::greater<T>>;
+        case GE:
+            return with_column ? &column_column<T, std::greater_equal<T>> : &column_literal<T, std::greater_equal<T>>;
+        default:
+            return nullptr;
+    }
+}
+
+// Pick the kernel for a comparison of a column with a literal or another column, or a column BETWEEN two
+// literals, if the column is INT or TEXT (BOOLEAN is left to the interpreter). A literal on the left is moved
+// to the right first, turning the comparison around.
+void EvalExpr::pick_kernel() {
+    this->kernel = nullptr;
+    if (!specialize)
+        return;
+    if (this->type == Compare && this->left->type == Literal && this->right->type == Column) {
+        std::swap(this->left, this->right);
+        this->op = swapped(this->op);
+    }
+    ColumnAttribute::DataType column_type = this->left->data_type;
+    if (this->left->type != Column || (column_type != ColumnAttribute::INT && column_type != ColumnAttribute::TEXT))
+        return;
+    if (this->type == Compare && (this->right->type == Literal || this->right->type == Column)) {
+        bool with_column = this->right->type == Column;
+        this->kernel = column_type == ColumnAttribute::INT ? kernel_for<int32_t>(this->op, with_column)
+                                                           : kernel_for<std::string>(this->op, with_column);
+    } else if (this->type == Between && this->right->type == Literal && this->third->type == Literal) {
+        this->kernel = column_type == ColumnAttribute::INT ? &column_between<int32_t> : &column_between<std::string>;
+    }
+}
+
+bool EvalExpr::compare(Operator op, const Value &a, const Value &b) {
+    switch (op) {
+        case EQ:
+            return a == b;
+        case NE:
+            return a != b;
+        case LT:
+            return a < b;
+        case LE:
+            return !(b < a);
+        case GT:
+            return b < a;
+        case GE:
+            return !(a < b);
+        default:
+            throw DbRelationError("not a comparison");
+    }
+}
+
+// INT arithmetic, done in 64 bits so we can tell when the answer doesn't fit back in an INT.
+Value EvalExpr::arithmetic(Operator op, const Value &a, const Value &b) {
+    int64_t x = a.n, y = b.n, n;
+    switch (op) {
+        case ADD:
+            n = x + y;
+            break;
+        case SUB:
+            n = x - y;
+            break;
+        case MUL:
+            n = x * y;
+            break;
+        case DIV:
+        case MOD:
+            if (y == 0)
+                throw DbRelationError("division by zero");
+            n = op == DIV ? x / y : x % y;
+            break;
+        default:
+            throw DbRelationError("not an arithmetic operator");
+    }
+    if (n < INT32_MIN || n > INT32_MAX)
+        throw DbRelationError("INT overflow");
+    return Value((int32_t) n);
+}
+
+void EvalExpr::evaluate(const ValueDicts &rows, std::vector<Value> &values) const {
+    values.clear();
+    values.reserve(rows.size());
+    if (this->kernel != nullptr || this->type == And || this->type == Or || this->type == Not) {
+        std::vector<char> matches;
+        test(rows, matches);
+        for (auto const& match : matches)
+            values.push_back(Value(match != 0));
+        return;
+    }
+    std::vector<Value> a, b, c;
+    switch (this->type) {
+        case Column:
+            for (auto const& row : rows)
+                values.push_back(row->at(this->column));
+            return;
+        case Literal:
+            values.assign(rows.size(), this->value);
+            return;
+        case Compare:
+            this->left->evaluate(rows, a);
+            this->right->evaluate(rows, b);
+            for (u_long i = 0; i < rows.size(); i++)
+                values.push_back(Value(compare(this->op, a[i], b[i])));
+            return;
+        case Arithmetic:
+            this->left->evaluate(rows, a);
+            this->right->evaluate(rows, b);
+            for (u_long i = 0; i < rows.size(); i++)
+                values.push_back(arithmetic(this->op, a[i], b[i]));
+            return;
+        case Negate:
+            this->left->evaluate(rows, a);
+            for (auto const& v : a)
+                values.push_back(arithmetic(SUB, Value(0), v));
+            return;
+        case Between:
+            this->left->evaluate(rows, a);
+            this->right->evaluate(rows, b);
+            this->third->evaluate(rows, c);
+            for (u_long i = 0; i < rows.size(); i++)
+                values.push_back(Value(!(a[i] < b[i]) && !(c[i] < a[i])));
+            return;
+        default:
+            return;  // And, Or and Not went to test above
+    }
+}
+
+void EvalExpr::test(const ValueDicts &rows, std::vector<char> &matches) const {
+    if (this->kernel != nullptr) {
+        this->kernel(*this, rows, matches);
+        return;
+    }
+    switch (this->type) {
+        case And:
+        case Or: {
+            // the right side only decides the rows where the left side is true (for AND) or false (for OR)
+            this->left->test(rows, matches);
+            char undecided_when = this->type == And ? 1 : 0;
+            ValueDicts undecided;
+            std::vector<u_long> positions;
+            for (u_long i = 0; i < rows.size(); i++)
+                if (matches[i] == undecided_when) {
+                    undecided.push_back(rows[i]);
+                    positions.push_back(i);
+                }
+            if (undecided.empty())
+                return;
+            std::vector<char> right_matches;
+            this->right->test(undecided, right_matches);
+            for (u_long i = 0; i < positions.size(); i++)
+                matches[positions[i]] = right_matches[i];
+            return;
+        }
+        case Not:
+            this->left->test(rows, matches);
+            for (auto &match : matches)
+                match = !match;
+            return;
+        default: {
+            std::vector<Value> values;
+            evaluate(rows, values);
+            matches.resize(rows.size());
+            for (u_long i = 0; i < rows.size(); i++)
+                matches[i] = values[i].n != 0;
+            return;
+        }
+    }
+}
+
+void EvalExpr::filter(ValueDicts &rows) const {
+    std::vector<char> matches;
+    test(rows, matches);
+    u_long kept = 0;
+    for (u_long i = 0; i < rows.size(); i++) {
+        if (matches[i])
+            rows[kept++] = rows[i];
+        else
+            delete rows[i];
+    }
+    rows.resize(kept);
+}
+
+void EvalExpr::columns(ColumnNames &column_names) const {
+    if (this->type == Column && std::find(column_names.begin(), column_names.end(), this->column) == column_names.end())
+        column_names.push_back(this->column);
+    for (auto const& operand : {this->left, this->right, this->third})
+        if (operand != nullptr)
+            operand->columns(column_names);
+}
+
+bool EvalExpr::is_equality(Identifier &column, Value &value) const {
+    if (this->type != Compare || this->op != EQ)
+        return false;
+    const EvalExpr *column_side = this->left->type == Column ? this->left : this->right;
+    const EvalExpr *literal_side = this->left->type == Column ? this->right : this->left;
+    if (column_side->type != Column || literal_side->type != Literal)
+        return false;
+    column = column_side->column;
+    value = literal_side->value;
+    return true;
+}
+
+void EvalExpr::bounds(ValueDict &min, ValueDict &max) const {
+    auto at_least = [&min](const Identifier &column, const Value &value) {
+        auto it = min.find(column);
+        if (it == min.end() || it->second < value)
+            min[column] = value;
+    };
+    auto at_most = [&max](const Identifier &column, const Value &value) {
+        auto it = max.find(column);
+        if (it == max.end() || value < it->second)
+            max[column] = value;
+    };
+
+    if (this->type == And) {
+        this->left->bounds(min, max);
+        this->right->bounds(min, max);
+    } else if (this->type == Between) {
+        if (this->left->type == Column && this->right->type == Literal)
+            at_least(this->left->column, this->right->value);
+        if (this->left->type == Column && this->third->type == Literal)
+            at_most(this->left->column, this->third->value);
+    } else if (this->type == Compare) {
+        // put it as column op literal
+        Operator op = this->op;
+        const EvalExpr *column_side = this->left, *literal_side = this->right;
+        if (this->left->type == Literal) {
+            std::swap(column_side, literal_side);
+            op = swapped(op);
+        }
+        if (column_side->type != Column || literal_side->type != Literal)
+            return;
+        if (op == EQ || op == GT || op == GE)
+            at_least(column_side->column, literal_side->value);
+        if (op == EQ || op == LT || op == LE)
+            at_most(column_side->column, literal_side->value);
+    }
+}
+
+// Time the common predicate shapes over a batch of rows, interpreted and then with their kernels.
+void benchmark_expressions() {
+    const uint ROWS = 1000, PASSES = 2000;
+    ValueDicts rows;
+    for (uint i = 0; i < ROWS; i++) {
+        ValueDict *row = new ValueDict();
+        (*row)["a"] = Value((int32_t)(rand() % 1000));
+        (*row)["b"] = Value((int32_t)(rand() % 1000));
+        (*row)["s"] = Value("name" + std::to_string(rand() % 100));
+        rows.push_back(row);
+    }
+    auto a = []() { return new EvalExpr("a", ColumnAttribute::INT); };
+    auto b = []() { return new EvalExpr("b", ColumnAttribute::INT); };
+    auto s = []() { return new EvalExpr("s", ColumnAttribute::TEXT); };
+    std::vector<std::pair<std::string, std::function<EvalExpr*()>>> shapes = {
+        {"a < 500", [&]() { return new EvalExpr(EvalExpr::LT, a(), new EvalExpr(Value(500))); }},
+        {"s = 'name42'", [&]() { return new EvalExpr(EvalExpr::EQ, s(), new EvalExpr(Value("name42"))); }},
+        {"a <= b", [&]() { return new EvalExpr(EvalExpr::LE, a(), b()); }},
+        {"a BETWEEN 100 AND 600", [&]() {
+            return new EvalExpr(a(), new EvalExpr(Value(100)), new EvalExpr(Value(600)));
+        }},
+        {"a < 500 AND s <> 'name7'", [&]() {
+            return new EvalExpr(EvalExpr::And, new EvalExpr(EvalExpr::LT, a(), new EvalExpr(Value(500))),
+                                new EvalExpr(EvalExpr::NE, s(), new EvalExpr(Value("name7"))));
+        }},
+        {"a > 900 OR b > 900", [&]() {
+            return new EvalExpr(EvalExpr::Or, new EvalExpr(EvalExpr::GT, a(), new EvalExpr(Value(900))),
+                                new EvalExpr(EvalExpr::GT, b(), new EvalExpr(Value(900))));
+        }},
+    };
+
+    for (auto const& shape : shapes) {
+        double ns[2];
+        u_long counts[2] = {0, 0};
+        for (int specialized = 0; specialized < 2; specialized++) {
+            EvalExpr::specialize = specialized != 0;
+            EvalExpr *expr = shape.second();
+            std::vector<char> matches;
+            auto start = std::chrono::steady_clock::now();
+            for (uint pass = 0; pass < PASSES; pass++) {
+                expr->test(rows, matches);
+                counts[specialized] += std::count(matches.begin(), matches.end(), 1);
+            }
+            auto end = std::chrono::steady_clock::now();
+            ns[specialized] = std::chrono::duration<double, std::nano>(end - start).count() / (ROWS * PASSES);
+            delete expr;
+        }
+        std::cout << shape.first << ": interpreted " << ns[0] << " ns/row, specialized " << ns[1] << " ns/row"
+                  << (counts[0] == counts[1] ? "" : " (MISMATCH)") << std::endl;
+    }
+    EvalExpr::specialize = true;
+    for (auto const& row : rows)
+        delete row;
+}
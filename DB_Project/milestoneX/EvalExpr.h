@@ -0,0 +1,78 @@
+#pragma once
+
+#include "storage_engine.h"
+
+
+// A compiled scalar expression over the columns of a row, type checked as it's built and evaluated a batch
+// of rows at a time, with specialized kernels for the common predicate shapes.
+class EvalExpr {
+public:
+    static bool specialize;  // pick kernels for the shapes that have them (false to time the plain interpreter)
+
+    enum ExprType {
+        Column,
+        Literal,
+        Compare,  // =, <>, <, <=, >, >=
+        Arithmetic,  // +, -, *, /, %
+        Negate,
+        And,
+        Or,
+        Not,
+        Between
+    };
+    enum Operator {
+        EQ, NE, LT, LE, GT, GE,
+        ADD, SUB, MUL, DIV, MOD
+    };
+
+    EvalExpr(const Identifier &column, ColumnAttribute::DataType data_type);  // use for Column
+    EvalExpr(const Value &value);  // use for Literal
+    EvalExpr(Operator op, EvalExpr *left, EvalExpr *right);  // use for Compare or Arithmetic
+    EvalExpr(ExprType type, EvalExpr *left, EvalExpr *right = nullptr);  // use for And, Or, Not or Negate
+    EvalExpr(EvalExpr *expr, EvalExpr *low, EvalExpr *high);  // use for Between (low and high inclusive)
+    EvalExpr(const EvalExpr *other);  // use for copying
+    virtual ~EvalExpr();
+
+    ExprType get_type() const { return this->type; }
+    ColumnAttribute::DataType get_data_type() const { return this->data_type; }
+
+    // values[i] = the expression's value for rows[i]
+    void evaluate(const ValueDicts &rows, std::vector<Value> &values) const;
+    // matches[i] = whether it's true for rows[i] (it must be true or false)
+    void test(const ValueDicts &rows, std::vector<char> &matches) const;
+    // keep just the rows it's true for (deleting the others)
+    void filter(ValueDicts &rows) const;
+
+    // the columns it looks at
+    void columns(ColumnNames &column_names) const;
+    // is it column = literal? if so, which and what
+    bool is_equality(Identifier &column, Value &value) const;
+    // Inclusive bounds it puts on columns, taken from comparisons of a column with a literal (and BETWEENs)
+    // ANDed together at the top: a row it's true for has each column at least min and at most max.
+    void bounds(ValueDict &min, ValueDict &max) const;
+
+protected:
+    ExprType type;
+    Operator op;
+    ColumnAttribute::DataType data_type;
+    Identifier column;  // for Column
+    Value value;  // for Literal
+    EvalExpr *left, *right, *third;  // operands (third is BETWEEN's high)
+
+    typedef void (*Kernel)(const EvalExpr &expr, const ValueDicts &rows, std::vector<char> &matches);
+    Kernel kernel = nullptr;  // specialized test for this shape, if it has one
+
+    void check();
+    void pick_kernel();
+    static bool compare(Operator op, const Value &a, const Value &b);
+    static Value arithmetic(Operator op, const Value &a, const Value &b);
+    template<typename T> static Kernel kernel_for(Operator op, bool with_column);
+    template<typename T, typename Compare>
+    static void column_literal(const EvalExpr &expr, const ValueDicts &rows, std::vector<char> &matches);
+    template<typename T, typename Compare>
+    static void column_column(const EvalExpr &expr, const ValueDicts &rows, std::vector<char> &matches);
+    template<typename T>
+    static void column_between(const EvalExpr &expr, const ValueDicts &rows, std::vector<char> &matches);
+};
+
+void benchmark_expressions();
@@ -2,7 +2,13 @@
 // Created by Kevin Lundeen on 4/24/17.
 //
 
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <dirent.h>
+#include <unistd.h>
 #include "EvalPlan.h"
+#include "BTreeNode.h"
 
 
 class Dummy : public DbRelation {
@@ -24,24 +30,79 @@ public:
     virtual ValueDict* project(Handle handle, const ColumnNames* column_names) {return nullptr;}
 };
 
+const uint EvalPlan::BATCH_SIZE = 100;
+u_long EvalPlan::join_memory = 16 * 1024 * 1024;
+const uint EvalPlan::PROBE_BATCH = 1000;
+u_long EvalPlan::aggregate_memory = 16 * 1024 * 1024;
+const uint EvalPlan::AGGREGATE_PARTITIONS = 16;
+const uint EvalPlan::MAX_JOIN_SPLITS = 3;
+u_long EvalPlan::sort_memory = 16 * 1024 * 1024;
+const double EvalPlan::INDEX_FETCH_COST = 4.0;
+const double EvalPlan::DEFAULT_ROWS = 1000.0;
+const double EvalPlan::DEFAULT_EQUAL_SELECTIVITY = 0.1;
+const double EvalPlan::DEFAULT_RANGE_SELECTIVITY = 1.0 / 3.0;
+
 EvalPlan::EvalPlan(PlanType type, EvalPlan *relation)
-        : type(type), relation(relation), projection(nullptr), select_conjunction(nullptr), table(Dummy::one()) {
+        : type(type), relation(relation), projection(nullptr), select_conjunction(nullptr), table(Dummy::one()),
+          indices(), index(nullptr) {
 }
 
 EvalPlan::EvalPlan(ColumnNames *projection, EvalPlan *relation)
-        : type(Project), relation(relation), projection(projection), select_conjunction(nullptr), table(Dummy::one()) {
+        : type(Project), relation(relation), projection(projection), select_conjunction(nullptr), table(Dummy::one()),
+          indices(), index(nullptr) {
 }
 
 EvalPlan::EvalPlan(ValueDict* conjunction, EvalPlan *relation)
-        : type(Select), relation(relation), projection(nullptr), select_conjunction(conjunction), table(Dummy::one()) {
+        : type(Select), relation(relation), projection(nullptr), select_conjunction(conjunction), table(Dummy::one()),
+          indices(), index(nullptr) {
+}
+
+EvalPlan::EvalPlan(ValueDict* conjunction, EvalExpr *filter, EvalPlan *relation)
+        : type(Select), relation(relation), projection(nullptr), select_conjunction(conjunction), filter(filter),
+          table(Dummy::one()), indices(), index(nullptr) {
 }
 
 EvalPlan::EvalPlan(DbRelation &table)
-        : type(TableScan), relation(nullptr), projection(nullptr), select_conjunction(nullptr), table(table) {
+        : type(TableScan), relation(nullptr), projection(nullptr), select_conjunction(nullptr), table(table),
+          indices(), index(nullptr) {
+}
+
+EvalPlan::EvalPlan(DbRelation &table, const DbIndexes &indices)
+        : type(TableScan), relation(nullptr), projection(nullptr), select_conjunction(nullptr), table(table),
+          indices(indices), index(nullptr) {
+}
+
+EvalPlan::EvalPlan(DbRelation &table, DbIndex &index, ValueDict* conjunction, EvalExpr *filter)
+        : type(IndexScan), relation(nullptr), projection(nullptr), select_conjunction(conjunction), filter(filter),
+          table(table), indices(), index(&index) {
+}
+
+EvalPlan::EvalPlan(DbIndex &index, ValueDict* conjunction)
+        : type(IndexOnlyScan), relation(nullptr), projection(nullptr), select_conjunction(conjunction),
+          table(Dummy::one()), indices(), index(&index) {
+}
+
+EvalPlan::EvalPlan(EvalPlan *left, Identifier left_alias, EvalPlan *right, Identifier right_alias,
+                   ColumnNames *left_keys, ColumnNames *right_keys, EvalExpr *filter)
+        : type(Join), relation(left), projection(nullptr), select_conjunction(nullptr), filter(filter),
+          table(Dummy::one()), indices(), index(nullptr), right(right), left_alias(left_alias),
+          right_alias(right_alias), left_keys(left_keys), right_keys(right_keys) {
+}
+
+EvalPlan::EvalPlan(ColumnNames *group_by, AggregateFunctions *aggregates, EvalPlan *relation)
+        : type(Aggregate), relation(relation), projection(group_by), select_conjunction(nullptr), table(Dummy::one()),
+          indices(), index(nullptr), aggregates(aggregates) {
+}
+
+EvalPlan::EvalPlan(ColumnNames *sort_by, std::vector<bool> *descending, long limit, long offset, EvalPlan *relation)
+        : type(Sort), relation(relation), projection(sort_by), select_conjunction(nullptr), table(Dummy::one()),
+          indices(), index(nullptr), descending(descending), limit(limit), offset(offset) {
 }
 
 EvalPlan::EvalPlan(const EvalPlan *other)
-        : type(other->type), table(other->table) {
+        : type(other->type), table(other->table), indices(other->indices), index(other->index),
+          left_alias(other->left_alias), right_alias(other->right_alias), limit(other->limit),
+          offset(other->offset), backward(other->backward) {
     if (other->relation != nullptr)
         relation = new EvalPlan(other->relation);
     else
@@ -54,41 +115,607 @@ EvalPlan::EvalPlan(const EvalPlan *other)
         select_conjunction = new ValueDict(*other->select_conjunction);
     else
         select_conjunction = nullptr;
+    if (other->filter != nullptr)
+        filter = new EvalExpr(other->filter);
+    if (other->right != nullptr)
+        right = new EvalPlan(other->right);
+    if (other->left_keys != nullptr)
+        left_keys = new ColumnNames(*other->left_keys);
+    if (other->right_keys != nullptr)
+        right_keys = new ColumnNames(*other->right_keys);
+    if (other->aggregates != nullptr)
+        aggregates = new AggregateFunctions(*other->aggregates);
+    if (other->descending != nullptr)
+        descending = new std::vector<bool>(*other->descending);
 }
 
 EvalPlan::~EvalPlan() {
     delete relation;
     delete projection;
     delete select_conjunction;
+    delete filter;
+    delete right;
+    delete left_keys;
+    delete right_keys;
+    delete aggregates;
+    delete descending;
 }
 
 
 EvalPlan *EvalPlan::optimize() {
+    if (this->type == Sort) {
+        EvalPlan *ret = new EvalPlan(new ColumnNames(*this->projection), new std::vector<bool>(*this->descending),
+                                     this->limit, this->offset, this->relation->optimize());
+        // an ORDER BY on the start of a BTREE table's key, all of it descending, reads the table backward
+        EvalPlan *scan = ret->ordered_scan();
+        if (scan != nullptr && !ret->projection->empty()
+            && std::find(ret->descending->begin(), ret->descending->end(), false) == ret->descending->end()) {
+            scan->backward = true;
+            scan->backward = ret->presorted();
+        }
+        return ret;
+    }
+    if (this->type == Aggregate)
+        return new EvalPlan(new ColumnNames(*this->projection), new AggregateFunctions(*this->aggregates),
+                            min_max_from_ends(nullptr) ? new EvalPlan(this->relation) : this->relation->optimize());
+    if ((this->type == ProjectAll || this->type == Project) && this->relation->is_join()) {
+        EvalPlan *ordered = this->relation->order_joins();
+        EvalPlan *join = ordered->optimize_join();
+        delete ordered;
+        if (this->type == ProjectAll)
+            return new EvalPlan(ProjectAll, join);
+        return new EvalPlan(new ColumnNames(*this->projection), join);
+    }
+    EvalPlan *index_only = optimize_index_only();
+    if (index_only != nullptr)
+        return index_only;
+    EvalPlan *index_scan = optimize_index_scan();
+    if (index_scan != nullptr)
+        return index_scan;
     return new EvalPlan(this);  // For now, we don't know how to do anything better
 }
 
+// Project(Select(TableScan)) or Project(TableScan) where one of the table's indices has every column we
+// need (projected or in the where clause) can be answered from the index alone, as long as a partial index
+// isn't missing any of the rows and the where clause is just column = literal. Returns nullptr if not.
+EvalPlan *EvalPlan::optimize_index_only() const {
+    if (this->type != ProjectAll && this->type != Project)
+        return nullptr;
+    const EvalPlan *scan = this->relation;
+    const ValueDict *where = nullptr;
+    if (scan->type == Select) {
+        if (scan->filter != nullptr)
+            return nullptr;
+        where = scan->select_conjunction;
+        scan = scan->relation;
+    }
+    if (scan->type != TableScan)
+        return nullptr;
+
+    ColumnNames projection = this->type == ProjectAll ? scan->table.get_column_names() : *this->projection;
+    ColumnNames needed = projection;
+    if (where != nullptr)
+        for (auto const& column : *where)
+            needed.push_back(column.first);
+    for (auto const& index : scan->indices)
+        if (index->covers(&needed) && index->applies_to(where))
+            return new EvalPlan(new ColumnNames(projection),
+                                new EvalPlan(*index, where == nullptr ? nullptr : new ValueDict(*where)));
+    return nullptr;
+}
+
+// Project(Select(TableScan)) whose where clause an index can answer becomes an IndexScan (or a range scan)
+// on the cheapest such index (by cost once the table is analyzed). Returns nullptr if none fits.
+EvalPlan *EvalPlan::optimize_index_scan() const {
+    if ((this->type != ProjectAll && this->type != Project) || this->relation->type != Select)
+        return nullptr;
+    const EvalPlan *select = this->relation;
+    const EvalPlan *scan = select->relation;
+    if (scan->type != TableScan)
+        return nullptr;
+    const ValueDict *where = select->select_conjunction;
+    ValueDict min, max;
+    if (select->filter != nullptr)
+        select->filter->bounds(min, max);
+
+    auto pins_down = [where](const ColumnNames &columns) {
+        for (auto const& column : columns)
+            if (where == nullptr || where->find(column) == where->end())
+                return false;
+        return true;
+    };
+    auto bounded = [where, &min, &max](const ColumnNames &columns) {
+        uint n = 0;
+        while (n < columns.size() && ((where != nullptr && where->find(columns[n]) != where->end())
+                                      || min.find(columns[n]) != min.end() || max.find(columns[n]) != max.end()))
+            n++;
+        return n;
+    };
+    // the leading columns a lookup or range scan on them would be narrowed to
+    auto scanned = [where, &bounded](const ColumnNames &columns) {
+        uint n = bounded(columns), pinned = 0;
+        while (pinned < n && where != nullptr && where->find(columns[pinned]) != where->end())
+            pinned++;
+        return ColumnNames(columns.begin(), columns.begin() + std::min(n, pinned + 1));
+    };
+    if (scan->table.has_primary_key() && pins_down(*scan->table.get_primary_key()))
+        return nullptr;
+    DbIndex *best = nullptr;
+    const TableStatistics *statistics = scan->table.get_statistics();
+    if (statistics != nullptr) {
+        double rows = statistics->row_count, best_cost = rows;
+        if (scan->table.has_primary_key())
+            best_cost = rows * selectivity(scan->table, where, min, max, scanned(*scan->table.get_primary_key()));
+        for (auto const& index : scan->indices) {
+            const ColumnNames &key = index->get_key_columns();
+            if (!index->applies_to(where) || !(pins_down(key) || (index->supports_range() && bounded(key) > 0)))
+                continue;
+            double cost = index->lookup_cost()
+                          + rows * selectivity(scan->table, where, min, max, scanned(key)) * INDEX_FETCH_COST;
+            if (cost < best_cost) {
+                best = index;
+                best_cost = cost;
+            }
+        }
+    } else {
+        uint best_cost = 0;
+        for (auto const& index : scan->indices) {
+            if (!pins_down(index->get_key_columns()) || !index->applies_to(where))
+                continue;
+            uint cost = index->lookup_cost();
+            if (best == nullptr || cost < best_cost
+                || (cost == best_cost && index->is_unique() && !best->is_unique())) {
+                best = index;
+                best_cost = cost;
+            }
+        }
+        if (best == nullptr) {
+            if (scan->table.has_primary_key() && bounded(*scan->table.get_primary_key()) > 0)
+                return nullptr;
+            uint best_bounded = 0;
+            for (auto const& index : scan->indices) {
+                uint n = bounded(index->get_key_columns());
+                if (n > best_bounded && index->supports_range() && index->applies_to(where)) {
+                    best = index;
+                    best_bounded = n;
+                }
+            }
+        }
+    }
+    if (best == nullptr)
+        return nullptr;
+    EvalPlan *lookup = new EvalPlan(scan->table, *best, new ValueDict(where == nullptr ? ValueDict() : *where),
+                                    select->filter == nullptr ? nullptr : new EvalExpr(select->filter));
+    if (this->type == ProjectAll)
+        return new EvalPlan(ProjectAll, lookup);
+    return new EvalPlan(new ColumnNames(*this->projection), lookup);
+}
+
+// Pick how to do a join. If both sides already come out in join key order, merge them. Otherwise, if the
+// right side is a table with an index (or a primary key) on the join columns, look up the matches for each
+// left row instead of hashing the whole table: an index nested-loop join (swapping the sides if only the
+// left one fits). Failing that, if one side is in order, sort the other and merge; if not, hash. Joins
+// further down the left side get the same treatment.
+EvalPlan *EvalPlan::optimize_join() const {
+    EvalPlan *left = this->left_alias.empty() ? this->relation->optimize_join() : new EvalPlan(this->relation);
+    EvalPlan *ret = new EvalPlan(left, this->left_alias, new EvalPlan(this->right), this->right_alias,
+                                 new ColumnNames(*this->left_keys), new ColumnNames(*this->right_keys),
+                                 this->filter == nullptr ? nullptr : new EvalExpr(this->filter));
+    if (ret->use_merge_join(false) || ret->use_index_join())
+        return ret;
+    if (!this->left_alias.empty()) {
+        std::swap(ret->relation, ret->right);
+        std::swap(ret->left_alias, ret->right_alias);
+        std::swap(ret->left_keys, ret->right_keys);
+        if (ret->use_index_join())
+            return ret;
+        std::swap(ret->relation, ret->right);
+        std::swap(ret->left_alias, ret->right_alias);
+        std::swap(ret->left_keys, ret->right_keys);
+    }
+    ret->use_merge_join(true);
+    return ret;
+}
+
+// Put the joined tables in the order that keeps the joins' results smallest, going by the tables' statistics:
+// start with the table expected to have the fewest rows (after its own conditions), then keep adding the table
+// tied to the ones so far by join columns that gives the fewest joined rows. The join columns and each join's
+// filter go to the first join that has all of their tables. If any of the tables hasn't been analyzed, they're
+// left in the order they're in. Returns a new plan either way.
+EvalPlan *EvalPlan::order_joins() const {
+    // take the joins apart into their sides, the pairs of columns they join on and their filters
+    std::vector<const EvalPlan*> sides;
+    std::vector<Identifier> aliases;
+    std::vector<std::pair<Identifier, Identifier>> keys;
+    std::vector<const EvalExpr*> filters;
+    for (const EvalPlan *join = this; ; join = join->relation) {
+        sides.insert(sides.begin(), join->right);
+        aliases.insert(aliases.begin(), join->right_alias);
+        for (uint i = 0; i < join->left_keys->size(); i++)
+            keys.push_back(std::make_pair((*join->left_keys)[i], (*join->right_keys)[i]));
+        if (join->filter != nullptr)
+            filters.push_back(join->filter);
+        if (!join->left_alias.empty()) {
+            sides.insert(sides.begin(), join->relation);
+            aliases.insert(aliases.begin(), join->left_alias);
+            break;
+        }
+    }
+    std::vector<double> rows;
+    for (auto const& side : sides) {
+        const EvalPlan *scan = side->type == Select ? side->relation : side;
+        if (scan->type != TableScan || scan->table.get_statistics() == nullptr)
+            return new EvalPlan(this);
+        rows.push_back(side->estimate_rows());
+    }
+
+    auto side_of = [&aliases](const Identifier &column) {
+        return (uint) (std::find(aliases.begin(), aliases.end(), column.substr(0, column.find('.')))
+                       - aliases.begin());
+    };
+    auto bare = [](const Identifier &column) { return column.substr(column.find('.') + 1); };
+    std::vector<bool> joined(sides.size(), false);
+    uint first = (uint) (std::min_element(rows.begin(), rows.end()) - rows.begin());
+    joined[first] = true;
+    EvalPlan *plan = new EvalPlan(sides[first]);
+    double plan_rows = rows[first];
+    std::vector<bool> placed(filters.size(), false);
+    for (uint step = 1; step < sides.size(); step++) {
+        uint next = (uint) sides.size();
+        bool next_tied = false;
+        double next_rows = 0.0;
+        for (uint i = 0; i < sides.size(); i++) {
+            if (joined[i])
+                continue;
+            bool tied = false;
+            double joined_rows = plan_rows * rows[i];
+            for (auto const& key : keys) {
+                uint left = side_of(key.first), right = side_of(key.second);
+                if ((left == i && joined[right]) || (right == i && joined[left])) {
+                    tied = true;
+                    joined_rows /= std::max(1.0, std::max(distinct_values(sides[left], bare(key.first)),
+                                                          distinct_values(sides[right], bare(key.second))));
+                }
+            }
+            if (next == sides.size() || (tied && !next_tied) || (tied == next_tied && joined_rows < next_rows)) {
+                next = i;
+                next_tied = tied;
+                next_rows = joined_rows;
+            }
+        }
+
+        ColumnNames *left_keys = new ColumnNames(), *right_keys = new ColumnNames();
+        for (auto const& key : keys) {
+            uint left = side_of(key.first), right = side_of(key.second);
+            if (left == next && joined[right]) {
+                left_keys->push_back(key.second);
+                right_keys->push_back(key.first);
+            } else if (right == next && joined[left]) {
+                left_keys->push_back(key.first);
+                right_keys->push_back(key.second);
+            }
+        }
+        joined[next] = true;
+        EvalExpr *filter = nullptr;
+        for (uint i = 0; i < filters.size(); i++) {
+            ColumnNames columns;
+            filters[i]->columns(columns);
+            bool ready = !placed[i];
+            for (auto const& column : columns)
+                ready = ready && joined[side_of(column)];
+            if (ready) {
+                placed[i] = true;
+                filter = filter == nullptr ? new EvalExpr(filters[i])
+                                           : new EvalExpr(EvalExpr::And, filter, new EvalExpr(filters[i]));
+            }
+        }
+        plan = new EvalPlan(plan, step == 1 ? aliases[first] : "", new EvalPlan(sides[next]), aliases[next],
+                            left_keys, right_keys, filter);
+        plan_rows = next_rows;
+    }
+    return plan;
+}
+
+// Make this Join a MergeJoin if both sides (or, with either, at least one side) come out in order on the
+// join columns. The join columns are put in that order.
+bool EvalPlan::use_merge_join(bool either) {
+    if (this->left_keys->empty())
+        return false;
+    bool left_sorted = sorted_on(this->relation, this->left_alias, *this->left_keys, *this->right_keys);
+    bool right_sorted = left_sorted ? sorted_by(this->right, this->right_alias, *this->right_keys)
+                                    : sorted_on(this->right, this->right_alias, *this->right_keys, *this->left_keys);
+    if (either ? !left_sorted && !right_sorted : !left_sorted || !right_sorted)
+        return false;
+    this->type = MergeJoin;
+    return true;
+}
+
+// The qualified columns a side of a join comes out sorted by, if any: a BTREE table's primary key (a select
+// from one keeps that order), or a merge join's keys.
+ColumnNames EvalPlan::sort_order(const EvalPlan *side, const Identifier &alias) {
+    ColumnNames ret;
+    if (alias.empty()) {
+        if (side->type == MergeJoin)
+            ret = *side->left_keys;
+        return ret;
+    }
+    const EvalPlan *scan = side->type == Select ? side->relation : side;
+    if (scan->type == TableScan && scan->table.has_primary_key())
+        for (auto const& column : *scan->table.get_primary_key())
+            ret.push_back(alias + "." + column);
+    return ret;
+}
+
+// Does side come out sorted on keys, i.e. are they the leading columns of its sort order?
+bool EvalPlan::sorted_by(const EvalPlan *side, const Identifier &alias, const ColumnNames &keys) {
+    ColumnNames order = sort_order(side, alias);
+    return !keys.empty() && keys.size() <= order.size() && std::equal(keys.begin(), keys.end(), order.begin());
+}
+
+// Does side come out sorted on keys, in some order of them? If so, rearrange keys into that order, along with
+// other_keys (the columns they're joined to) to match.
+bool EvalPlan::sorted_on(const EvalPlan *side, const Identifier &alias, ColumnNames &keys, ColumnNames &other_keys) {
+    ColumnNames sorted_keys, sorted_other_keys;
+    for (auto const& column : sort_order(side, alias)) {
+        auto it = std::find(keys.begin(), keys.end(), column);
+        if (it == keys.end() || sorted_keys.size() == keys.size())
+            break;
+        sorted_keys.push_back(*it);
+        sorted_other_keys.push_back(other_keys[it - keys.begin()]);
+    }
+    if (sorted_keys.size() != keys.size() || !sorted_by(side, alias, sorted_keys))
+        return false;
+    keys = sorted_keys;
+    other_keys = sorted_other_keys;
+    return true;
+}
+
+// Make this Join an IndexJoin if its right side is a table (perhaps with a Select) that can look up rows by
+// the join columns: by its own primary key or, failing that, by the cheapest of its indices that fits. If the
+// table has been analyzed, fetching the matches for each left row has to cost less than reading the whole
+// table, too.
+bool EvalPlan::use_index_join() {
+    const EvalPlan *scan = this->right->type == Select ? this->right->relation : this->right;
+    if (scan->type != TableScan || this->right_keys->empty())
+        return false;
+    const ValueDict *where = this->right->type == Select ? this->right->select_conjunction : nullptr;
+    auto joins_on = [this](const ColumnNames &columns) {
+        for (auto const& column : columns)
+            if (std::find(this->right_keys->begin(), this->right_keys->end(), this->right_alias + "." + column)
+                == this->right_keys->end())
+                return false;
+        return true;
+    };
+    DbIndex *best = nullptr;
+    if (!scan->table.has_primary_key() || !joins_on(*scan->table.get_primary_key())) {
+        uint best_cost = 0;
+        for (auto const& index : scan->indices) {
+            if (!joins_on(index->get_key_columns()) || !index->applies_to(where))
+                continue;
+            uint cost = index->lookup_cost();
+            if (best == nullptr || cost < best_cost) {
+                best = index;
+                best_cost = cost;
+            }
+        }
+        if (best == nullptr)
+            return false;
+    }
+    const TableStatistics *statistics = scan->table.get_statistics();
+    if (statistics != nullptr && this->relation->estimate_rows() * INDEX_FETCH_COST > statistics->row_count)
+        return false;
+    this->type = IndexJoin;
+    this->index = best;
+    return true;
+}
+
 ValueDicts *EvalPlan::evaluate() {
-    ValueDicts *ret = nullptr;
+    if (this->type == Sort)
+        return sort();
+    if (this->type == Aggregate)
+        return aggregate();
     if (this->type != ProjectAll && this->type != Project)
         throw DbRelationError("Invalid evaluation plan--not ending with a projection");
 
-    EvalPipeline pipeline = this->relation->pipeline();
-    DbRelation *temp_table = pipeline.first;
-    Handles *handles = pipeline.second;
-    if (this->type == ProjectAll)
-        ret = temp_table->project(handles);
-    else if (this->type == Project)
-        ret = temp_table->project(handles, this->projection);
-    delete handles;
+    // a join hands back whole rows already, so just trim them down to the projection
+    if (this->relation->is_join()) {
+        ValueDicts *rows = this->relation->join();
+        if (this->type == Project)
+            for (auto& row : *rows) {
+                ValueDict *projected = new ValueDict();
+                for (auto const& column_name : *this->projection)
+                    (*projected)[column_name] = row->at(column_name);
+                delete row;
+                row = projected;
+            }
+        return rows;
+    }
+
+    // project a batch of handles at a time so we never hold the whole selection
+    ValueDicts *ret = new ValueDicts();
+    EvalStream stream = this->relation->stream();
+    ValueDicts *rows;
+    while ((rows = project_batch(stream)) != nullptr) {
+        ret->insert(ret->end(), rows->begin(), rows->end());
+        delete rows;
+    }
+    delete stream.second;
     return ret;
 }
 
+// A Project or ProjectAll over a table or an index streams its rows out a batch at a time, and with a limit,
+// stops fetching once it's handed over that many (so a scan reads no further than it has to); anything else is
+// evaluated all at once and handed over as one batch.
+void EvalPlan::evaluate_batches(const std::function<void(ValueDicts*)> &consume, u_long limit) {
+    if ((this->type != ProjectAll && this->type != Project) || this->relation->is_join()) {
+        consume(evaluate());
+        return;
+    }
+    EvalStream stream = this->relation->stream();
+    ValueDicts *rows;
+    u_long count = 0;
+    while (limit == 0 || count < limit) {
+        uint batch_size = limit == 0 ? BATCH_SIZE : (uint) std::min<u_long>(BATCH_SIZE, limit - count);
+        if ((rows = project_batch(stream, batch_size)) == nullptr)
+            break;
+        count += rows->size();
+        consume(rows);
+    }
+    delete stream.second;
+}
+
+// The next batch of rows from stream (of this Project's or ProjectAll's relation), projected, or nullptr once
+// the stream runs out.
+ValueDicts *EvalPlan::project_batch(EvalStream &stream, uint batch_size) {
+    Handles *handles = stream.second->fetch(batch_size);
+    if (handles->empty()) {
+        delete handles;
+        return nullptr;
+    }
+    ValueDicts *rows;
+    if (this->relation->type == IndexOnlyScan)
+        rows = this->relation->index->project(handles, this->projection);
+    else if (this->type == ProjectAll)
+        rows = stream.first->project(handles);
+    else
+        rows = stream.first->project(handles, this->projection);
+    delete handles;
+    return rows;
+}
+
+// Keep just the handles whose rows filter is true for, fetching the columns it needs a batch at a time.
+static void filter_handles(DbRelation &table, Handles &handles, const EvalExpr &filter) {
+    ColumnNames column_names;
+    filter.columns(column_names);
+    u_long kept = 0;
+    std::vector<char> matches;
+    for (u_long start = 0; start < handles.size(); start += EvalPlan::BATCH_SIZE) {
+        Handles batch(handles.begin() + start,
+                      handles.begin() + std::min<u_long>(start + EvalPlan::BATCH_SIZE, handles.size()));
+        ValueDicts *rows = table.project(&batch, &column_names);
+        try {
+            filter.test(*rows, matches);
+        } catch (...) {
+            for (auto const& row : *rows)
+                delete row;
+            delete rows;
+            throw;
+        }
+        for (u_long i = 0; i < batch.size(); i++)
+            if (matches[i])
+                handles[kept++] = batch[i];
+        for (auto const& row : *rows)
+            delete row;
+        delete rows;
+    }
+    handles.resize(kept);
+}
+
+// Cursor over the handles from another cursor whose rows filter is true for, checked BATCH_SIZE at a time as
+// they're fetched (any left over from a batch wait for the next fetch). Takes ownership of the other cursor.
+class FilterCursor : public DbCursor {
+public:
+    FilterCursor(DbRelation &table, DbCursor *selection, const EvalExpr &filter)
+            : table(table), selection(selection), filter(filter), pending(), position(0) {}
+    virtual ~FilterCursor() { delete selection; }
+
+    virtual Handles* fetch(uint limit) {
+        Handles *ret = new Handles();
+        while (limit == 0 || ret->size() < limit) {
+            if (this->position == this->pending.size()) {
+                Handles *handles = this->selection->fetch(EvalPlan::BATCH_SIZE);
+                if (handles->empty()) {
+                    delete handles;
+                    break;
+                }
+                filter_handles(this->table, *handles, this->filter);
+                this->pending = *handles;
+                this->position = 0;
+                delete handles;
+            }
+            while (this->position < this->pending.size() && (limit == 0 || ret->size() < limit))
+                ret->push_back(this->pending[this->position++]);
+        }
+        return ret;
+    }
+
+protected:
+    DbRelation &table;
+    DbCursor *selection;
+    const EvalExpr &filter;
+    Handles pending;
+    u_long position;
+};
+
+EvalStream EvalPlan::stream() {
+    // base cases: let the table hand out its own selection (narrowed to any range the filter puts on its columns)
+    if (this->type == TableScan)
+        return EvalStream(&this->table, this->backward ? this->table.reverse_cursor(nullptr, nullptr, nullptr)
+                                                       : this->table.cursor(nullptr));
+    if (this->type == Select && this->relation->type == TableScan) {
+        DbRelation &table = this->relation->table;
+        if (this->filter == nullptr && !this->relation->backward)
+            return EvalStream(&table, table.cursor(this->select_conjunction));
+        ValueDict min, max;
+        if (this->filter != nullptr)
+            this->filter->bounds(min, max);
+        DbCursor *selection = this->relation->backward ? table.reverse_cursor(this->select_conjunction, &min, &max)
+                                                       : table.cursor(this->select_conjunction, &min, &max);
+        if (this->filter == nullptr)
+            return EvalStream(&table, selection);
+        return EvalStream(&table, new FilterCursor(table, selection, *this->filter));
+    }
+    if (this->type == IndexOnlyScan)
+        return EvalStream(&this->table, this->index->cursor(this->select_conjunction));
+
+    // otherwise build the whole thing
+    EvalPipeline pipeline = this->pipeline();
+    return EvalStream(pipeline.first, new HandlesCursor(pipeline.second));
+}
+
 EvalPipeline EvalPlan::pipeline() {
     // base cases
     if (this->type == TableScan)
         return EvalPipeline(&this->table, this->table.select());
-    if (this->type == Select && this->relation->type == TableScan)
-        return EvalPipeline(&this->relation->table, this->relation->table.select(this->select_conjunction));
+    if (this->type == Select && this->relation->type == TableScan) {
+        if (this->filter == nullptr)
+            return EvalPipeline(&this->relation->table, this->relation->table.select(this->select_conjunction));
+        EvalStream stream = this->stream();
+        std::unique_ptr<DbCursor> cursor(stream.second);
+        return EvalPipeline(stream.first, cursor->fetch(0));
+    }
+    if (this->type == IndexScan) {
+        // the index finds the candidates, with a lookup if the where clause pins down its whole key, or else by
+        // scanning the range of keys it and the filter allow; the table checks them against the rest
+        const ValueDict *where = this->select_conjunction;
+        bool pinned = where != nullptr;
+        for (auto const& column : this->index->get_key_columns())
+            if (pinned && where->find(column) == where->end())
+                pinned = false;
+        Handles *candidates;
+        if (pinned) {
+            candidates = this->index->lookup(this->select_conjunction);
+        } else {
+            ValueDict min, max;
+            if (this->filter != nullptr)
+                this->filter->bounds(min, max);
+            if (where != nullptr)
+                for (auto const& column : *where)
+                    min[column.first] = max[column.first] = column.second;
+            candidates = this->index->range(&min, &max);
+        }
+        EvalPipeline ret(&this->table, this->table.select(candidates, this->select_conjunction));
+        delete candidates;
+        if (this->filter != nullptr) {
+            try {
+                filter_handles(this->table, *ret.second, *this->filter);
+            } catch (...) {
+                delete ret.second;
+                throw;
+            }
+        }
+        return ret;
+    }
 
     // recursive case
     if (this->type == Select) {
@@ -97,8 +724,1134 @@ EvalPipeline EvalPlan::pipeline() {
         Handles *handles = pipeline.second;
         EvalPipeline ret(temp_table, temp_table->select(handles, this->select_conjunction));
         delete handles;
+        if (this->filter != nullptr) {
+            try {
+                filter_handles(*temp_table, *ret.second, *this->filter);
+            } catch (...) {
+                delete ret.second;
+                throw;
+            }
+        }
         return ret;
     }
 
     throw DbRelationError("Not implemented: pipeline other than Select or TableScan");
 }
+
+// One input of a join, handing out its rows one at a time. A side that is a table is selected and then
+// projected a row at a time, with its column names qualified by alias; a side that is itself a join is
+// evaluated up front; a partition (a temporary table) already has qualified column names.
+class JoinSide {
+public:
+    JoinSide(EvalPlan *plan, const Identifier &alias)
+            : alias(alias), table(nullptr), handles(nullptr), rows(nullptr), position(0) {
+        if (alias.empty()) {
+            this->rows = plan->join();
+        } else {
+            EvalPipeline pipeline = plan->pipeline();
+            this->table = pipeline.first;
+            this->handles = pipeline.second;
+        }
+    }
+
+    JoinSide(DbRelation &partition)
+            : alias(), table(&partition), handles(partition.select()), rows(nullptr), position(0) {}
+
+    ~JoinSide() {
+        delete this->handles;
+        if (this->rows != nullptr) {
+            for (u_long i = this->position; i < this->rows->size(); i++)
+                delete (*this->rows)[i];
+            delete this->rows;
+        }
+    }
+
+    u_long size() const {
+        return this->rows != nullptr ? this->rows->size() : this->handles->size();
+    }
+
+    // the next row (which the caller then owns), or nullptr when there are no more
+    ValueDict *next() {
+        if (this->position >= size())
+            return nullptr;
+        if (this->rows != nullptr)
+            return (*this->rows)[this->position++];
+        ValueDict *row = this->table->project((*this->handles)[this->position++]);
+        if (this->alias.empty())
+            return row;
+        ValueDict *ret = new ValueDict();
+        for (auto const& column : *row)
+            (*ret)[this->alias + "." + column.first] = column.second;
+        delete row;
+        return ret;
+    }
+
+protected:
+    Identifier alias;
+    DbRelation *table;
+    Handles *handles;
+    ValueDicts *rows;
+    u_long position;
+};
+
+typedef std::unordered_multimap<std::string, ValueDict*> JoinTable;
+
+static const std::string TEMP_PREFIX = "_temp_";
+
+// A fresh name for the temporary tables of a join, sort or aggregate that spills to disk. The process id keeps
+// it clear of the names earlier runs used.
+static Identifier temp_name() {
+    static uint count = 0;
+    return TEMP_PREFIX + std::to_string(getpid()) + "_" + std::to_string(++count);
+}
+
+void EvalPlan::remove_temp_files(const char *env_home) {
+    DIR *dir = opendir(env_home);
+    if (dir == nullptr)
+        return;
+    while (struct dirent *entry = readdir(dir)) {
+        std::string file_name = entry->d_name;
+        if (file_name.compare(0, TEMP_PREFIX.size(), TEMP_PREFIX) == 0) {
+            Db db(_DB_ENV, 0);
+            db.remove(file_name.c_str(), nullptr, 0);
+        }
+    }
+    closedir(dir);
+}
+
+// The join key of a row: its key columns' values, encoded as for a B-tree key so equal values give equal bytes.
+static std::string join_key(const ValueDict *row, const ColumnNames &key_columns) {
+    KeyValue key;
+    for (auto const& column_name : key_columns)
+        key.push_back(row->at(column_name));
+    return BTreeKey::encode(key);
+}
+
+// Rough size in memory of a row held in a JoinTable.
+static u_long row_bytes(const ValueDict *row) {
+    u_long bytes = 64;
+    for (auto const& column : *row)
+        bytes += 48 + column.first.size() + column.second.s.size();
+    return bytes;
+}
+
+// Run every row of probe past the hashed rows, adding each match (the two rows together) to ret.
+static void probe_rows(const JoinTable &hashed, JoinSide &probe, const ColumnNames &probe_keys, ValueDicts &ret) {
+    ValueDict *row;
+    while ((row = probe.next()) != nullptr) {
+        auto matches = hashed.equal_range(join_key(row, probe_keys));
+        for (auto it = matches.first; it != matches.second; it++) {
+            ValueDict *joined = new ValueDict(*it->second);
+            joined->insert(row->begin(), row->end());
+            ret.push_back(joined);
+        }
+        delete row;
+    }
+}
+
+static void clear(JoinTable &hashed) {
+    for (auto const& entry : hashed)
+        delete entry.second;
+    hashed.clear();
+}
+
+// Temporary tables holding one side of a join (or an aggregate's input), split by a hash of the key columns.
+// The hash is FNV-1a, which has nothing to do with the JoinTable's hashing, so a partition's rows still spread
+// out when it's hashed.
+class JoinPartitions {
+public:
+    JoinPartitions(const Identifier &name, const ColumnNames &column_names, const ColumnAttributes &column_attributes,
+                   const ColumnNames &key_columns, u_long count, uint32_t seed = 0)
+            : tables(), key_columns(key_columns), seed(seed) {
+        for (u_long i = 0; i < count; i++) {
+            this->tables.push_back(new HeapTable(name + "_" + std::to_string(i), column_names, column_attributes));
+            this->tables.back()->create();
+        }
+    }
+
+    ~JoinPartitions() {
+        for (auto const& table : this->tables) {
+            table->drop();
+            delete table;
+        }
+    }
+
+    void add(const ValueDict *row) {
+        std::string key = join_key(row, this->key_columns);
+        uint32_t h = 2166136261U + this->seed * 0x9e3779b9U;
+        for (auto const& c : key) {
+            h ^= (unsigned char) c;
+            h *= 16777619U;
+        }
+        this->tables[h % this->tables.size()]->insert(row);
+    }
+
+    HeapTable &operator[](u_long i) { return *this->tables[i]; }
+
+protected:
+    std::vector<HeapTable*> tables;
+    const ColumnNames &key_columns;
+    uint32_t seed;  // so a partition split again spreads out over the new partitions
+};
+
+// The joined rows, by whichever kind of join this is, less any the filter is false for.
+ValueDicts *EvalPlan::join() {
+    ValueDicts *rows;
+    if (this->type == IndexJoin)
+        rows = index_join();
+    else if (this->type == MergeJoin)
+        rows = merge_join();
+    else if (this->type == Join)
+        rows = hash_join();
+    else
+        throw DbRelationError("Invalid evaluation plan--not a join");
+    if (this->filter != nullptr) {
+        try {
+            this->filter->filter(*rows);
+        } catch (...) {
+            for (auto const& row : *rows)
+                delete row;
+            delete rows;
+            throw;
+        }
+    }
+    return rows;
+}
+
+// Hash join of a build side and a probe side: the build side goes into a hash table on its join key and the
+// probe side is run past it. If the build side turns out not to fit in join_memory, it's a Grace hash join
+// instead: both sides are split by join key into partitions on disk, small enough to hash, and the partitions
+// are joined pair by pair the same way, so a build partition that still doesn't fit is split again (with the
+// next seed). After MAX_JOIN_SPLITS of those, a partition is hashed whatever its size: it's down to a few keys
+// with too many rows each, and splitting again wouldn't spread them.
+class PartitionedHashJoin {
+public:
+    PartitionedHashJoin(const ColumnNames &build_keys, const ColumnNames &probe_keys,
+                        const ColumnNames &build_names, const ColumnAttributes &build_attributes,
+                        const ColumnNames &probe_names, const ColumnAttributes &probe_attributes)
+            : build_keys(build_keys), probe_keys(probe_keys), build_names(build_names),
+              build_attributes(build_attributes), probe_names(probe_names), probe_attributes(probe_attributes) {}
+
+    // Add the joined rows of build and probe to ret. level is how many times they've been split already.
+    void join(JoinSide &build, JoinSide &probe, uint32_t level, ValueDicts &ret) {
+        JoinTable hashed;
+        try {
+            u_long bytes = 0, count = 0;
+            ValueDict *row = nullptr;
+            while ((bytes <= EvalPlan::join_memory || level == EvalPlan::MAX_JOIN_SPLITS)
+                   && (row = build.next()) != nullptr) {
+                bytes += row_bytes(row);
+                count++;
+                hashed.emplace(join_key(row, this->build_keys), row);
+            }
+            if (row == nullptr) {
+                probe_rows(hashed, probe, this->probe_keys, ret);
+                clear(hashed);
+                return;
+            }
+
+            // too big: guess the whole build side's size from what we have so far, and aim for partitions half
+            // of join_memory
+            u_long partitions = 2 * (bytes / count) * build.size() / EvalPlan::join_memory + 1;
+            Identifier name = temp_name();
+            JoinPartitions build_partitions(name + "_build", this->build_names, this->build_attributes,
+                                            this->build_keys, partitions, level);
+            JoinPartitions probe_partitions(name + "_probe", this->probe_names, this->probe_attributes,
+                                            this->probe_keys, partitions, level);
+            for (auto const& entry : hashed)
+                build_partitions.add(entry.second);
+            clear(hashed);
+            while ((row = build.next()) != nullptr) {
+                build_partitions.add(row);
+                delete row;
+            }
+            while ((row = probe.next()) != nullptr) {
+                probe_partitions.add(row);
+                delete row;
+            }
+            for (u_long i = 0; i < partitions; i++) {
+                JoinSide build_partition(build_partitions[i]), probe_partition(probe_partitions[i]);
+                join(build_partition, probe_partition, level + 1, ret);
+            }
+        } catch (...) {
+            clear(hashed);
+            throw;
+        }
+    }
+
+protected:
+    const ColumnNames &build_keys, &probe_keys;
+    const ColumnNames &build_names;
+    const ColumnAttributes &build_attributes;
+    const ColumnNames &probe_names;
+    const ColumnAttributes &probe_attributes;
+};
+
+// Hash join, with the smaller side as the build side.
+ValueDicts *EvalPlan::hash_join() {
+    JoinSide left(this->relation, this->left_alias), right(this->right, this->right_alias);
+    bool build_left = left.size() <= right.size();
+    ColumnNames left_names, right_names;
+    ColumnAttributes left_attributes, right_attributes;
+    side_columns(this->relation, this->left_alias, left_names, left_attributes);
+    side_columns(this->right, this->right_alias, right_names, right_attributes);
+    PartitionedHashJoin joiner = build_left
+        ? PartitionedHashJoin(*this->left_keys, *this->right_keys, left_names, left_attributes, right_names,
+                              right_attributes)
+        : PartitionedHashJoin(*this->right_keys, *this->left_keys, right_names, right_attributes, left_names,
+                              left_attributes);
+
+    ValueDicts *ret = new ValueDicts();
+    try {
+        joiner.join(build_left ? left : right, build_left ? right : left, 0, *ret);
+    } catch (...) {
+        for (auto const& joined : *ret)
+            delete joined;
+        delete ret;
+        throw;
+    }
+    return ret;
+}
+
+// Index nested-loop join: each left row's matches are looked up in the right side's table through index (or
+// through the table's primary key). Left rows are taken PROBE_BATCH at a time and looked up in key order, so
+// one lookup after another lands on the same or the next leaf, and a key repeated in a batch is looked up once.
+ValueDicts *EvalPlan::index_join() {
+    JoinSide left(this->relation, this->left_alias);
+    DbRelation &table = this->right->type == Select ? this->right->relation->table : this->right->table;
+    const ValueDict *where = this->right->type == Select ? this->right->select_conjunction : nullptr;
+    const EvalExpr *filter = this->right->type == Select ? this->right->filter : nullptr;
+
+    // sort on the lookup columns first, then the rest of the join columns, all as found in the left rows
+    const ColumnNames &lookup_columns = this->index != nullptr ? this->index->get_key_columns()
+                                                               : *table.get_primary_key();
+    std::vector<uint> order;
+    for (auto const& column : lookup_columns)
+        order.push_back((uint) (std::find(this->right_keys->begin(), this->right_keys->end(),
+                                          this->right_alias + "." + column) - this->right_keys->begin()));
+    for (uint i = 0; i < this->right_keys->size(); i++)
+        if (std::find(order.begin(), order.end(), i) == order.end())
+            order.push_back(i);
+
+    ValueDicts *ret = new ValueDicts();
+    std::vector<std::pair<KeyValue, ValueDict*>> batch;
+    ValueDicts matches;
+    ValueDict *row = nullptr;
+    do {
+        while (batch.size() < PROBE_BATCH && (row = left.next()) != nullptr) {
+            KeyValue key;
+            for (auto const& i : order)
+                key.push_back(row->at(this->left_keys->at(i)));
+            batch.push_back(std::make_pair(key, row));
+        }
+        std::stable_sort(batch.begin(), batch.end(),
+                         [](const std::pair<KeyValue, ValueDict*> &a, const std::pair<KeyValue, ValueDict*> &b) {
+                             return a.first < b.first;
+                         });
+        for (uint b = 0; b < batch.size(); b++) {
+            if (b == 0 || batch[b].first != batch[b - 1].first) {
+                for (auto const& match : matches)
+                    delete match;
+                matches.clear();
+
+                // the join columns (less their qualifier) plus the right side's own conditions, unless any of
+                // them disagree
+                ValueDict lookup;
+                bool possible = true;
+                for (uint i = 0; i < order.size(); i++) {
+                    Identifier column = this->right_keys->at(order[i]).substr(this->right_alias.size() + 1);
+                    auto it = lookup.find(column);
+                    if (it == lookup.end())
+                        lookup[column] = batch[b].first[i];
+                    else if (it->second != batch[b].first[i])
+                        possible = false;
+                }
+                if (where != nullptr)
+                    for (auto const& column : *where) {
+                        auto it = lookup.find(column.first);
+                        if (it == lookup.end())
+                            lookup.insert(column);
+                        else if (it->second != column.second)
+                            possible = false;
+                    }
+                if (possible) {
+                    Handles *handles;
+                    if (this->index != nullptr) {
+                        Handles *candidates = this->index->lookup(&lookup);
+                        handles = table.select(candidates, &lookup);
+                        delete candidates;
+                    } else {
+                        handles = table.select(&lookup);
+                    }
+                    if (filter != nullptr)
+                        filter_handles(table, *handles, *filter);
+                    for (auto const& handle : *handles) {
+                        ValueDict *match = table.project(handle);
+                        ValueDict *qualified = new ValueDict();
+                        for (auto const& column : *match)
+                            (*qualified)[this->right_alias + "." + column.first] = column.second;
+                        delete match;
+                        matches.push_back(qualified);
+                    }
+                    delete handles;
+                }
+            }
+            for (auto const& match : matches) {
+                ValueDict *joined = new ValueDict(*batch[b].second);
+                joined->insert(match->begin(), match->end());
+                ret->push_back(joined);
+            }
+            delete batch[b].second;
+        }
+        batch.clear();
+    } while (row != nullptr);
+    for (auto const& match : matches)
+        delete match;
+    return ret;
+}
+
+typedef std::pair<std::string, ValueDict*> KeyedRow;
+
+// Order rows by their encoded keys, which is the order a B-tree keeps them in.
+static bool key_less(const KeyedRow &a, const KeyedRow &b) {
+    return BTreeKey::compare(a.first, b.first) < 0;
+}
+
+// The sort key of a row: as join_key, but with the bytes of each descending column flipped. Each column's
+// encoding is never a prefix of another value's, so flipping it exactly reverses its order.
+static std::string sort_key(const ValueDict *row, const ColumnNames &key_columns, const std::vector<bool> &descending) {
+    std::string ret;
+    for (uint i = 0; i < key_columns.size(); i++) {
+        std::string bytes = BTreeKey::encode(KeyValue{row->at(key_columns[i])});
+        if (descending[i])
+            for (auto& c : bytes)
+                c = (char) ~c;
+        ret += bytes;
+    }
+    return ret;
+}
+
+// Puts rows in sort key order. They're sorted in memory if they fit in memory bytes, otherwise by an external
+// merge sort: sorted runs that size are written to temporary tables and then merged. With a limit, only that
+// many rows (the first ones in order) are wanted, so they're kept in a bounded heap instead, unless that many
+// don't fit either. Rows with the same key come out in the order they went in (in the heap, each key has the
+// row's number tacked on to see to that).
+class RowSorter {
+public:
+    RowSorter(const ColumnNames &key_columns, const std::vector<bool> &descending, u_long memory, long limit = -1)
+            : key_columns(key_columns), descending(descending), memory(memory), limit(limit), numbered(limit >= 0),
+              count(0), bytes(0), rows(), position(0), name(), runs(), readers(), heap() {}
+
+    ~RowSorter() {
+        for (u_long i = this->position; i < this->rows.size(); i++)
+            delete this->rows[i].second;
+        for (auto const& entry : this->heap)
+            delete entry.first.second;
+        for (auto const& reader : this->readers)
+            delete reader;
+        for (auto const& run : this->runs) {
+            run->drop();
+            delete run;
+        }
+    }
+
+    // take in another row (which we then own)
+    void add(ValueDict *row) {
+        KeyedRow keyed(sort_key(row, this->key_columns, this->descending), row);
+        if (this->numbered)
+            for (int shift = 56; shift >= 0; shift -= 8)
+                keyed.first.push_back((char) (this->count >> shift));
+        this->count++;
+        if (this->limit >= 0) {
+            // rows is a heap with the last row we'd keep on top
+            if (this->rows.size() < (u_long) this->limit) {
+                this->rows.push_back(keyed);
+                std::push_heap(this->rows.begin(), this->rows.end(), key_less);
+                this->bytes += row_bytes(row);
+                if (this->bytes > this->memory) {
+                    // too many to keep: sort them all after all (and leave the limit to the caller)
+                    this->limit = -1;
+                    spill();
+                    this->bytes = 0;
+                }
+            } else if (this->limit > 0 && key_less(keyed, this->rows.front())) {
+                std::pop_heap(this->rows.begin(), this->rows.end(), key_less);
+                delete this->rows.back().second;
+                this->rows.back() = keyed;
+                std::push_heap(this->rows.begin(), this->rows.end(), key_less);
+            } else {
+                delete row;
+            }
+            return;
+        }
+        this->bytes += row_bytes(row);
+        this->rows.push_back(keyed);
+        if (this->bytes > this->memory) {
+            spill();
+            this->bytes = 0;
+        }
+    }
+
+    // call once all the rows are in, before next
+    void done() {
+        if (this->limit >= 0) {
+            std::sort_heap(this->rows.begin(), this->rows.end(), key_less);
+            return;
+        }
+        if (this->runs.empty()) {
+            std::stable_sort(this->rows.begin(), this->rows.end(), key_less);
+            return;
+        }
+        if (!this->rows.empty())
+            spill();
+        for (uint i = 0; i < this->runs.size(); i++) {
+            this->readers.push_back(new JoinSide(*this->runs[i]));
+            push(i);
+        }
+    }
+
+    // the next row (which the caller then owns) and its key, or nullptr when there are no more
+    ValueDict *next(std::string &key) {
+        if (this->runs.empty()) {
+            if (this->position >= this->rows.size())
+                return nullptr;
+            key = this->rows[this->position].first;
+            if (this->numbered)
+                key.resize(key.size() - 8);
+            return this->rows[this->position++].second;
+        }
+        if (this->heap.empty())
+            return nullptr;
+        std::pop_heap(this->heap.begin(), this->heap.end(), later);
+        RunRow top = this->heap.back();
+        this->heap.pop_back();
+        push(top.second);
+        key = top.first.first;
+        return top.first.second;
+    }
+
+protected:
+    typedef std::pair<KeyedRow, uint> RunRow;  // a row from one of the runs, and which run
+
+    const ColumnNames &key_columns;
+    const std::vector<bool> &descending;
+    u_long memory;
+    long limit;
+    bool numbered;  // do the keys in rows end with the row's number?
+    uint64_t count;  // rows added so far
+    u_long bytes;  // rough size of rows
+    std::vector<KeyedRow> rows;
+    u_long position;
+    Identifier name;
+    std::vector<HeapTable*> runs;
+    std::vector<JoinSide*> readers;
+    std::vector<RunRow> heap;  // the first row not yet handed out from each run, smallest key on top
+
+    // Merge order: the row with the smaller key, or with the same key, the row from the earlier run. That keeps
+    // rows with the same key in the order they went in.
+    static bool later(const RunRow &a, const RunRow &b) {
+        if (key_less(b.first, a.first))
+            return true;
+        return !key_less(a.first, b.first) && a.second > b.second;
+    }
+
+    // sort the rows we have and write them out as another run
+    void spill() {
+        std::stable_sort(this->rows.begin(), this->rows.end(), key_less);
+        if (this->runs.empty())
+            this->name = temp_name();
+        ColumnNames column_names;
+        ColumnAttributes column_attributes;
+        for (auto const& column : *this->rows.front().second) {
+            column_names.push_back(column.first);
+            column_attributes.push_back(ColumnAttribute(column.second.data_type));
+        }
+        HeapTable *run = new HeapTable(this->name + "_" + std::to_string(this->runs.size()), column_names,
+                                       column_attributes);
+        this->runs.push_back(run);
+        run->create();
+        for (auto const& row : this->rows) {
+            run->insert(row.second);
+            delete row.second;
+        }
+        this->rows.clear();
+    }
+
+    // put run's next row on the heap
+    void push(uint run) {
+        ValueDict *row = this->readers[run]->next();
+        if (row == nullptr)
+            return;
+        this->heap.push_back(RunRow(KeyedRow(sort_key(row, this->key_columns, this->descending), row), run));
+        std::push_heap(this->heap.begin(), this->heap.end(), later);
+    }
+};
+
+ValueSorter::ValueSorter(const Identifier &column, u_long memory)
+        : column(column), key_columns(1, column), descending(1, false), sorter(nullptr), count(0) {
+    this->sorter = new RowSorter(this->key_columns, this->descending, memory);
+}
+
+ValueSorter::~ValueSorter() {
+    delete this->sorter;
+}
+
+void ValueSorter::add(const Value &value) {
+    ValueDict *row = new ValueDict();
+    (*row)[this->column] = value;
+    this->sorter->add(row);
+    this->count++;
+}
+
+void ValueSorter::done() {
+    this->sorter->done();
+}
+
+bool ValueSorter::next(Value &value) {
+    std::string key;
+    ValueDict *row = this->sorter->next(key);
+    if (row == nullptr)
+        return false;
+    value = row->at(this->column);
+    delete row;
+    return true;
+}
+
+// One input of a merge join, handing out its rows in join key order. An input that's already in order is
+// passed straight through; any other goes through a RowSorter with join_memory to work in.
+class SortedSide {
+public:
+    SortedSide(JoinSide &side, const ColumnNames &key_columns, bool in_order)
+            : side(side), key_columns(key_columns), in_order(in_order), ascending(key_columns.size(), false),
+              sorter(key_columns, ascending, EvalPlan::join_memory) {
+        if (in_order)
+            return;
+        ValueDict *row;
+        while ((row = side.next()) != nullptr)
+            this->sorter.add(row);
+        this->sorter.done();
+    }
+
+    // the next row (which the caller then owns) and its key, or nullptr when there are no more
+    ValueDict *next(std::string &key) {
+        if (!this->in_order)
+            return this->sorter.next(key);
+        ValueDict *row = this->side.next();
+        if (row != nullptr)
+            key = join_key(row, this->key_columns);
+        return row;
+    }
+
+protected:
+    JoinSide &side;
+    const ColumnNames &key_columns;
+    bool in_order;
+    std::vector<bool> ascending;
+    RowSorter sorter;
+};
+
+// Sort-merge join: with both sides in join key order, one pass over each matches them up without any hashing.
+// A side that's a BTREE table on the join columns (or a merge join on them) is already in order; optimize_join
+// has put the keys in that order. Any other side is sorted first.
+ValueDicts *EvalPlan::merge_join() {
+    JoinSide left(this->relation, this->left_alias), right(this->right, this->right_alias);
+    SortedSide left_sorted(left, *this->left_keys, sorted_by(this->relation, this->left_alias, *this->left_keys));
+    SortedSide right_sorted(right, *this->right_keys, sorted_by(this->right, this->right_alias, *this->right_keys));
+
+    ValueDicts *ret = new ValueDicts();
+    ValueDicts matches;  // the right rows with the current key
+    std::string left_key, right_key;
+    ValueDict *left_row = left_sorted.next(left_key);
+    ValueDict *right_row = right_sorted.next(right_key);
+    while (left_row != nullptr && right_row != nullptr) {
+        int cmp = BTreeKey::compare(left_key, right_key);
+        if (cmp < 0) {
+            delete left_row;
+            left_row = left_sorted.next(left_key);
+        } else if (cmp > 0) {
+            delete right_row;
+            right_row = right_sorted.next(right_key);
+        } else {
+            std::string key = right_key;
+            while (right_row != nullptr && right_key == key) {
+                matches.push_back(right_row);
+                right_row = right_sorted.next(right_key);
+            }
+            while (left_row != nullptr && left_key == key) {
+                for (auto const& match : matches) {
+                    ValueDict *joined = new ValueDict(*left_row);
+                    joined->insert(match->begin(), match->end());
+                    ret->push_back(joined);
+                }
+                delete left_row;
+                left_row = left_sorted.next(left_key);
+            }
+            for (auto const& match : matches)
+                delete match;
+            matches.clear();
+        }
+    }
+    delete left_row;
+    delete right_row;
+    return ret;
+}
+
+// Qualified names and attributes of the columns coming out of a Join: the left side's, then the right side's.
+void EvalPlan::join_columns(ColumnNames &column_names, ColumnAttributes &column_attributes) const {
+    side_columns(this->relation, this->left_alias, column_names, column_attributes);
+    side_columns(this->right, this->right_alias, column_names, column_attributes);
+}
+
+void EvalPlan::side_columns(const EvalPlan *side, const Identifier &alias, ColumnNames &column_names,
+                            ColumnAttributes &column_attributes) {
+    if (alias.empty()) {
+        side->join_columns(column_names, column_attributes);
+        return;
+    }
+    const DbRelation &table = side->type == Select ? side->relation->table : side->table;
+    for (auto const& column_name : table.get_column_names())
+        column_names.push_back(alias + "." + column_name);
+    for (auto const& column_attribute : table.get_column_attributes())
+        column_attributes.push_back(column_attribute);
+}
+
+// Tables that have been analyzed go by their statistics, others by the defaults. A join is expected to have a row
+// for each pair of rows whose join columns match, which for each pair of columns is a fraction 1 / (the larger
+// of their distinct counts) of all the pairs; any filter is taken to keep DEFAULT_RANGE_SELECTIVITY of them.
+double EvalPlan::estimate_rows() const {
+    switch (this->type) {
+        case TableScan: {
+            const TableStatistics *statistics = this->table.get_statistics();
+            return statistics == nullptr ? DEFAULT_ROWS : (double) statistics->row_count;
+        }
+        case Select:
+        case IndexScan: {
+            const DbRelation &table = this->type == Select ? this->relation->table : this->table;
+            const TableStatistics *statistics = table.get_statistics();
+            double rows = statistics == nullptr ? DEFAULT_ROWS : (double) statistics->row_count;
+            ValueDict min, max;
+            if (this->filter != nullptr)
+                this->filter->bounds(min, max);
+            ColumnNames columns;
+            auto add_columns = [&columns](const ValueDict &conditions) {
+                for (auto const& column : conditions)
+                    if (std::find(columns.begin(), columns.end(), column.first) == columns.end())
+                        columns.push_back(column.first);
+            };
+            if (this->select_conjunction != nullptr)
+                add_columns(*this->select_conjunction);
+            add_columns(min);
+            add_columns(max);
+            return rows * selectivity(table, this->select_conjunction, min, max, columns);
+        }
+        case Join:
+        case IndexJoin:
+        case MergeJoin: {
+            double rows = this->relation->estimate_rows() * this->right->estimate_rows();
+            for (uint i = 0; i < this->left_keys->size(); i++) {
+                const Identifier &left_key = (*this->left_keys)[i], &right_key = (*this->right_keys)[i];
+                const EvalPlan *left = table_side(this->relation, this->left_alias,
+                                                  left_key.substr(0, left_key.find('.')));
+                const EvalPlan *right = table_side(this->right, this->right_alias,
+                                                   right_key.substr(0, right_key.find('.')));
+                double distinct = std::max(
+                        left == nullptr ? 1.0 : distinct_values(left, left_key.substr(left_key.find('.') + 1)),
+                        right == nullptr ? 1.0 : distinct_values(right, right_key.substr(right_key.find('.') + 1)));
+                rows /= std::max(1.0, distinct);
+            }
+            if (this->filter != nullptr)
+                rows *= DEFAULT_RANGE_SELECTIVITY;
+            return rows;
+        }
+        default:
+            return this->relation == nullptr ? DEFAULT_ROWS : this->relation->estimate_rows();
+    }
+}
+
+// The fraction of the table's rows that meet the conditions on columns: column = value in where, or inclusive
+// bounds in min and max. The columns are taken to be independent.
+double EvalPlan::selectivity(const DbRelation &table, const ValueDict *where, const ValueDict &min,
+                             const ValueDict &max, const ColumnNames &columns) {
+    const TableStatistics *statistics = table.get_statistics();
+    double ret = 1.0;
+    for (auto const& column : columns) {
+        const ColumnStatistics *column_statistics = nullptr;
+        if (statistics != nullptr && statistics->columns.find(column) != statistics->columns.end())
+            column_statistics = &statistics->columns.at(column);
+        auto low = min.find(column), high = max.find(column);
+        if (where != nullptr && where->find(column) != where->end())
+            ret *= column_statistics == nullptr ? DEFAULT_EQUAL_SELECTIVITY
+                                                : column_statistics->equal_fraction(where->at(column));
+        else if (low != min.end() || high != max.end())
+            ret *= column_statistics == nullptr ? DEFAULT_RANGE_SELECTIVITY
+                                                : column_statistics->range_fraction(
+                            low == min.end() ? nullptr : &low->second, high == max.end() ? nullptr : &high->second);
+    }
+    return ret;
+}
+
+// How many distinct values of column a side of a join that is a table (perhaps with a Select) has: no more than
+// the table has, nor than the rows the side is expected to have. Without statistics, every row's is different.
+double EvalPlan::distinct_values(const EvalPlan *side, const Identifier &column) {
+    double rows = side->estimate_rows();
+    const EvalPlan *scan = side->type == Select ? side->relation : side;
+    const TableStatistics *statistics = scan->type == TableScan ? scan->table.get_statistics() : nullptr;
+    if (statistics == nullptr || statistics->columns.find(column) == statistics->columns.end())
+        return rows;
+    return std::min(rows, (double) statistics->columns.at(column).distinct_count);
+}
+
+// The table (perhaps with a Select) under a side of a join that goes by table_alias, or nullptr if none does.
+const EvalPlan *EvalPlan::table_side(const EvalPlan *side, const Identifier &alias, const Identifier &table_alias) {
+    if (!alias.empty())
+        return alias == table_alias ? side : nullptr;
+    const EvalPlan *ret = table_side(side->relation, side->left_alias, table_alias);
+    return ret != nullptr ? ret : table_side(side->right, side->right_alias, table_alias);
+}
+
+// Running state of one aggregate function for one group.
+struct Accumulator {
+    int64_t count;
+    int64_t sum;
+    Value min, max;
+};
+
+// One group: its GROUP BY values (encoded, and as they are) and its aggregates so far.
+struct AggregateGroup {
+    std::string key;
+    KeyValue values;
+    std::vector<Accumulator> state;
+};
+
+// The groups of a hash aggregation. The groups sit one after another in a vector, and the hash table is open
+// addressing (linear probing) over small slots holding a group's hash and where it is, so most probes are a
+// short walk along neighbouring slots and then a look at the one group that matches.
+class AggregateTable {
+public:
+    AggregateTable(const ColumnNames &group_columns, const AggregateFunctions &aggregates)
+            : group_columns(group_columns), aggregates(aggregates), slots(64, Slot{0, EMPTY}), groups(), bytes(0) {}
+
+    // Add row into its group. If it would start a new group once the table is up to aggregate_memory, it's left
+    // out and we return false.
+    bool add(const ValueDict *row) {
+        KeyValue values;
+        for (auto const& column_name : this->group_columns)
+            values.push_back(row->at(column_name));
+        std::string key = BTreeKey::encode(values);
+        uint32_t h = hash(key);
+        size_t mask = this->slots.size() - 1;
+        size_t i = h & mask;
+        while (this->slots[i].group != EMPTY
+               && (this->slots[i].hash != h || this->groups[this->slots[i].group].key != key))
+            i = (i + 1) & mask;
+        uint32_t group = this->slots[i].group;
+        if (group == EMPTY) {
+            if (this->bytes > EvalPlan::aggregate_memory)
+                return false;
+            group = (uint32_t) this->groups.size();
+            this->groups.push_back(AggregateGroup{key, values, std::vector<Accumulator>(this->aggregates.size())});
+            this->bytes += 2 * key.size() + 64 * (this->aggregates.size() + this->group_columns.size()) + 64;
+            this->slots[i] = Slot{h, group};
+            if (2 * this->groups.size() > this->slots.size())
+                grow();
+        }
+        accumulate(this->groups[group], row);
+        return true;
+    }
+
+    // Add a result row for each group to rows.
+    void output(ValueDicts &rows) const {
+        for (auto const& group : this->groups)
+            rows.push_back(result(group));
+    }
+
+    // The result row with no rows at all in the group (for an aggregate without GROUP BY over nothing).
+    ValueDict *empty_result() const {
+        AggregateGroup group{"", KeyValue(), std::vector<Accumulator>(this->aggregates.size())};
+        for (uint i = 0; i < this->aggregates.size(); i++)
+            if (this->aggregates[i].data_type == ColumnAttribute::TEXT)
+                group.state[i].min = group.state[i].max = Value("");
+        return result(group);
+    }
+
+protected:
+    struct Slot {
+        uint32_t hash;
+        uint32_t group;
+    };
+    static const uint32_t EMPTY = 0xffffffffU;
+
+    const ColumnNames &group_columns;
+    const AggregateFunctions &aggregates;
+    std::vector<Slot> slots;  // always a power of two of them, at most half in use
+    std::vector<AggregateGroup> groups;
+    u_long bytes;  // rough size of the groups
+
+    // FNV-1a
+    static uint32_t hash(const std::string &key) {
+        uint32_t h = 2166136261U;
+        for (auto const& c : key) {
+            h ^= (unsigned char) c;
+            h *= 16777619U;
+        }
+        return h;
+    }
+
+    void grow() {
+        std::vector<Slot> old(this->slots.size() * 2, Slot{0, EMPTY});
+        old.swap(this->slots);
+        size_t mask = this->slots.size() - 1;
+        for (auto const& slot : old) {
+            if (slot.group == EMPTY)
+                continue;
+            size_t i = slot.hash & mask;
+            while (this->slots[i].group != EMPTY)
+                i = (i + 1) & mask;
+            this->slots[i] = slot;
+        }
+    }
+
+    void accumulate(AggregateGroup &group, const ValueDict *row) {
+        for (uint i = 0; i < this->aggregates.size(); i++) {
+            const AggregateFunction &aggregate = this->aggregates[i];
+            Accumulator &state = group.state[i];
+            if (aggregate.function == AggregateFunction::SUM || aggregate.function == AggregateFunction::AVG) {
+                state.sum += row->at(aggregate.column).n;
+            } else if (aggregate.function == AggregateFunction::MIN) {
+                const Value &value = row->at(aggregate.column);
+                if (state.count == 0 || value < state.min)
+                    state.min = value;
+            } else if (aggregate.function == AggregateFunction::MAX) {
+                const Value &value = row->at(aggregate.column);
+                if (state.count == 0 || state.max < value)
+                    state.max = value;
+            }
+            state.count++;
+        }
+    }
+
+    ValueDict *result(const AggregateGroup &group) const {
+        ValueDict *row = new ValueDict();
+        for (uint i = 0; i < group.values.size(); i++)
+            (*row)[this->group_columns[i]] = group.values[i];
+        for (uint i = 0; i < this->aggregates.size(); i++) {
+            const AggregateFunction &aggregate = this->aggregates[i];
+            const Accumulator &state = group.state[i];
+            int64_t n = 0;
+            switch (aggregate.function) {
+                case AggregateFunction::COUNT:
+                    n = state.count;
+                    break;
+                case AggregateFunction::SUM:
+                    n = state.sum;
+                    break;
+                case AggregateFunction::AVG:
+                    n = state.count == 0 ? 0 : state.sum / state.count;
+                    break;
+                case AggregateFunction::MIN:
+                    (*row)[aggregate.name] = state.min;
+                    continue;
+                case AggregateFunction::MAX:
+                    (*row)[aggregate.name] = state.max;
+                    continue;
+            }
+            if (n < INT32_MIN || n > INT32_MAX) {
+                delete row;
+                throw DbRelationError(aggregate.name + " is too big for an INT");
+            }
+            (*row)[aggregate.name] = Value((int32_t) n);
+        }
+        return row;
+    }
+};
+
+// Hash aggregation that copes with more groups than fit in aggregate_memory. Once the table is full, rows of
+// groups already in it are still aggregated there, but rows of any other group are set aside in partitions on
+// disk by a hash of their GROUP BY values. Each partition then holds whole groups, and gets aggregated the same
+// way in turn (itself spilling, with a different hash, if need be).
+class HashAggregation {
+public:
+    HashAggregation(const ColumnNames &group_columns, const AggregateFunctions &aggregates, uint32_t level)
+            : group_columns(group_columns), aggregates(aggregates), level(level), table(group_columns, aggregates),
+              partitions() {}
+
+    void add(const ValueDict *row) {
+        if (this->table.add(row))
+            return;
+        if (this->partitions == nullptr) {
+            ColumnNames column_names;
+            ColumnAttributes column_attributes;
+            for (auto const& column : *row) {
+                column_names.push_back(column.first);
+                column_attributes.push_back(ColumnAttribute(column.second.data_type));
+            }
+            this->partitions.reset(new JoinPartitions(temp_name(), column_names, column_attributes,
+                                                      this->group_columns, EvalPlan::AGGREGATE_PARTITIONS,
+                                                      this->level + 1));
+        }
+        this->partitions->add(row);
+    }
+
+    // Add a result row for each group to rows.
+    void finish(ValueDicts &rows) {
+        this->table.output(rows);
+        if (this->partitions == nullptr)
+            return;
+        for (uint i = 0; i < EvalPlan::AGGREGATE_PARTITIONS; i++) {
+            HashAggregation partition(this->group_columns, this->aggregates, this->level + 1);
+            JoinSide partition_rows((*this->partitions)[i]);
+            ValueDict *row;
+            while ((row = partition_rows.next()) != nullptr) {
+                partition.add(row);
+                delete row;
+            }
+            partition.finish(rows);
+        }
+    }
+
+    ValueDict *empty_result() const { return this->table.empty_result(); }
+
+protected:
+    const ColumnNames &group_columns;
+    const AggregateFunctions &aggregates;
+    uint32_t level;
+    AggregateTable table;
+    std::unique_ptr<JoinPartitions> partitions;
+};
+
+// Hash aggregation of the Project below, as it streams by a batch at a time (or of just the rows at the ends
+// of the table, where they're all MIN and MAX needs).
+ValueDicts *EvalPlan::aggregate() {
+    HashAggregation aggregation(*this->projection, *this->aggregates, 0);
+    auto add = [&aggregation](ValueDicts *rows) {
+        for (auto const& row : *rows) {
+            aggregation.add(row);
+            delete row;
+        }
+        delete rows;
+    };
+    Handles ends;
+    if (min_max_from_ends(&ends)) {
+        DbRelation &table = this->relation->relation->table;
+        add(this->relation->type == ProjectAll ? table.project(&ends) : table.project(&ends, this->relation->projection));
+    } else {
+        this->relation->evaluate_batches(add);
+    }
+
+    ValueDicts *ret = new ValueDicts();
+    aggregation.finish(*ret);
+    if (ret->empty() && this->projection->empty())
+        ret->push_back(aggregation.empty_result());
+    return ret;
+}
+
+// MIN and MAX of a whole table (with no GROUP BY or WHERE) only need the rows at the ends of an order the table
+// keeps: the first for MIN and the last for MAX, by the table's primary key if it starts with the column, or else
+// by a B-tree index of all its rows whose key does. Can every aggregate be had that way? If so, and handles isn't
+// nullptr, put those rows' handles in it.
+bool EvalPlan::min_max_from_ends(Handles *handles) const {
+    if (!this->projection->empty() || (this->relation->type != ProjectAll && this->relation->type != Project)
+        || this->relation->relation->type != TableScan)
+        return false;
+    const EvalPlan *scan = this->relation->relation;
+    DbRelation &table = scan->table;
+    for (auto const& aggregate : *this->aggregates) {
+        bool last = aggregate.function == AggregateFunction::MAX;
+        if (!last && aggregate.function != AggregateFunction::MIN)
+            return false;
+        Handles *found = nullptr;
+        if (table.has_primary_key() && table.get_primary_key()->front() == aggregate.column) {
+            if (handles != nullptr) {
+                std::unique_ptr<DbCursor> cursor(last ? table.reverse_cursor(nullptr, nullptr, nullptr)
+                                                      : table.cursor(nullptr));
+                found = cursor->fetch(1);
+            }
+        } else {
+            auto it = std::find_if(scan->indices.begin(), scan->indices.end(), [&aggregate](DbIndex *index) {
+                return index->supports_range() && index->get_predicate().empty()
+                       && index->get_key_columns().front() == aggregate.column;
+            });
+            if (it == scan->indices.end())
+                return false;
+            if (handles != nullptr)
+                found = (*it)->first(last);
+        }
+        if (found != nullptr) {
+            handles->insert(handles->end(), found->begin(), found->end());
+            delete found;
+        }
+    }
+    return true;
+}
+
+// Sort the rows from below as they come (a batch at a time, where they stream) and hand back the ones from
+// offset on. With a limit, only the first offset + limit rows in order are ever held, so e.g. the top 100 of
+// a big table take room for 100 rows. Rows that come in order already (or with no ORDER BY, just LIMIT) are
+// taken as they are, and then with a limit the scan below stops as soon as it has produced enough of them.
+ValueDicts *EvalPlan::sort() {
+    long keep = this->limit < 0 ? -1 : this->offset + this->limit;
+    if (presorted()) {
+        ValueDicts *ret = new ValueDicts();
+        long position = 0;
+        this->relation->evaluate_batches([this, keep, ret, &position](ValueDicts *rows) {
+            for (auto const& row : *rows) {
+                if (position < this->offset || (keep >= 0 && position >= keep))
+                    delete row;
+                else
+                    ret->push_back(row);
+                position++;
+            }
+            delete rows;
+        }, keep < 0 ? 0 : (u_long) keep);
+        return ret;
+    }
+
+    RowSorter sorter(*this->projection, *this->descending, sort_memory, keep);
+    this->relation->evaluate_batches([&sorter](ValueDicts *rows) {
+        for (auto const& row : *rows)
+            sorter.add(row);
+        delete rows;
+    });
+    sorter.done();
+
+    ValueDicts *ret = new ValueDicts();
+    std::string key;
+    ValueDict *row;
+    for (long position = 0; (keep < 0 || position < keep) && (row = sorter.next(key)) != nullptr; position++) {
+        if (position < this->offset)
+            delete row;
+        else
+            ret->push_back(row);
+    }
+    return ret;
+}
+
+// Do the rows from below come out in this Sort's order already? Any order will do without ORDER BY. Otherwise
+// they do from a BTREE table (perhaps with a Select), which keeps them in primary key order, when the ORDER BY
+// is on the start of that key, ascending (or descending, where the scan runs backward).
+bool EvalPlan::presorted() const {
+    if (this->projection->empty())
+        return true;
+    const EvalPlan *scan = ordered_scan();
+    if (scan == nullptr)
+        return false;
+    const ColumnNames &primary_key = *scan->table.get_primary_key();
+    if (this->projection->size() > primary_key.size())
+        return false;
+    for (uint i = 0; i < this->projection->size(); i++)
+        if (this->descending->at(i) != scan->backward || this->projection->at(i) != primary_key[i])
+            return false;
+    return true;
+}
+
+// The scan of a BTREE table this Sort's rows stream from (perhaps through a Select), if they do.
+EvalPlan *EvalPlan::ordered_scan() const {
+    if ((this->relation->type != ProjectAll && this->relation->type != Project) || this->relation->relation->is_join())
+        return nullptr;
+    EvalPlan *scan = this->relation->relation;
+    if (scan->type == Select)
+        scan = scan->relation;
+    if (scan->type != TableScan || !scan->table.has_primary_key())
+        return nullptr;
+    return scan;
+}
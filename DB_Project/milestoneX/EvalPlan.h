@@ -4,39 +4,171 @@
 
 #pragma once
 
-#include "storage_engine.h"
+#include <functional>
+#include "EvalExpr.h"
 
 
 typedef std::pair<DbRelation*,Handles*> EvalPipeline;
+typedef std::pair<DbRelation*,DbCursor*> EvalStream;
+typedef std::vector<DbIndex*> DbIndexes;
+
+// One aggregate function in a SELECT, e.g. SUM(column); column is "" for COUNT(*), and name and data_type are
+// the result column's
+struct AggregateFunction {
+    enum Function {
+        COUNT,
+        SUM,
+        MIN,
+        MAX,
+        AVG
+    };
+    Function function;
+    Identifier column;
+    Identifier name;
+    ColumnAttribute::DataType data_type;
+};
+typedef std::vector<AggregateFunction> AggregateFunctions;
+
+class RowSorter;
+
+// The values of one column, handed back in order once they're all in. They're sorted in memory bytes, or by an
+// external merge sort if they don't fit (it's a RowSorter underneath, as for ORDER BY).
+class ValueSorter {
+public:
+    ValueSorter(const Identifier &column, u_long memory);
+    virtual ~ValueSorter();
+
+    void add(const Value &value);
+    void done();  // call once all the values are in, before next
+    bool next(Value &value);  // the next value in order, or false when there are no more
+    u_long size() const { return this->count; }
+
+protected:
+    Identifier column;
+    ColumnNames key_columns;
+    std::vector<bool> descending;
+    RowSorter *sorter;
+    u_long count;
+};
 
 class EvalPlan {
 public:
+    static const uint BATCH_SIZE;  // how many handles evaluate projects at a time
+    static u_long join_memory;  // bytes of rows a Join may hash in memory before it partitions to disk
+    static const uint PROBE_BATCH;  // how many left rows an IndexJoin sorts and looks up at a time
+    static u_long aggregate_memory;  // bytes of groups an Aggregate may hold in memory before it partitions to disk
+    static const uint AGGREGATE_PARTITIONS;  // how many partitions an Aggregate spills to
+    static const uint MAX_JOIN_SPLITS;  // how many times a Join may split a partition that doesn't fit again
+    static u_long sort_memory;  // bytes of rows a Sort may hold in memory before it writes sorted runs to disk
+    // the cost model: a row read in a scan costs 1, and one fetched through an index INDEX_FETCH_COST; without
+    // statistics, a table is taken to have DEFAULT_ROWS rows, and column = literal or a range on a column to
+    // keep the given fraction of them
+    static const double INDEX_FETCH_COST;
+    static const double DEFAULT_ROWS;
+    static const double DEFAULT_EQUAL_SELECTIVITY;
+    static const double DEFAULT_RANGE_SELECTIVITY;
+
     enum PlanType {
         ProjectAll,
         Project,
         Select,
-        TableScan
+        TableScan,
+        IndexScan,
+        IndexOnlyScan,
+        Join,
+        IndexJoin,
+        MergeJoin,
+        Aggregate,
+        Sort
     };
 
     EvalPlan(PlanType type, EvalPlan *relation);  // use for ProjectAll, e.g., EvalPlan(EvalPlan::ProjectAll, table);
     EvalPlan(ColumnNames *projection, EvalPlan *relation); // use for Project
     EvalPlan(ValueDict* conjunction, EvalPlan *relation);  // use for Select
+    // use for Select: rows matching conjunction (column = literal) for which filter, the rest of the where clause,
+    // is true as well
+    EvalPlan(ValueDict* conjunction, EvalExpr *filter, EvalPlan *relation);
     EvalPlan(DbRelation &table);  // use for TableScan
+    EvalPlan(DbRelation &table, const DbIndexes &indices);  // use for TableScan (with indices the optimizer may use)
+    EvalPlan(DbRelation &table, DbIndex &index, ValueDict* conjunction, EvalExpr *filter = nullptr);  // use for IndexScan
+    EvalPlan(DbIndex &index, ValueDict* conjunction);  // use for IndexOnlyScan (conjunction may be nullptr)
+    // use for Join: rows of left and right where left_keys[i] = right_keys[i] for every i (no keys for a cross
+    // product), and for which filter (if any) is true; a side that is a table gets its column names qualified by
+    // its alias, e.g. "alias.column"
+    EvalPlan(EvalPlan *left, Identifier left_alias, EvalPlan *right, Identifier right_alias,
+             ColumnNames *left_keys, ColumnNames *right_keys, EvalExpr *filter = nullptr);
+    // use for Aggregate: one row per group of relation's rows (relation is a Project) with the same group_by
+    // values, holding those values and the aggregates
+    EvalPlan(ColumnNames *group_by, AggregateFunctions *aggregates, EvalPlan *relation);
+    // use for Sort: relation's rows (relation is a Project, ProjectAll or Aggregate) ordered by sort_by, each
+    // column ascending unless descending says otherwise, skipping the first offset of them and then keeping at
+    // most limit (-1 for no limit)
+    EvalPlan(ColumnNames *sort_by, std::vector<bool> *descending, long limit, long offset, EvalPlan *relation);
     EvalPlan(const EvalPlan *other);  // use for copying
     virtual ~EvalPlan();
 
+    // Remove the temporary tables that runs killed mid-spill left in the environment at env_home.
+    static void remove_temp_files(const char *env_home);
+
     // Attempt to get the best equivalent evaluation plan
     EvalPlan *optimize();
 
-    // Evaluate the plan: evaluate gets values, pipeline gets handles
+    // Evaluate the plan: evaluate gets values, pipeline gets handles, stream gets handles a batch at a time
     ValueDicts *evaluate();
     EvalPipeline pipeline();
+    EvalStream stream();
+    ValueDicts *join();  // for any join: the joined rows, under their qualified column names
+    // evaluate, handing the rows to consume (which takes them over) a batch at a time where the plan streams; a
+    // plan that streams stops after limit rows (0 for no limit)
+    void evaluate_batches(const std::function<void(ValueDicts*)> &consume, u_long limit = 0);
+
+    // qualified names and attributes of the columns a join's rows have
+    void join_columns(ColumnNames &column_names, ColumnAttributes &column_attributes) const;
+
+    // how many rows the plan is expected to come up with
+    double estimate_rows() const;
 
 protected:
 
     PlanType type;
     EvalPlan *relation;  // for everything except TableScan
-    ColumnNames *projection;  // for Project
-    ValueDict *select_conjunction;  // for Select
-    DbRelation &table;  // for TableScan
+    ColumnNames *projection;  // for Project (and the GROUP BY columns for Aggregate, the ORDER BY columns for Sort)
+    ValueDict *select_conjunction;  // for Select, IndexScan and IndexOnlyScan
+    EvalExpr *filter = nullptr;  // for Select, IndexScan and joins: what else the rows have to satisfy
+    DbRelation &table;  // for TableScan and IndexScan
+    DbIndexes indices;  // for TableScan
+    DbIndex *index;  // for IndexScan, IndexOnlyScan and IndexJoin (nullptr there for the table's primary key)
+    EvalPlan *right = nullptr;  // for joins (relation is the left side)
+    Identifier left_alias, right_alias;  // for joins: qualifier for a side that is a table ("" for a join)
+    ColumnNames *left_keys = nullptr, *right_keys = nullptr;  // for joins
+    AggregateFunctions *aggregates = nullptr;  // for Aggregate
+    std::vector<bool> *descending = nullptr;  // for Sort: which projection columns sort in descending order
+    long limit = -1, offset = 0;  // for Sort
+    bool backward = false;  // for TableScan: hand out the rows in descending primary key order
+
+    EvalPlan *optimize_index_only() const;
+    EvalPlan *optimize_index_scan() const;
+    EvalPlan *optimize_join() const;
+    EvalPlan *order_joins() const;
+    bool use_index_join();
+    bool use_merge_join(bool either);
+    ValueDicts *hash_join();
+    ValueDicts *index_join();
+    ValueDicts *merge_join();
+    ValueDicts *aggregate();
+    ValueDicts *sort();
+    ValueDicts *project_batch(EvalStream &stream, uint batch_size = BATCH_SIZE);
+    bool min_max_from_ends(Handles *handles) const;
+    bool presorted() const;
+    EvalPlan *ordered_scan() const;
+    bool is_join() const { return this->type == Join || this->type == IndexJoin || this->type == MergeJoin; }
+    static double selectivity(const DbRelation &table, const ValueDict *where, const ValueDict &min,
+                              const ValueDict &max, const ColumnNames &columns);
+    static double distinct_values(const EvalPlan *side, const Identifier &column);
+    static const EvalPlan *table_side(const EvalPlan *side, const Identifier &alias, const Identifier &table_alias);
+    static ColumnNames sort_order(const EvalPlan *side, const Identifier &alias);
+    static bool sorted_by(const EvalPlan *side, const Identifier &alias, const ColumnNames &keys);
+    static bool sorted_on(const EvalPlan *side, const Identifier &alias, ColumnNames &keys, ColumnNames &other_keys);
+    static void side_columns(const EvalPlan *side, const Identifier &alias, ColumnNames &column_names,
+                             ColumnAttributes &column_attributes);
 };
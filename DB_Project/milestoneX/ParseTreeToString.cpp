@@ -3,6 +3,7 @@
 //
 
 #include "ParseTreeToString.h"
+#include "SQLExec.h"
 
 const std::vector<std::string> ParseTreeToString::reserved_words = {
 "COLUMNS", "SHOW", "TABLES",
@@ -39,14 +40,32 @@ bool ParseTreeToString::is_reserved_word(std::string candidate) {
     return false;
 }
 
+// An operand that is itself an operator expression (just an OR, with only_or) goes in parentheses, so the
+// grouping reads the way it parsed.
+static std::string operand(const hsql::Expr *expr, bool only_or = false) {
+    if (expr->type == hsql::kExprOperator && (!only_or || expr->opType == hsql::Expr::OR))
+        return "(" + ParseTreeToString::expression(expr) + ")";
+    return ParseTreeToString::expression(expr);
+}
+
 std::string ParseTreeToString::operator_expression(const hsql::Expr *expr) {
     if (expr == NULL)
         return "null";
 
+    switch (expr->opType) {
+        case hsql::Expr::NOT:
+            return "NOT " + operand(expr->expr);
+        case hsql::Expr::UMINUS:
+            return "-" + operand(expr->expr);
+        case hsql::Expr::BETWEEN:
+            return operand(expr->expr) + " BETWEEN " + operand(expr->exprList->at(0)) + " AND "
+                   + operand(expr->exprList->at(1));
+        default:
+            break;
+    }
+
     std::string ret;
-    if (expr->opType == hsql::Expr::NOT)
-        ret += "NOT ";
-    ret += expression(expr->expr) + " ";
+    ret += (expr->opType == hsql::Expr::AND ? operand(expr->expr, true) : expression(expr->expr)) + " ";
     switch (expr->opType) {
         case hsql::Expr::SIMPLE_OP:
             ret += expr->opChar;
@@ -57,12 +76,18 @@ std::string ParseTreeToString::operator_expression(const hsql::Expr *expr) {
         case hsql::Expr::OR:
             ret += "OR";
             break;
+        case hsql::Expr::NOT_EQUALS:
+            ret += "<>";
+            break;
+        case hsql::Expr::LESS_EQ:
+            ret += "<=";
+            break;
+        case hsql::Expr::GREATER_EQ:
+            ret += ">=";
+            break;
         case hsql::Expr::NONE:break;
         case hsql::Expr::BETWEEN:break;
         case hsql::Expr::CASE:break;
-        case hsql::Expr::NOT_EQUALS:break;
-        case hsql::Expr::LESS_EQ:break;
-        case hsql::Expr::GREATER_EQ:break;
         case hsql::Expr::LIKE:break;
         case hsql::Expr::NOT_LIKE:break;
         case hsql::Expr::IN:break;
@@ -72,7 +97,7 @@ std::string ParseTreeToString::operator_expression(const hsql::Expr *expr) {
         case hsql::Expr::EXISTS:break;
     }
     if (expr->expr2 != NULL)
-        ret += " " + expression(expr->expr2);
+        ret += " " + (expr->opType == hsql::Expr::AND ? operand(expr->expr2, true) : expression(expr->expr2));
     return ret;
 }
 
@@ -97,7 +122,13 @@ std::string ParseTreeToString::expression(const hsql::Expr *expr) {
             ret += std::to_string(expr->ival);
             break;
         case hsql::kExprFunctionRef:
-            ret += std::string(expr->name) + "?" + expr->expr->name;
+            ret += std::string(expr->name) + "(";
+            if (expr->distinct)
+                ret += "DISTINCT ";
+            if (expr->exprList != NULL)
+                for (uint i = 0; i < expr->exprList->size(); i++)
+                    ret += (i > 0 ? ", " : "") + expression(expr->exprList->at(i));
+            ret += ")";
             break;
         case hsql::kExprOperator:
             ret += operator_expression(expr);
@@ -202,6 +233,25 @@ std::string ParseTreeToString::select(const hsql::SelectStatement *stmt) {
     ret += " FROM " + table_ref(stmt->fromTable);
     if (stmt->whereClause != NULL)
         ret += " WHERE " + expression(stmt->whereClause);
+    if (stmt->groupBy != NULL) {
+        ret += " GROUP BY ";
+        for (uint i = 0; i < stmt->groupBy->columns->size(); i++)
+            ret += (i > 0 ? ", " : "") + expression(stmt->groupBy->columns->at(i));
+        if (stmt->groupBy->having != NULL)
+            ret += " HAVING " + expression(stmt->groupBy->having);
+    }
+    if (stmt->order != NULL) {
+        ret += " ORDER BY ";
+        for (uint i = 0; i < stmt->order->size(); i++)
+            ret += (i > 0 ? ", " : "") + expression(stmt->order->at(i)->expr)
+                   + (stmt->order->at(i)->type == hsql::kOrderDesc ? " DESC" : "");
+    }
+    if (stmt->limit != NULL) {
+        if (stmt->limit->limit != hsql::kNoLimit)
+            ret += " LIMIT " + std::to_string(stmt->limit->limit);
+        if (stmt->limit->offset != hsql::kNoOffset)
+            ret += " OFFSET " + std::to_string(stmt->limit->offset);
+    }
     return ret;
 }
 
@@ -261,6 +311,8 @@ std::string ParseTreeToString::create(const hsql::CreateStatement *stmt) {
             doComma = true;
         }
         ret += ")";
+        if (stmt->select != nullptr && stmt->select->whereClause != nullptr)
+            ret += " WHERE " + expression(stmt->select->whereClause);
     } else {
         ret += "...";
     }
@@ -302,6 +354,12 @@ std::string ParseTreeToString::show(const hsql::ShowStatement *stmt) {
     return ret;
 }
 
+std::string ParseTreeToString::analyze(const AnalyzeStatement *stmt) {
+    if (stmt->table_name.empty())
+        return "ANALYZE";
+    return "ANALYZE " + stmt->table_name;
+}
+
 std::string ParseTreeToString::del(const hsql::DeleteStatement *stmt) {
     std::string ret("DELETE FROM ");
     ret += stmt->tableName;
@@ -313,6 +371,9 @@ std::string ParseTreeToString::del(const hsql::DeleteStatement *stmt) {
 }
 
 std::string ParseTreeToString::statement(const hsql::SQLStatement *stmt) {
+    const AnalyzeStatement *analyze_stmt = dynamic_cast<const AnalyzeStatement *>(stmt);
+    if (analyze_stmt != nullptr)
+        return analyze(analyze_stmt);
     switch (stmt->type()) {
         case hsql::kStmtSelect:
             return select((const hsql::SelectStatement *) stmt);
@@ -7,6 +7,7 @@
 #include <vector>
 #include "SQLParser.h"
 
+struct AnalyzeStatement;
 
 class ParseTreeToString {
 public:
@@ -22,6 +23,7 @@ public:
     static std::string create(const hsql::CreateStatement *stmt);
     static std::string drop(const hsql::DropStatement *stmt);
     static std::string show(const hsql::ShowStatement *stmt);
+    static std::string analyze(const AnalyzeStatement *stmt);
 
     static const std::vector<std::string> reserved_words;
     static bool is_reserved_word(std::string word);
@@ -1,5 +1,11 @@
 
 #include <algorithm>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
 #include "SQLExec.h"
 #include "EvalPlan.h"
 
@@ -60,6 +66,9 @@ QueryResult *SQLExec::execute(const hsql::SQLStatement *statement) throw(SQLExec
 	}
 
 	try {
+		const AnalyzeStatement *analyze_statement = dynamic_cast<const AnalyzeStatement *>(statement);
+		if (analyze_statement != nullptr)
+			return analyze(analyze_statement);
 		switch (statement->type()) {
 		case hsql::kStmtCreate:
 			return create((const hsql::CreateStatement *) statement);
@@ -82,6 +91,112 @@ QueryResult *SQLExec::execute(const hsql::SQLStatement *statement) throw(SQLExec
 	}
 }
 
+// Parse some SQL. hsql's grammar has no WHERE clause for CREATE INDEX, so for a partial index,
+// CREATE INDEX ... (columns) WHERE conditions, we parse the statement up to the WHERE as usual and the
+// conditions as the WHERE clause of a SELECT from the table, which goes in the CreateStatement's select.
+// Nor does it have ANALYZE, so ANALYZE, optionally followed by a table name, becomes an AnalyzeStatement.
+hsql::SQLParserResult *SQLExec::parse(const std::string &sql) {
+	std::string upper = sql;
+	std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+	size_t start = upper.find_first_not_of(" \t");
+	size_t after = start == std::string::npos ? start : start + 7;
+	if (start != std::string::npos && upper.compare(start, 7, "ANALYZE") == 0
+		&& (after == sql.size() || isspace(sql[after]) || sql[after] == ';')) {
+		size_t first = sql.find_first_not_of(" \t;", after), last = sql.find_last_not_of(" \t;");
+		std::string table_name = first == std::string::npos ? "" : sql.substr(first, last - first + 1);
+		if (std::all_of(table_name.begin(), table_name.end(), [](char c) { return isalnum(c) || c == '_'; }))
+			return new hsql::SQLParserResult(new AnalyzeStatement(table_name));
+	}
+	size_t close = upper.find(')');
+	size_t where = close == std::string::npos ? close : upper.find_first_not_of(" \t", close + 1);
+	if (start == std::string::npos || upper.compare(start, 13, "CREATE INDEX ") != 0
+		|| where == std::string::npos || upper.compare(where, 6, "WHERE ") != 0)
+		return hsql::SQLParser::parseSQLString(sql);
+
+	hsql::SQLParserResult *parse = hsql::SQLParser::parseSQLString(sql.substr(0, close + 1));
+	if (!parse->isValid() || parse->size() != 1)
+		return parse;
+	hsql::CreateStatement *create = (hsql::CreateStatement *)parse->getMutableStatement(0);
+	hsql::SQLParserResult *conditions = hsql::SQLParser::parseSQLString(
+		std::string("SELECT * FROM ") + create->tableName + " " + sql.substr(where));
+	if (!conditions->isValid()) {
+		delete parse;
+		return conditions;
+	}
+	hsql::SelectStatement *select = (hsql::SelectStatement *)conditions->getMutableStatement(0);
+	if (select->groupBy != nullptr || select->order != nullptr || select->limit != nullptr
+		|| select->unionSelect != nullptr) {
+		delete parse;
+		conditions->setIsValid(false);
+		conditions->setErrorDetails(strdup("a partial index takes only a WHERE clause"), 0, 0);
+		return conditions;
+	}
+	create->select = new hsql::SelectStatement();
+	create->select->whereClause = select->whereClause;
+	select->whereClause = nullptr;
+	delete conditions;
+	return parse;
+}
+
+// SQL: ANALYZE [table]
+// Read every row of the table (or of every table but the schema tables) to get its row count and, for each
+// column, the distinct count and an equi-depth histogram, and record them in _statistics for the optimizer.
+// Each column's values go through a ValueSorter, so between them they take no more than sort_memory and spill
+// to disk beyond that.
+QueryResult *SQLExec::analyze(const AnalyzeStatement *statement) {
+	std::vector<Identifier> table_names;
+	Handles *handles = SQLExec::tables->select();
+	for (auto const& handle : *handles) {
+		ValueDict *row = SQLExec::tables->project(handle);
+		Identifier table_name = row->at("table_name").s;
+		delete row;
+		if (statement->table_name.empty() ? table_name != Tables::TABLE_NAME && table_name != Columns::TABLE_NAME
+				&& table_name != Indices::TABLE_NAME && table_name != Statistics::TABLE_NAME
+			: table_name == statement->table_name)
+			table_names.push_back(table_name);
+	}
+	delete handles;
+	if (!statement->table_name.empty() && table_names.empty())
+		throw SQLExecError("unknown table " + statement->table_name);
+
+	Statistics &catalog = (Statistics &)SQLExec::tables->get_table(Statistics::TABLE_NAME);
+	std::string message;
+	for (auto const& table_name : table_names) {
+		DbRelation &table = SQLExec::tables->get_table(table_name);
+		const ColumnNames &column_names = table.get_column_names();
+		u_long memory = EvalPlan::sort_memory / std::max<size_t>(column_names.size(), 1);
+		std::vector<std::unique_ptr<ValueSorter>> sorters;
+		for (auto const& column_name : column_names)
+			sorters.push_back(std::unique_ptr<ValueSorter>(new ValueSorter(column_name, memory)));
+		std::unique_ptr<DbCursor> cursor(table.cursor(nullptr));
+		bool more = true;
+		while (more) {
+			std::unique_ptr<Handles> batch(cursor->fetch(EvalPlan::BATCH_SIZE));
+			more = !batch->empty();
+			for (auto const& handle : *batch) {
+				std::unique_ptr<ValueDict> row(table.project(handle));
+				for (uint i = 0; i < column_names.size(); i++)
+					sorters[i]->add(row->at(column_names[i]));
+			}
+		}
+
+		TableStatistics *statistics = new TableStatistics();
+		statistics->row_count = sorters.empty() ? 0 : sorters[0]->size();
+		for (uint i = 0; i < column_names.size(); i++) {
+			ValueSorter &sorter = *sorters[i];
+			sorter.done();
+			statistics->columns[column_names[i]].build(sorter.size(), Statistics::HISTOGRAM_BUCKETS,
+				[&sorter](Value &value) { return sorter.next(value); });
+			sorters[i].reset();
+		}
+		catalog.set_statistics(table, *statistics);
+		table.set_statistics(statistics);
+		message += (message.empty() ? "analyzed " : ", ") + table_name + " ("
+			+ std::to_string(statistics->row_count) + " rows)";
+	}
+	return new QueryResult(message.empty() ? "no tables to analyze" : message);
+}
+
 // SQL: INSERT ...
 QueryResult *SQLExec::insert(const hsql::InsertStatement *statement) {
 	Identifier table_name = statement->tableName;
@@ -116,20 +231,31 @@ QueryResult *SQLExec::insert(const hsql::InsertStatement *statement) {
 
 	Handle t_insert = table.insert(&row);
 
-	// insert into indices
-	auto index_names = SQLExec::indices->get_index_names(table_name);
-	for (auto const& index_name : index_names) {
+	// insert into indices (partial ones only if the row is one of theirs)
+	uint index_count = 0;
+	for (auto const& index_name : SQLExec::indices->get_index_names(table_name)) {
 		DbIndex& index = SQLExec::indices->get_index(table, index_name);
-		index.insert(t_insert);
+		if (index.includes(t_insert)) {
+			index.insert(t_insert);
+			index_count++;
+		}
 	}
 
 	std::string comment = "successfully inserted 1 row into " + table_name;
-	if (index_names.size() > 0)
-		comment += std::string(" and ") + std::to_string(index_names.size()) + " indices";
+	if (index_count > 0)
+		comment += std::string(" and ") + std::to_string(index_count) + " indices";
 	return new QueryResult(comment);
 }
 
-// recursive helper to pick up all the leaf equality conditions
+// column = value as part of conjunction, which can't also hold column = some other value
+static void add_equality(ValueDict *conjunction, const Identifier &column_name, const Value &value) {
+	auto found = conjunction->find(column_name);
+	if (found != conjunction->end() && found->second != value)
+		throw DbRelationError("conflicting conditions on " + column_name + " in WHERE clause");
+	(*conjunction)[column_name] = value;
+}
+
+// recursive helper to pick up all the leaf equality conditions (of a partial index's WHERE clause)
 void get_where_conjunction(const hsql::Expr *expr, ValueDict *conjunction) {
 	if (expr->type == hsql::kExprOperator) {
 
@@ -139,11 +265,11 @@ void get_where_conjunction(const hsql::Expr *expr, ValueDict *conjunction) {
 			&& expr->expr->type == hsql::kExprColumnRef) {
 
 			if (expr->expr2->type == hsql::kExprLiteralInt) {
-				(*conjunction)[expr->expr->name] = Value((int32_t)expr->expr2->ival);
+				add_equality(conjunction, expr->expr->name, Value((int32_t)expr->expr2->ival));
 				return;
 			}
 			if (expr->expr2->type == hsql::kExprLiteralString) {
-				(*conjunction)[expr->expr->name] = Value(expr->expr2->name);
+				add_equality(conjunction, expr->expr->name, Value(expr->expr2->name));
 				return;
 			}
 		}
@@ -158,13 +284,6 @@ void get_where_conjunction(const hsql::Expr *expr, ValueDict *conjunction) {
 	throw SQLExecError("we only know how to do WHERE clauses with =/AND so far");
 }
 
-// Get a ValueDict of any AND conjuctions where bottom level has to be EQUALITY expressions
-ValueDict *get_where_conjunction(const hsql::Expr *where_clause) {
-	ValueDict *where = new ValueDict();
-	get_where_conjunction(where_clause, where);
-	return where;
-}
-
 // Get the column names from the SELECT
 ColumnNames *get_select_column_names(const std::vector<hsql::Expr*>* list) {
 	ColumnNames *column_names = new ColumnNames();
@@ -180,42 +299,649 @@ ColumnNames *get_select_column_names(const std::vector<hsql::Expr*>* list) {
 	return column_names;
 }
 
+// Finds what a column reference in a SELECT refers to: sets column to the name it goes by in the rows being
+// selected from and returns its attribute.
+typedef std::function<ColumnAttribute(const hsql::Expr *expr, Identifier &column)> ColumnResolver;
+
+// Resolves the columns of a single table, which go by their own names.
+ColumnResolver table_resolver(const DbRelation &table) {
+	return [&table](const hsql::Expr *expr, Identifier &column) {
+		column = expr->name;
+		ColumnAttributes *attributes = table.get_column_attributes(ColumnNames{column});
+		ColumnAttribute ret = attributes->at(0);
+		delete attributes;
+		return ret;
+	};
+}
+
+// Compile a condition (or part of one) from a WHERE or ON clause: comparisons (=, <>, <, <=, >, >=), AND, OR,
+// NOT, BETWEEN and INT arithmetic (+, -, *, /, % and unary minus) over columns and literals.
+EvalExpr *get_expression(const hsql::Expr *expr, const ColumnResolver &resolve) {
+	switch (expr->type) {
+	case hsql::kExprColumnRef: {
+		Identifier column;
+		ColumnAttribute attribute = resolve(expr, column);
+		return new EvalExpr(column, attribute.get_data_type());
+	}
+	case hsql::kExprLiteralInt:
+		return new EvalExpr(Value((int32_t)expr->ival));
+	case hsql::kExprLiteralString:
+		return new EvalExpr(Value(expr->name));
+	case hsql::kExprOperator:
+		break;
+	default:
+		throw SQLExecError("only support columns, INT and TEXT literals, and operators in WHERE");
+	}
+
+	if (expr->opType == hsql::Expr::NOT || expr->opType == hsql::Expr::UMINUS)
+		return new EvalExpr(expr->opType == hsql::Expr::NOT ? EvalExpr::Not : EvalExpr::Negate,
+			get_expression(expr->expr, resolve));
+	if (expr->opType == hsql::Expr::BETWEEN) {
+		std::unique_ptr<EvalExpr> operand(get_expression(expr->expr, resolve));
+		std::unique_ptr<EvalExpr> low(get_expression(expr->exprList->at(0), resolve));
+		EvalExpr *high = get_expression(expr->exprList->at(1), resolve);
+		return new EvalExpr(operand.release(), low.release(), high);
+	}
+
+	EvalExpr::Operator op;
+	bool logical = false;
+	switch (expr->opType) {
+	case hsql::Expr::SIMPLE_OP:
+		switch (expr->opChar) {
+		case '=': op = EvalExpr::EQ; break;
+		case '<': op = EvalExpr::LT; break;
+		case '>': op = EvalExpr::GT; break;
+		case '+': op = EvalExpr::ADD; break;
+		case '-': op = EvalExpr::SUB; break;
+		case '*': op = EvalExpr::MUL; break;
+		case '/': op = EvalExpr::DIV; break;
+		case '%': op = EvalExpr::MOD; break;
+		default:
+			throw SQLExecError(std::string("operator ") + expr->opChar + " is not supported");
+		}
+		break;
+	case hsql::Expr::NOT_EQUALS:
+		op = EvalExpr::NE;
+		break;
+	case hsql::Expr::LESS_EQ:
+		op = EvalExpr::LE;
+		break;
+	case hsql::Expr::GREATER_EQ:
+		op = EvalExpr::GE;
+		break;
+	case hsql::Expr::AND:
+	case hsql::Expr::OR:
+		logical = true;
+		break;
+	default:
+		throw SQLExecError("only support comparisons, AND, OR, NOT, BETWEEN and arithmetic in WHERE");
+	}
+	std::unique_ptr<EvalExpr> left(get_expression(expr->expr, resolve));
+	EvalExpr *right = get_expression(expr->expr2, resolve);
+	if (logical)
+		return new EvalExpr(expr->opType == hsql::Expr::AND ? EvalExpr::And : EvalExpr::Or, left.release(), right);
+	return new EvalExpr(op, left.release(), right);
+}
+
+// recursive helper to break a condition into the parts ANDed together
+void get_conjuncts(const hsql::Expr *expr, std::vector<const hsql::Expr*> &conjuncts) {
+	if (expr->type == hsql::kExprOperator && expr->opType == hsql::Expr::AND) {
+		get_conjuncts(expr->expr, conjuncts);
+		get_conjuncts(expr->expr2, conjuncts);
+		return;
+	}
+	conjuncts.push_back(expr);
+}
+
+// AND condition into a where clause: into conjunction if it's column = literal (that conjunction doesn't already
+// have another value for), otherwise into filter. Takes ownership of condition.
+void add_condition(EvalExpr *condition, ValueDict &conjunction, EvalExpr *&filter) {
+	if (condition->get_data_type() != ColumnAttribute::BOOLEAN) {
+		delete condition;
+		throw SQLExecError("WHERE and ON need conditions that are true or false");
+	}
+	Identifier column;
+	Value value;
+	if (condition->is_equality(column, value) && conjunction.find(column) == conjunction.end()) {
+		conjunction[column] = value;
+		delete condition;
+		return;
+	}
+	filter = filter == nullptr ? condition : new EvalExpr(EvalExpr::And, filter, condition);
+}
+
+// Wrap plan in a Select for a WHERE clause: the column = literal conditions ANDed together at the top go in its
+// conjunction, which tables and indices can look up directly, and everything else in its filter.
+EvalPlan *get_select_plan(const hsql::Expr *where_clause, const ColumnResolver &resolve, EvalPlan *plan) {
+	std::vector<const hsql::Expr*> conjuncts;
+	get_conjuncts(where_clause, conjuncts);
+	ValueDict *conjunction = new ValueDict();
+	EvalExpr *filter = nullptr;
+	try {
+		for (auto const& expr : conjuncts)
+			add_condition(get_expression(expr, resolve), *conjunction, filter);
+	}
+	catch (...) {
+		delete conjunction;
+		delete filter;
+		delete plan;
+		throw;
+	}
+	return new EvalPlan(conjunction, filter, plan);
+}
+
+// Is it a SELECT with GROUP BY or aggregate functions?
+bool is_aggregate(const hsql::SelectStatement *statement) {
+	if (statement->groupBy != nullptr)
+		return true;
+	for (auto const& expr : *statement->selectList)
+		if (expr->type == hsql::kExprFunctionRef)
+			return true;
+	return false;
+}
+
+// Pick apart a SELECT with GROUP BY or aggregate functions: the GROUP BY columns, the aggregates, and the
+// columns of the rows being selected from that those need (input). For each column of the result, gives the
+// name it has in the aggregated rows (source), the name to show it as, and its attribute.
+void get_aggregates(const hsql::SelectStatement *statement, const ColumnResolver &resolve, ColumnNames &group_by,
+	AggregateFunctions &aggregates, ColumnNames &input, ColumnNames &sources, ColumnNames &column_names,
+	ColumnAttributes &column_attributes) {
+	if (statement->groupBy != nullptr) {
+		if (statement->groupBy->having != nullptr)
+			throw SQLExecError("HAVING is not supported yet");
+		for (auto const& expr : *statement->groupBy->columns) {
+			if (expr->type != hsql::kExprColumnRef)
+				throw SQLExecError("only support column names in GROUP BY");
+			Identifier column;
+			resolve(expr, column);
+			group_by.push_back(column);
+		}
+	}
+	input = group_by;
+	for (auto const& expr : *statement->selectList) {
+		if (expr->type == hsql::kExprColumnRef) {
+			Identifier column;
+			column_attributes.push_back(resolve(expr, column));
+			if (std::find(group_by.begin(), group_by.end(), column) == group_by.end())
+				throw SQLExecError(std::string("column ") + expr->name + " must be in GROUP BY");
+			sources.push_back(column);
+			if (expr->alias != nullptr)
+				column_names.push_back(expr->alias);
+			else
+				column_names.push_back(expr->table != nullptr ? std::string(expr->table) + "." + expr->name : expr->name);
+			continue;
+		}
+		if (expr->type != hsql::kExprFunctionRef)
+			throw SQLExecError("only support columns and COUNT, SUM, MIN, MAX or AVG with GROUP BY");
+
+		std::string function = expr->name;
+		std::transform(function.begin(), function.end(), function.begin(), ::toupper);
+		AggregateFunction aggregate;
+		if (function == "COUNT")
+			aggregate.function = AggregateFunction::COUNT;
+		else if (function == "SUM")
+			aggregate.function = AggregateFunction::SUM;
+		else if (function == "MIN")
+			aggregate.function = AggregateFunction::MIN;
+		else if (function == "MAX")
+			aggregate.function = AggregateFunction::MAX;
+		else if (function == "AVG")
+			aggregate.function = AggregateFunction::AVG;
+		else
+			throw SQLExecError("unknown function " + function);
+		if (expr->distinct)
+			throw SQLExecError("DISTINCT aggregates are not supported");
+		if (expr->exprList == nullptr || expr->exprList->size() != 1)
+			throw SQLExecError(function + " takes one argument");
+
+		const hsql::Expr *argument = expr->exprList->at(0);
+		ColumnAttribute attribute(ColumnAttribute::INT);
+		Identifier shown;
+		if (argument->type == hsql::kExprStar && aggregate.function == AggregateFunction::COUNT) {
+			shown = "*";
+		}
+		else if (argument->type == hsql::kExprColumnRef) {
+			ColumnAttribute column_attribute = resolve(argument, aggregate.column);
+			if (aggregate.function == AggregateFunction::MIN || aggregate.function == AggregateFunction::MAX)
+				attribute = column_attribute;
+			else if (aggregate.function != AggregateFunction::COUNT
+				&& column_attribute.get_data_type() != ColumnAttribute::INT)
+				throw SQLExecError(function + " needs an INT column");
+			if (std::find(input.begin(), input.end(), aggregate.column) == input.end())
+				input.push_back(aggregate.column);
+			shown = argument->table != nullptr ? std::string(argument->table) + "." + argument->name : argument->name;
+		}
+		else {
+			throw SQLExecError(function + " takes a column" + (aggregate.function == AggregateFunction::COUNT ? " or *" : ""));
+		}
+		aggregate.name = expr->alias != nullptr ? std::string(expr->alias) : function + "(" + shown + ")";
+		aggregate.data_type = attribute.get_data_type();
+
+		// the same aggregate twice is just computed once
+		bool duplicate = false;
+		for (auto const& other : aggregates)
+			if (other.name == aggregate.name) {
+				if (other.function != aggregate.function || other.column != aggregate.column)
+					throw SQLExecError("two different columns called " + aggregate.name);
+				duplicate = true;
+			}
+		if (std::find(group_by.begin(), group_by.end(), aggregate.name) != group_by.end())
+			throw SQLExecError("two different columns called " + aggregate.name);
+		if (!duplicate)
+			aggregates.push_back(aggregate);
+		sources.push_back(aggregate.name);
+		column_names.push_back(aggregate.name);
+		column_attributes.push_back(attribute);
+	}
+}
+
+// Give the rows their columns' names to show (column_names) in place of the ones they have (sources).
+void rename_columns(ValueDicts *rows, const ColumnNames &sources, const ColumnNames &column_names) {
+	for (auto& row : *rows) {
+		ValueDict *shown = new ValueDict();
+		for (uint i = 0; i < sources.size(); i++)
+			(*shown)[column_names.at(i)] = row->at(sources[i]);
+		delete row;
+		row = shown;
+	}
+}
+
+// Wrap plan in a Sort if the SELECT has ORDER BY or LIMIT. Each ORDER BY term names a column of the result:
+// by the name it's shown as, as written in a join (alias.column), by its position from 1, or for an aggregate,
+// as written in the select list. sources are the names the result's columns have in the plan's rows.
+EvalPlan *get_sort_plan(const hsql::SelectStatement *statement, const ColumnNames &sources,
+	const ColumnNames &column_names, EvalPlan *plan) {
+	if (statement->order == nullptr && statement->limit == nullptr)
+		return plan;
+	ColumnNames sort_by;
+	std::vector<bool> descending;
+	if (statement->order != nullptr) {
+		for (auto const& order : *statement->order) {
+			const hsql::Expr *expr = order->expr;
+			Identifier name;
+			if (expr->type == hsql::kExprLiteralInt) {
+				if (expr->ival < 1 || expr->ival > (int64_t)sources.size())
+					throw SQLExecError("ORDER BY position " + std::to_string(expr->ival) + " is not in the result");
+				name = sources[expr->ival - 1];
+			}
+			else {
+				Identifier written;
+				if (expr->type == hsql::kExprColumnRef) {
+					written = expr->table != nullptr ? std::string(expr->table) + "." + expr->name : expr->name;
+				}
+				else if (expr->type == hsql::kExprFunctionRef && expr->exprList != nullptr && expr->exprList->size() == 1) {
+					const hsql::Expr *argument = expr->exprList->at(0);
+					written = expr->name;
+					std::transform(written.begin(), written.end(), written.begin(), ::toupper);
+					if (argument->type == hsql::kExprStar)
+						written += "(*)";
+					else if (argument->type == hsql::kExprColumnRef)
+						written += "(" + (argument->table != nullptr ? std::string(argument->table) + "." : "")
+							+ argument->name + ")";
+				}
+				else {
+					throw SQLExecError("only support columns of the result in ORDER BY");
+				}
+				for (uint i = 0; i < sources.size() && name.empty(); i++)
+					if (column_names[i] == written)
+						name = sources[i];
+				if (name.empty() && std::find(sources.begin(), sources.end(), written) != sources.end())
+					name = written;
+				if (name.empty())
+					throw SQLExecError("ORDER BY " + written + " is not a column of the result");
+			}
+			sort_by.push_back(name);
+			descending.push_back(order->type == hsql::kOrderDesc);
+		}
+	}
+	long limit = -1, offset = 0;
+	if (statement->limit != nullptr) {
+		if (statement->limit->limit != hsql::kNoLimit)
+			limit = (long)statement->limit->limit;
+		if (statement->limit->offset != hsql::kNoOffset)
+			offset = (long)statement->limit->offset;
+	}
+	return new EvalPlan(new ColumnNames(sort_by), new std::vector<bool>(descending), limit, offset, plan);
+}
+
 // SQL: SELECT...
 QueryResult *SQLExec::select(const hsql::SelectStatement *statement) {
+	if (statement->fromTable->type != hsql::kTableName)
+		return select_join(statement);
 	Identifier table_name = statement->fromTable->getName();
 	DbRelation& table = SQLExec::tables->get_table(table_name);
+	ColumnResolver resolve = table_resolver(table);
 
-	// start base of plan at a TableScan
-	EvalPlan *plan = new EvalPlan(table);
+	// with GROUP BY or aggregate functions, work out what to aggregate first
+	bool aggregating = is_aggregate(statement);
+	ColumnNames group_by, input, sources;
+	AggregateFunctions aggregates;
+	ColumnNames *column_names = new ColumnNames();
+	ColumnAttributes *column_attributes = new ColumnAttributes();
+	if (aggregating) {
+		try {
+			get_aggregates(statement, resolve, group_by, aggregates, input, sources, *column_names, *column_attributes);
+		}
+		catch (...) {
+			delete column_names;
+			delete column_attributes;
+			throw;
+		}
+	}
+
+	// start base of plan at a TableScan (the optimizer may swap in one of these indices)
+	DbIndexes indices;
+	for (auto const& index_name : SQLExec::indices->get_index_names(table_name))
+		indices.push_back(&SQLExec::indices->get_index(table, index_name));
+	EvalPlan *plan = new EvalPlan(table, indices);
 
 	// enclose that in a Select if we have a where clause
-	if (statement->whereClause != nullptr)
-		plan = new EvalPlan(get_where_conjunction(statement->whereClause), plan);
+	if (statement->whereClause != nullptr) {
+		try {
+			plan = get_select_plan(statement->whereClause, resolve, plan);
+		}
+		catch (...) {
+			delete column_names;
+			delete column_attributes;
+			throw;
+		}
+	}
 
-	// now wrap the whole thing in a ProjectAll or a Project
-	ColumnNames *column_names;
-	ColumnAttributes *column_attributes;
-	if (statement->selectList->at(0)->type == hsql::kExprStar) {
-		column_names = new ColumnNames(table.get_column_names());
-		column_attributes = new ColumnAttributes(table.get_column_attributes());
+	// now wrap the whole thing in a ProjectAll or a Project (with an Aggregate over that if we're aggregating)
+	if (aggregating) {
+		plan = new EvalPlan(new ColumnNames(group_by), new AggregateFunctions(aggregates),
+			new EvalPlan(new ColumnNames(input), plan));
+	}
+	else if (statement->selectList->at(0)->type == hsql::kExprStar) {
+		*column_names = table.get_column_names();
+		*column_attributes = table.get_column_attributes();
 		plan = new EvalPlan(EvalPlan::ProjectAll, plan);
 	}
 	else {
+		delete column_names;
+		delete column_attributes;
 		column_names = get_select_column_names(statement->selectList);
 		column_attributes = table.get_column_attributes(*column_names);
 		plan = new EvalPlan(new ColumnNames(*column_names), plan);
 	}
 
+	// and finally in a Sort for any ORDER BY or LIMIT
+	try {
+		plan = get_sort_plan(statement, aggregating ? sources : *column_names, *column_names, plan);
+	}
+	catch (...) {
+		delete plan;
+		delete column_names;
+		delete column_attributes;
+		throw;
+	}
+
 	// optimize the plan and evaluate the optimized plan
 	EvalPlan *optimized = plan->optimize();
 	ValueDicts *rows = optimized->evaluate();
 	delete plan;
 	delete optimized;
+	if (aggregating)
+		rename_columns(rows, sources, *column_names);
 
 	return new QueryResult(column_names, column_attributes, rows,
 		"successfully returned " + std::to_string(rows->size()) + " rows");
 }
 
+// recursive helper to flatten a FROM clause into its tables, picking up the ON conditions along the way
+void get_join_tables(const hsql::TableRef *table, std::vector<const hsql::TableRef*> &tables,
+	std::vector<const hsql::Expr*> &conditions) {
+	switch (table->type) {
+	case hsql::kTableName:
+		tables.push_back(table);
+		return;
+	case hsql::kTableCrossProduct:
+		for (auto const& member : *table->list)
+			get_join_tables(member, tables, conditions);
+		return;
+	case hsql::kTableJoin:
+		if (table->join->type != hsql::kJoinInner && table->join->type != hsql::kJoinCross)
+			throw SQLExecError("only inner joins are supported");
+		get_join_tables(table->join->left, tables, conditions);
+		get_join_tables(table->join->right, tables, conditions);
+		if (table->join->condition != nullptr)
+			conditions.push_back(table->join->condition);
+		return;
+	default:
+		throw SQLExecError("only tables and joins of tables are supported in FROM");
+	}
+}
+
+// SQL: SELECT ... FROM two or more tables. Conditions (in ON or WHERE) on one table narrow it down before the
+// join, column = column across two tables is what the tables are joined on, and any other condition on several
+// tables is checked on the joined rows.
+// The tables are joined in FROM order, give or take, and the optimizer picks a hash, merge or index nested-loop
+// join for each. Joined rows carry "alias.column" names, and the result shows a column by its bare name unless
+// that's ambiguous.
+QueryResult *SQLExec::select_join(const hsql::SelectStatement *statement) {
+	std::vector<const hsql::TableRef*> refs;
+	std::vector<const hsql::Expr*> conditions, conjuncts;
+	get_join_tables(statement->fromTable, refs, conditions);
+	if (statement->whereClause != nullptr)
+		conditions.push_back(statement->whereClause);
+	for (auto const& condition : conditions)
+		get_conjuncts(condition, conjuncts);
+
+	std::vector<Identifier> aliases;
+	std::vector<DbRelation*> relations;
+	for (auto const& ref : refs) {
+		Identifier alias = ref->alias != nullptr ? ref->alias : ref->name;
+		if (std::find(aliases.begin(), aliases.end(), alias) != aliases.end())
+			throw SQLExecError("table " + alias + " appears more than once in FROM (give it an alias)");
+		aliases.push_back(alias);
+		relations.push_back(&SQLExec::tables->get_table(ref->name));
+	}
+
+	// which table a column reference is to, and the column's qualified name
+	auto resolve = [&](const hsql::Expr *expr, Identifier &qualified) {
+		uint found = (uint) refs.size();
+		for (uint i = 0; i < refs.size(); i++) {
+			if (expr->table != nullptr && aliases[i] != expr->table)
+				continue;
+			const ColumnNames &columns = relations[i]->get_column_names();
+			if (std::find(columns.begin(), columns.end(), expr->name) == columns.end())
+				continue;
+			if (found != refs.size())
+				throw SQLExecError(std::string("column ") + expr->name + " is ambiguous");
+			found = i;
+		}
+		if (found == refs.size())
+			throw SQLExecError(std::string("unknown column ")
+				+ (expr->table != nullptr ? std::string(expr->table) + "." : "") + expr->name);
+		qualified = aliases[found] + "." + expr->name;
+		return found;
+	};
+
+	// the same, giving the column's attribute too, and noting the table in mentioned; or for a condition on just
+	// one table, as that table sees it (by its bare name)
+	std::set<uint> mentioned;
+	auto resolve_qualified = [&](const hsql::Expr *expr, Identifier &column) {
+		uint table = resolve(expr, column);
+		mentioned.insert(table);
+		ColumnAttributes *attributes = relations[table]->get_column_attributes(ColumnNames{expr->name});
+		ColumnAttribute ret = attributes->at(0);
+		delete attributes;
+		return ret;
+	};
+	auto resolve_bare = [&](const hsql::Expr *expr, Identifier &column) {
+		ColumnAttribute ret = resolve_qualified(expr, column);
+		column = expr->name;
+		return ret;
+	};
+
+	// sort the conditions into each table's own where clause (column = literal in wheres, anything else in
+	// filters), the equalities between tables, and the conditions on several tables, which are checked as soon
+	// as those tables have been joined
+	struct Equality {
+		uint left, right;
+		Identifier left_column, right_column;
+	};
+	struct Residual {
+		std::set<uint> tables;
+		std::unique_ptr<EvalExpr> condition;
+	};
+	std::vector<ValueDict> wheres(refs.size());
+	std::vector<std::unique_ptr<EvalExpr>> filters(refs.size());
+	std::vector<Equality> equalities;
+	std::vector<Residual> residuals;
+	for (auto const& expr : conjuncts) {
+		if (expr->type == hsql::kExprOperator && expr->opType == hsql::Expr::SIMPLE_OP && expr->opChar == '='
+			&& expr->expr->type == hsql::kExprColumnRef && expr->expr2->type == hsql::kExprColumnRef) {
+			Identifier column, other_column;
+			uint table = resolve(expr->expr, column);
+			uint other_table = resolve(expr->expr2, other_column);
+			if (other_table != table) {
+				equalities.push_back(Equality{table, other_table, column, other_column});
+				continue;
+			}
+		}
+		mentioned.clear();
+		std::unique_ptr<EvalExpr> condition(get_expression(expr, resolve_qualified));
+		if (condition->get_data_type() != ColumnAttribute::BOOLEAN)
+			throw SQLExecError("WHERE and ON need conditions that are true or false");
+		if (mentioned.size() == 1) {
+			uint table = *mentioned.begin();
+			EvalExpr *filter = filters[table].release();
+			add_condition(get_expression(expr, resolve_bare), wheres[table], filter);
+			filters[table].reset(filter);
+		}
+		else {
+			residuals.push_back(Residual{mentioned, std::move(condition)});
+		}
+	}
+
+	// the columns to show and the qualified names they come from (or, if we're aggregating, what to aggregate)
+	ColumnNames *column_names = new ColumnNames();
+	ColumnAttributes *column_attributes = new ColumnAttributes();
+	ColumnNames qualified_names;
+	bool project_all = statement->selectList->at(0)->type == hsql::kExprStar;
+	bool aggregating = is_aggregate(statement);
+	ColumnNames group_by, input;
+	AggregateFunctions aggregates;
+	try {
+		if (aggregating) {
+			get_aggregates(statement, resolve_qualified, group_by, aggregates, input, qualified_names, *column_names,
+				*column_attributes);
+		}
+		else if (project_all) {
+			for (uint i = 0; i < refs.size(); i++) {
+				const ColumnNames &columns = relations[i]->get_column_names();
+				ColumnAttributes attributes = relations[i]->get_column_attributes();
+				for (uint j = 0; j < columns.size(); j++) {
+					uint tables_with_column = 0;
+					for (auto const& relation : relations) {
+						const ColumnNames &others = relation->get_column_names();
+						if (std::find(others.begin(), others.end(), columns[j]) != others.end())
+							tables_with_column++;
+					}
+					qualified_names.push_back(aliases[i] + "." + columns[j]);
+					column_names->push_back(tables_with_column > 1 ? qualified_names.back() : columns[j]);
+					column_attributes->push_back(attributes[j]);
+				}
+			}
+		}
+		else {
+			for (auto const& expr : *statement->selectList) {
+				if (expr->type != hsql::kExprColumnRef)
+					throw SQLExecError("only support * or explicit column names in SELECT");
+				Identifier qualified;
+				uint table = resolve(expr, qualified);
+				qualified_names.push_back(qualified);
+				column_names->push_back(expr->table != nullptr ? qualified : Identifier(expr->name));
+				ColumnAttributes *attributes = relations[table]->get_column_attributes(ColumnNames{expr->name});
+				column_attributes->push_back(attributes->at(0));
+				delete attributes;
+			}
+		}
+	}
+	catch (...) {
+		delete column_names;
+		delete column_attributes;
+		throw;
+	}
+
+	// join the tables in FROM order, each on whichever equalities tie it to the tables before it, except that
+	// a table with no such ties waits until one turns up (so there's a cross product only when there has to be)
+	auto scan = [&](uint i) {
+		DbIndexes table_indices;
+		for (auto const& index_name : SQLExec::indices->get_index_names(refs[i]->name))
+			table_indices.push_back(&SQLExec::indices->get_index(*relations[i], index_name));
+		EvalPlan *plan = new EvalPlan(*relations[i], table_indices);
+		if (!wheres[i].empty() || filters[i] != nullptr)
+			plan = new EvalPlan(new ValueDict(wheres[i]), filters[i].release(), plan);
+		return plan;
+	};
+	std::vector<bool> joined(refs.size(), false);
+	joined[0] = true;
+	EvalPlan *plan = scan(0);
+	for (uint step = 1; step < refs.size(); step++) {
+		uint next = (uint) refs.size();
+		for (uint i = 1; i < refs.size() && next == refs.size(); i++)
+			if (!joined[i])
+				for (auto const& equality : equalities)
+					if ((equality.left == i && joined[equality.right]) || (equality.right == i && joined[equality.left]))
+						next = i;
+		for (uint i = 1; i < refs.size() && next == refs.size(); i++)
+			if (!joined[i])
+				next = i;
+
+		ColumnNames *left_keys = new ColumnNames(), *right_keys = new ColumnNames();
+		for (auto const& equality : equalities) {
+			if (joined[equality.left] && equality.right == next) {
+				left_keys->push_back(equality.left_column);
+				right_keys->push_back(equality.right_column);
+			}
+			else if (joined[equality.right] && equality.left == next) {
+				left_keys->push_back(equality.right_column);
+				right_keys->push_back(equality.left_column);
+			}
+		}
+		joined[next] = true;
+		EvalExpr *filter = nullptr;
+		for (auto& residual : residuals) {
+			bool ready = residual.condition != nullptr;
+			for (auto const& table : residual.tables)
+				ready = ready && joined[table];
+			if (ready)
+				filter = filter == nullptr ? residual.condition.release()
+					: new EvalExpr(EvalExpr::And, filter, residual.condition.release());
+		}
+		plan = new EvalPlan(plan, step == 1 ? aliases[0] : "", scan(next), aliases[next], left_keys, right_keys,
+			filter);
+	}
+	if (aggregating)
+		plan = new EvalPlan(new ColumnNames(group_by), new AggregateFunctions(aggregates),
+			new EvalPlan(new ColumnNames(input), plan));
+	else if (project_all)
+		plan = new EvalPlan(EvalPlan::ProjectAll, plan);
+	else
+		plan = new EvalPlan(new ColumnNames(qualified_names), plan);
+	try {
+		plan = get_sort_plan(statement, qualified_names, *column_names, plan);
+	}
+	catch (...) {
+		delete plan;
+		delete column_names;
+		delete column_attributes;
+		throw;
+	}
+
+	EvalPlan *optimized = plan->optimize();
+	ValueDicts *rows = optimized->evaluate();
+	delete plan;
+	delete optimized;
+
+	// rename the columns from their qualified names to the ones shown
+	rename_columns(rows, qualified_names, *column_names);
+	return new QueryResult(column_names, column_attributes, rows,
+		"successfully returned " + std::to_string(rows->size()) + " rows");
+}
+
 // SQL: DELETE ...
 QueryResult *SQLExec::del(const hsql::DeleteStatement *statement) {
 	Identifier table_name = statement->tableName;
@@ -225,32 +951,37 @@ QueryResult *SQLExec::del(const hsql::DeleteStatement *statement) {
 	EvalPlan *plan = new EvalPlan(table);
 
 	// enclose that in a Select if we have a where clause
-	if (statement->expr != nullptr)
-		plan = new EvalPlan(get_where_conjunction(statement->expr), plan);
+	if (statement->expr != nullptr) {
+		plan = get_select_plan(statement->expr, table_resolver(table), plan);
+	}
 
 	// optimize the plan and evaluate the optimized plan
 	EvalPlan *optimized = plan->optimize();
 	EvalPipeline pipeline = optimized->pipeline();
 
-	// now delete all the handles
-	auto index_names = SQLExec::indices->get_index_names(table_name);
+	// now delete all the handles, a whole index at a time (partial ones only get their own rows), and from
+	// the indices before the table, since they may need the rows to find their keys
+	uint index_count = 0;
 	Handles *handles = pipeline.second;
-	for (auto const& handle : *handles) {
-		// delete from index before deleting from table
-		for (auto const& index_name : index_names) {
-			DbIndex& index = SQLExec::indices->get_index(table, index_name);
-			index.del(handle);
-		}
-		table.del(handle);
+	for (auto const& index_name : SQLExec::indices->get_index_names(table_name)) {
+		DbIndex& index = SQLExec::indices->get_index(table, index_name);
+		Handles entries;
+		for (auto const& handle : *handles)
+			if (index.includes(handle))
+				entries.push_back(handle);
+		index.del(&entries);
+		if (!entries.empty())
+			index_count++;
 	}
+	table.del(handles);
 	u_long n = handles->size();
 	delete handles;
 	delete plan;
 	delete optimized;
 
 	std::string comment = "successfully deleted " + std::to_string(n) + " rows from " + table_name;
-	if (index_names.size() > 0)
-		comment += std::string(" and ") + std::to_string(index_names.size()) + " indices";
+	if (index_count > 0)
+		comment += std::string(" and ") + std::to_string(index_count) + " indices";
 	return new QueryResult(comment);
 }
 
@@ -381,12 +1112,26 @@ QueryResult *SQLExec::create_index(const hsql::CreateStatement *statement) {
 		if (std::find(table_columns.begin(), table_columns.end(), col_name) == table_columns.end())
 			throw SQLExecError(std::string("Column '") + col_name + "' does not exist in " + table_name);
 
-	// insert a row for every column in index into _indices
+	// a partial index only has the rows matching its WHERE clause (column = literal conditions, like SELECT)
+	ValueDict predicate;
+	if (statement->select != nullptr && statement->select->whereClause != nullptr)
+		get_where_conjunction(statement->select->whereClause, &predicate);
+	for (auto const& column : predicate) {
+		ColumnNames predicate_column(1, column.first);
+		ColumnAttributes *attributes = table.get_column_attributes(predicate_column);  // throws if no such column
+		bool matches = attributes->at(0).get_data_type() == column.second.data_type;
+		delete attributes;
+		if (!matches)
+			throw SQLExecError("wrong type of value for " + column.first + " in index WHERE clause");
+	}
+
+	// insert a row for every column in index into _indices, then one for each column in the predicate
 	ValueDict row;
 	row["table_name"] = Value(table_name);
 	row["index_name"] = Value(index_name);
 	row["index_type"] = Value(statement->indexType);
 	row["is_unique"] = Value(std::string(statement->indexType) == "BTREE"); // assume HASH is non-unique -- leave uniqueness logic for another day...
+	row["predicate_value"] = Value("");
 	int seq = 0;
 	Handles i_handles;
 	try {
@@ -395,6 +1140,13 @@ QueryResult *SQLExec::create_index(const hsql::CreateStatement *statement) {
 			row["column_name"] = Value(col_name);
 			i_handles.push_back(SQLExec::indices->insert(&row));
 		}
+		row["seq_in_index"] = Value(0);
+		for (auto const& column : predicate) {
+			row["column_name"] = Value(column.first);
+			row["predicate_value"] = Value(column.second.data_type == ColumnAttribute::INT
+				? std::to_string(column.second.n) : column.second.s);
+			i_handles.push_back(SQLExec::indices->insert(&row));
+		}
 
 		DbIndex &index = SQLExec::indices->get_index(table, index_name);
 		index.create();
@@ -426,7 +1178,8 @@ QueryResult *SQLExec::drop(const hsql::DropStatement *statement) {
 
 QueryResult *SQLExec::drop_table(const hsql::DropStatement *statement) {
 	Identifier table_name = statement->name;
-	if (table_name == Tables::TABLE_NAME || table_name == Columns::TABLE_NAME)
+	if (table_name == Tables::TABLE_NAME || table_name == Columns::TABLE_NAME
+		|| table_name == Statistics::TABLE_NAME)
 		throw SQLExecError("cannot drop a schema table");
 
 	ValueDict where;
@@ -461,6 +1214,13 @@ QueryResult *SQLExec::drop_table(const hsql::DropStatement *statement) {
 		columns.del(handle);
 	delete handles;
 
+	// and any statistics about it
+	DbRelation& statistics = SQLExec::tables->get_table(Statistics::TABLE_NAME);
+	handles = statistics.select(&where);
+	for (auto const& handle : *handles)
+		statistics.del(handle);
+	delete handles;
+
 	// remove table
 	table.drop();
 
@@ -525,6 +1285,9 @@ QueryResult *SQLExec::show_index(const hsql::ShowStatement *statement) {
 	column_names->push_back("is_unique");
 	column_attributes->push_back(ColumnAttribute(ColumnAttribute::BOOLEAN));
 
+	column_names->push_back("predicate_value");
+	column_attributes->push_back(ColumnAttribute(ColumnAttribute::TEXT));
+
 	ValueDict where;
 	where["table_name"] = statement->tableName;
 	Handles* handles = SQLExec::indices->select(&where);
@@ -550,7 +1313,7 @@ QueryResult *SQLExec::show_tables() {
 	column_attributes->push_back(ColumnAttribute(ColumnAttribute::TEXT));
 
 	Handles* handles = SQLExec::tables->select();
-	u_long n = handles->size() - 3;
+	u_long n = handles->size() - 4;
 
 	ValueDicts* rows = new ValueDicts;
 	for (auto const& handle : *handles) {
@@ -558,10 +1321,14 @@ QueryResult *SQLExec::show_tables() {
 		Identifier table_name = row->at("table_name").s;
 		if (table_name != Tables::TABLE_NAME
 			&& table_name != Columns::TABLE_NAME
-			&& table_name != Indices::TABLE_NAME) {
+			&& table_name != Indices::TABLE_NAME
+			&& table_name != Statistics::TABLE_NAME) {
 
 			rows->push_back(row);
 		}
+		else {
+			delete row;
+		}
 	}
 	delete handles;
 	return new QueryResult(column_names, column_attributes, rows,
@@ -599,3 +1366,261 @@ QueryResult *SQLExec::show_columns(const hsql::ShowStatement *statement) {
 	return new QueryResult(column_names, column_attributes, rows,
 		"successfully returned " + std::to_string(n) + " rows");
 }
+
+// Run one SQL statement for test_sql_exec, giving back its rows as "value|value|..." in the result's column order.
+static std::vector<std::string> test_query(const std::string &sql) {
+	std::unique_ptr<hsql::SQLParserResult> parse(SQLExec::parse(sql));
+	if (!parse->isValid())
+		throw SQLExecError("invalid SQL: " + sql);
+	std::unique_ptr<QueryResult> result(SQLExec::execute(parse->getStatement(0)));
+	std::vector<std::string> ret;
+	if (result->get_rows() == nullptr)
+		return ret;
+	for (auto const& row : *result->get_rows()) {
+		std::string text;
+		for (auto const& column_name : *result->get_column_names()) {
+			const Value &value = row->at(column_name);
+			text += (text.empty() ? "" : "|") + (value.data_type == ColumnAttribute::TEXT ? value.s : std::to_string(value.n));
+		}
+		ret.push_back(text);
+	}
+	return ret;
+}
+
+// A query for test_sql_exec and the rows it should give (in that order if ordered, in any order if not).
+struct TestSQLQuery {
+	std::string sql;
+	std::vector<std::string> expected;
+	bool ordered;
+};
+
+// Run each query against one pair of tables (named {t} and {j} in the SQL).
+static bool test_sql_queries(const std::vector<TestSQLQuery> &queries, const std::string &t, const std::string &j,
+	const std::string &when) {
+	for (auto const& query : queries) {
+		std::string sql = query.sql;
+		for (size_t at; (at = sql.find("{t}")) != std::string::npos; )
+			sql.replace(at, 3, t);
+		for (size_t at; (at = sql.find("{j}")) != std::string::npos; )
+			sql.replace(at, 3, j);
+		std::vector<std::string> rows = test_query(sql), expected = query.expected;
+		if (!query.ordered) {
+			std::sort(rows.begin(), rows.end());
+			std::sort(expected.begin(), expected.end());
+		}
+		if (rows != expected) {
+			std::cout << "wrong rows " << when << " for " << sql << " (" << rows.size() << " rows, expected "
+				<< expected.size() << ")" << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+// Queries through the whole of SQLExec and EvalPlan, each checked against rows worked out here: WHERE clauses
+// (with and without the specialized kernels), ORDER BY and LIMIT, aggregation, joins of each kind, and
+// projections. They run against BTREE tables (with indices) and heap tables, before and after ANALYZE, and then
+// again with so little memory that joins, sorts and aggregates all spill to disk.
+bool test_sql_exec() {
+	const int N = 300, M = 450;
+	const char *tables[] = { "tsql_bt", "tsql_bj", "tsql_ht", "tsql_hj" };
+	auto drop_tables = [&tables]() {
+		for (auto const& table : tables) {
+			try {
+				test_query(std::string("DROP TABLE ") + table);
+			}
+			catch (SQLExecError &e) {}
+		}
+	};
+	drop_tables();
+	u_long join_memory = EvalPlan::join_memory, sort_memory = EvalPlan::sort_memory;
+	u_long aggregate_memory = EvalPlan::aggregate_memory;
+	auto restore = [&]() {
+		EvalPlan::join_memory = join_memory;
+		EvalPlan::sort_memory = sort_memory;
+		EvalPlan::aggregate_memory = aggregate_memory;
+		EvalExpr::specialize = true;
+		drop_tables();
+	};
+
+	// {t}: id, g = id % 7, s = "s" + id % 11; {j}: id, k (an id of {t} for most rows), w = "w" + id % 4
+	struct TRow { int id, g; std::string s; };
+	struct JRow { int id, k; std::string w; };
+	std::vector<TRow> t_rows;
+	std::vector<JRow> j_rows;
+	try {
+		test_query("CREATE TABLE tsql_bt (id INT, g INT, s TEXT, PRIMARY KEY (id))");
+		test_query("CREATE TABLE tsql_ht (id INT, g INT, s TEXT)");
+		test_query("CREATE TABLE tsql_bj (id INT, k INT, w TEXT, PRIMARY KEY (id))");
+		test_query("CREATE TABLE tsql_hj (id INT, k INT, w TEXT)");
+		for (int i = 0; i < N; i++) {
+			TRow row = { i * 7 % N, i * 7 % N % 7, "s" + std::to_string(i * 7 % N % 11) };
+			t_rows.push_back(row);
+			std::string values = " VALUES (" + std::to_string(row.id) + ", " + std::to_string(row.g) + ", \""
+				+ row.s + "\")";
+			test_query("INSERT INTO tsql_bt" + values);
+			test_query("INSERT INTO tsql_ht" + values);
+		}
+		for (int i = 0; i < M; i++) {
+			JRow row = { i * 11 % M, i * 11 % M * 13 % (N + 50), "w" + std::to_string(i * 11 % M % 4) };
+			j_rows.push_back(row);
+			std::string values = " VALUES (" + std::to_string(row.id) + ", " + std::to_string(row.k) + ", \""
+				+ row.w + "\")";
+			test_query("INSERT INTO tsql_bj" + values);
+			test_query("INSERT INTO tsql_hj" + values);
+		}
+		test_query("CREATE INDEX tsql_bt_g ON tsql_bt USING BTREE (g, id)");
+		test_query("CREATE INDEX tsql_bj_k ON tsql_bj USING HASH (k)");
+	}
+	catch (...) {
+		restore();
+		throw;
+	}
+	std::sort(t_rows.begin(), t_rows.end(), [](const TRow &a, const TRow &b) { return a.id < b.id; });
+	std::sort(j_rows.begin(), j_rows.end(), [](const JRow &a, const JRow &b) { return a.id < b.id; });
+
+	std::vector<TestSQLQuery> queries;
+	auto where = [&](const std::string &condition, const std::function<bool(const TRow&)> &keep) {
+		TestSQLQuery query = { "SELECT id, s FROM {t} WHERE " + condition, {}, false };
+		for (auto const& row : t_rows)
+			if (keep(row))
+				query.expected.push_back(std::to_string(row.id) + "|" + row.s);
+		queries.push_back(query);
+	};
+	where("g = 3 AND s <> \"s5\"", [](const TRow &r) { return r.g == 3 && r.s != "s5"; });
+	where("id BETWEEN 40 AND 60 OR g < 1", [](const TRow &r) { return (r.id >= 40 && r.id <= 60) || r.g < 1; });
+	where("g >= id", [](const TRow &r) { return r.g >= r.id; });
+	where("s > \"s7\" AND id % 2 = 0", [](const TRow &r) { return r.s > "s7" && r.id % 2 == 0; });
+	where("id > 250 AND NOT g = 1", [](const TRow &r) { return r.id > 250 && r.g != 1; });
+	where("g BETWEEN 2 AND 3 AND id < 100", [](const TRow &r) { return r.g >= 2 && r.g <= 3 && r.id < 100; });
+
+	// ORDER BY, with and without a LIMIT (which keeps just the top rows while sorting)
+	TestSQLQuery query = { "SELECT id, g FROM {t} ORDER BY g DESC, id LIMIT 10 OFFSET 5", {}, true };
+	std::vector<TRow> sorted = t_rows;
+	std::stable_sort(sorted.begin(), sorted.end(), [](const TRow &a, const TRow &b) { return a.g > b.g; });
+	for (int i = 5; i < 15; i++)
+		query.expected.push_back(std::to_string(sorted[i].id) + "|" + std::to_string(sorted[i].g));
+	queries.push_back(query);
+	query = { "SELECT s, id FROM {t} ORDER BY s, id DESC", {}, true };
+	sorted = t_rows;
+	std::sort(sorted.begin(), sorted.end(), [](const TRow &a, const TRow &b) {
+		return a.s != b.s ? a.s < b.s : a.id > b.id; });
+	for (auto const& row : sorted)
+		query.expected.push_back(row.s + "|" + std::to_string(row.id));
+	queries.push_back(query);
+
+	// LIMIT and OFFSET on the key, which a BTREE table streams in order (either way) so the scan stops early
+	query = { "SELECT id FROM {t} ORDER BY id LIMIT 10 OFFSET 100", {}, true };
+	for (int id = 100; id < 110; id++)
+		query.expected.push_back(std::to_string(id));
+	queries.push_back(query);
+	query = { "SELECT id FROM {t} ORDER BY id DESC LIMIT 5", {}, true };
+	for (int id = N - 1; id >= N - 5; id--)
+		query.expected.push_back(std::to_string(id));
+	queries.push_back(query);
+	query = { "SELECT id FROM {t} WHERE id < 50 ORDER BY id DESC", {}, true };
+	for (int id = 49; id >= 0; id--)
+		query.expected.push_back(std::to_string(id));
+	queries.push_back(query);
+
+	// aggregation: grouped (few groups and many), and MIN and MAX of a whole table
+	query = { "SELECT g, COUNT(*), SUM(id), MIN(s), MAX(id) FROM {t} GROUP BY g ORDER BY g DESC", {}, true };
+	for (int g = 6; g >= 0; g--) {
+		int count = 0, sum = 0, max = 0;
+		std::string min;
+		for (auto const& row : t_rows)
+			if (row.g == g) {
+				if (count++ == 0 || row.s < min)
+					min = row.s;
+				sum += row.id;
+				max = std::max(max, row.id);
+			}
+		query.expected.push_back(std::to_string(g) + "|" + std::to_string(count) + "|" + std::to_string(sum) + "|"
+			+ min + "|" + std::to_string(max));
+	}
+	queries.push_back(query);
+	query = { "SELECT k, COUNT(*), MIN(w) FROM {j} GROUP BY k", {}, false };
+	std::map<int, std::pair<int, std::string>> groups;
+	for (auto const& row : j_rows) {
+		auto found = groups.find(row.k);
+		if (found == groups.end())
+			groups[row.k] = std::make_pair(1, row.w);
+		else
+			found->second = std::make_pair(found->second.first + 1, std::min(found->second.second, row.w));
+	}
+	for (auto const& group : groups)
+		query.expected.push_back(std::to_string(group.first) + "|" + std::to_string(group.second.first) + "|"
+			+ group.second.second);
+	queries.push_back(query);
+	queries.push_back({ "SELECT MIN(id), MAX(id), MAX(g) FROM {t}", { "0|" + std::to_string(N - 1) + "|6" }, true });
+	queries.push_back({ "SELECT MAX(id), MIN(s) FROM {t} WHERE g = 4", { "298|s0" }, true });
+
+	// projections: just the columns asked for, which a heap scan alone decodes
+	query = { "SELECT s FROM {t} WHERE id < 30", {}, false };
+	for (int id = 0; id < 30; id++)
+		query.expected.push_back(t_rows[id].s);
+	queries.push_back(query);
+	query = { "SELECT w, id FROM {j} WHERE k = 13", {}, false };
+	for (auto const& row : j_rows)
+		if (row.k == 13)
+			query.expected.push_back(row.w + "|" + std::to_string(row.id));
+	queries.push_back(query);
+
+	// joins, with just the columns asked for coming back: on columns neither table is keyed or indexed on, on
+	// {t}'s key (a merge join between BTREE tables), through {j}'s index on k, and three ways
+	query = { "SELECT x.id, y.w FROM {t} AS x JOIN {j} AS y ON x.g = y.id", {}, false };
+	for (auto const& row : t_rows)
+		query.expected.push_back(std::to_string(row.id) + "|" + j_rows[row.g].w);
+	queries.push_back(query);
+	query = { "SELECT x.id, y.w FROM {t} AS x JOIN {j} AS y ON x.id = y.id", {}, false };
+	for (int id = 0; id < std::min(N, M); id++)
+		query.expected.push_back(std::to_string(id) + "|" + j_rows[id].w);
+	queries.push_back(query);
+	query = { "SELECT x.s, y.id FROM {t} AS x, {j} AS y WHERE x.id = y.k AND x.g = 2", {}, false };
+	for (auto const& row : j_rows)
+		if (row.k < N && t_rows[row.k].g == 2)
+			query.expected.push_back(t_rows[row.k].s + "|" + std::to_string(row.id));
+	queries.push_back(query);
+	query = { "SELECT x.g, y.w, z.s FROM {t} AS x, {j} AS y, {t} AS z "
+		"WHERE x.id = y.k AND z.id = y.id AND y.w = \"w1\"", {}, false };
+	for (auto const& row : j_rows)
+		if (row.k < N && row.id < N && row.w == "w1")
+			query.expected.push_back(std::to_string(t_rows[row.k].g) + "|" + row.w + "|" + t_rows[row.id].s);
+	queries.push_back(query);
+	query = { "SELECT x.id, y.id FROM {t} AS x JOIN {j} AS y ON x.id = y.k WHERE x.id + y.id < 40", {}, false };
+	for (auto const& row : j_rows)
+		if (row.k < N && row.k + row.id < 40)
+			query.expected.push_back(std::to_string(row.k) + "|" + std::to_string(row.id));
+	queries.push_back(query);
+
+	bool ok = true;
+	try {
+		for (int specialize = 1; ok && specialize >= 0; specialize--) {
+			EvalExpr::specialize = specialize == 1;
+			std::string when = specialize ? "with kernels" : "without kernels";
+			ok = test_sql_queries(queries, "tsql_bt", "tsql_bj", when)
+				&& test_sql_queries(queries, "tsql_ht", "tsql_hj", when);
+		}
+		EvalExpr::specialize = true;
+		if (ok) {
+			test_query("ANALYZE");
+			ok = test_sql_queries(queries, "tsql_bt", "tsql_bj", "after ANALYZE")
+				&& test_sql_queries(queries, "tsql_ht", "tsql_hj", "after ANALYZE");
+		}
+		if (ok) {
+			EvalPlan::join_memory = 2000;
+			EvalPlan::sort_memory = 2000;
+			EvalPlan::aggregate_memory = 1000;
+			ok = test_sql_queries(queries, "tsql_bt", "tsql_bj", "spilling")
+				&& test_sql_queries(queries, "tsql_ht", "tsql_hj", "spilling")
+				&& test_sql_queries(queries, "tsql_bt", "tsql_hj", "spilling")
+				&& test_sql_queries(queries, "tsql_ht", "tsql_bj", "spilling");
+		}
+	}
+	catch (...) {
+		restore();
+		throw;
+	}
+	restore();
+	return ok;
+}
@@ -12,6 +12,15 @@ public:
 };
 
 
+// ANALYZE [table]: hsql's grammar doesn't have it, so SQLExec::parse builds these itself. hsql has no statement
+// type for it either, so it borrows ALTER's; execute tells it apart by its class, not its type.
+struct AnalyzeStatement : hsql::SQLStatement {
+    AnalyzeStatement(Identifier table_name) : SQLStatement(hsql::kStmtAlter), table_name(table_name) {}
+
+    Identifier table_name;  // "" for every table
+};
+
+
 class QueryResult {
 public:
     QueryResult() : column_names(nullptr), column_attributes(nullptr), rows(nullptr), message("") {}
@@ -41,6 +50,8 @@ protected:
 class SQLExec {
 public:
     static QueryResult *execute(const hsql::SQLStatement *statement) throw(SQLExecError);
+    // hsql's parser, plus CREATE INDEX ... WHERE and ANALYZE
+    static hsql::SQLParserResult *parse(const std::string &sql);
 	static Tables& test_get_tables()
 	{
 		if (tables == nullptr)
@@ -65,10 +76,15 @@ protected:
     static QueryResult *show_columns(const hsql::ShowStatement *statement);
     static QueryResult *show_index(const hsql::ShowStatement *statement);
 
+    static QueryResult *analyze(const AnalyzeStatement *statement);
+
     static QueryResult *insert(const hsql::InsertStatement *statement);
     static QueryResult *del(const hsql::DeleteStatement *statement);
     static QueryResult *select(const hsql::SelectStatement *statement);
+    static QueryResult *select_join(const hsql::SelectStatement *statement);
 
     static bool column_definition(const hsql::ColumnDefinition *col, Identifier &column_name,
                                   ColumnAttribute &column_attribute, ColumnNames* &primary_key);
 };
+
+bool test_sql_exec();
@@ -2,6 +2,9 @@
 #include "btree.h"
 #include <string>
 #include <iterator>
+#include <chrono>
+#include <memory>
+#include <malloc.h>
 #include "SQLExec.h"
 #include "ParseTreeToString.h"
 
@@ -19,7 +22,12 @@ BTreeBase::BTreeBase(DbRelation& relation, Identifier name, ColumnNames key_colu
 	root(nullptr),
 	closed(true),
 	file(relation.get_table_name() + "-" + name),
-	key_profile() {
+	key_profile(),
+	bloom(file),
+	loading(false),
+	adaptive(true),
+	adaptive_leaves(),
+	adaptive_counts() {
 	if (!unique)
 		throw DbRelationError("BTree index must have unique key");
 	build_key_profile();
@@ -39,15 +47,23 @@ void BTreeBase::create() {
 
 	Handles *handles = nullptr;
 	try {
-		// now build the index! -- add every row from relation into index
+		// now build the index! -- add every row from relation (that the predicate lets in) into index
 		//this->file.begin_write();
-		handles = this->relation.select();
+		handles = this->relation.select(this->predicate.empty() ? nullptr : &this->predicate);
+		this->bloom.clear();
+		this->bloom.create(handles->size());
+		this->stat->set_bloom(this->bloom.get_first(), this->bloom.get_blocks());
+		this->stat->save();
+		this->loading = true;
 		for (auto const &handle : *handles)
 			insert(handle);
+		this->loading = false;
+		this->bloom.save();
 		//this->file.end_write();
 		delete handles;
 	}
 	catch (...) {
+		this->loading = false;
 		delete handles;
 		drop();
 		throw;
@@ -58,6 +74,9 @@ void BTreeBase::create() {
 void BTreeBase::drop() {
 	this->file.drop();
 	this->closed = true;
+	this->bloom.clear();
+	this->adaptive_leaves.clear();
+	this->adaptive_counts.clear();
 }
 
 // Open existing index. Enables: lookup, range, insert, delete, update.
@@ -69,6 +88,7 @@ void BTreeBase::open() {
 			this->root = make_leaf(this->stat->get_root_id(), false);
 		else
 			this->root = new BTreeInterior(this->file, this->stat->get_root_id(), this->key_profile, false);
+		this->bloom.load(this->stat->get_bloom_first(), this->stat->get_bloom_blocks());
 		this->closed = false;
 	}
 }
@@ -81,75 +101,196 @@ void BTreeBase::close() {
 	delete this->root;
 	this->root = nullptr;
 	this->closed = true;
+	this->bloom.clear();
+	this->adaptive_leaves.clear();
+	this->adaptive_counts.clear();
 }
 
 // Find all the rows whose columns are equal to key. Assumes key is a dictionary whose keys are the column
 // names in the index. Returns a list of row handles.
 Handles* BTreeBase::lookup(ValueDict* key_dict) {
 	open();
-	KeyValue *key = tkey(key_dict);
-	BTreeLeafBase *leaf = _lookup(this->root, this->stat->get_height(), key);
+	std::unique_ptr<KeyValue> key(tkey(key_dict));
 	Handles *handles = new Handles();
-	try {
-		BTreeLeafValue value = leaf->find_eq(key);
-		handles->push_back(value.h);
+	if (!might_contain(key.get()))
+		return handles;
+	BTreeLeafBase *leaf = _probe_leaf(key.get());
+	BTreeLeafValue value;
+	if (leaf->probe(key.get(), value))
+		handles->push_back(locator(value));
+	delete value.vd;
+	if (leaf != this->root)
+		delete leaf;
+	return handles;
+}
+
+// Is there an entry for this key?
+bool BTreeBase::contains(const KeyValue* key) {
+	open();
+	if (!might_contain(key))
+		return false;
+	BTreeLeafBase *leaf = _probe_leaf(key);
+	BTreeLeafValue value;
+	bool found = leaf->probe(key, value);
+	delete value.vd;
+	if (leaf != this->root)
+		delete leaf;
+	return found;
+}
+
+// A lookup reads one block per level.
+uint BTreeBase::lookup_cost() {
+	open();
+	return this->stat->get_height();
+}
+
+// Descend to the leaf where key belongs for a point lookup. Below the root, nodes are searched right on
+// their blocks and freed as we go, and the leaf's entries are left on the block for BTreeLeafBase::probe.
+// Keys in the adaptive hash go straight to their leaf.
+BTreeLeafBase* BTreeBase::_probe_leaf(const KeyValue* key) {
+	uint height = this->stat->get_height();
+	std::string encoded;
+	if (this->adaptive && height > 1) {
+		encoded = BTreeKey::encode(*key);
+		auto hit = this->adaptive_leaves.find(encoded);
+		if (hit != this->adaptive_leaves.end())
+			return make_leaf(hit->second, false, false);
+	}
+
+	BTreeNode *node = this->root;
+	for (uint depth = height; depth > 1; depth--) {
+		BTreeInterior *interior = (BTreeInterior *)node;
+		BlockID down = node == this->root ? interior->find(key) : interior->probe(key);
+		if (node != this->root)
+			delete node;
+		if (depth - 1 == 1)
+			node = make_leaf(down, false, false);
+		else
+			node = new BTreeInterior(this->file, down, this->key_profile, false, false);
 	}
-	catch (std::out_of_range &e) {
-		; // not found, so we return an empty list
+
+	// remember keys that keep coming back (starting over when either table gets too big)
+	if (this->adaptive && height > 1 && ++this->adaptive_counts[encoded] >= ADAPTIVE_THRESHOLD) {
+		if (this->adaptive_leaves.size() >= ADAPTIVE_MAX)
+			this->adaptive_leaves.clear();
+		this->adaptive_leaves[encoded] = node->get_id();
+		this->adaptive_counts.erase(encoded);
 	}
-	delete key;
-	return handles;
+	if (this->adaptive_counts.size() >= ADAPTIVE_MAX * ADAPTIVE_THRESHOLD)
+		this->adaptive_counts.clear();
+	return (BTreeLeafBase *)node;
+}
+
+// Turn the adaptive hash on or off (off also empties it).
+void BTreeBase::set_adaptive_hash(bool on) {
+	this->adaptive = on;
+	this->adaptive_leaves.clear();
+	this->adaptive_counts.clear();
+}
+
+// The first block of the Bloom filter and how many blocks it has.
+void BTreeBase::bloom_blocks(BlockID &first, uint &blocks) {
+	open();
+	first = this->bloom.get_first();
+	blocks = this->bloom.get_blocks();
+}
+
+// The number of boundaries in the root and the bytes they take up on its block (both 0 for a leaf root).
+void BTreeBase::root_boundaries(uint &boundaries, uint &bytes) {
+	open();
+	boundaries = bytes = 0;
+	if (this->stat->get_height() == 1)
+		return;
+	BTreeInterior *root = (BTreeInterior *)this->root;
+	boundaries = root->child_count() - 1;
+	bytes = root->stored_boundary_bytes();
 }
 
-// Recursive lookup.
+// Entries have moved in or out of this leaf (split, merge, or redistribution), so the adaptive hash can't
+// vouch for any key it has there any more.
+void BTreeBase::forget_leaf(BlockID leaf_id) {
+	for (auto it = this->adaptive_leaves.begin(); it != this->adaptive_leaves.end(); ) {
+		if (it->second == leaf_id)
+			it = this->adaptive_leaves.erase(it);
+		else
+			++it;
+	}
+}
+
+// Recursive lookup. The interior nodes along the way are freed; the leaf is the caller's (unless it is the root).
 BTreeLeafBase* BTreeBase::_lookup(BTreeNode *node, uint depth, const KeyValue* key) {
 	if (depth == 1) { // base case: leaf
 		return (BTreeLeafBase *)node;
 	}
 	else { // interior node: find the block to go to in the next level down and recurse there
 		BTreeInterior *interior = (BTreeInterior *)node;
-		return _lookup(find(interior, depth, key), depth - 1, key);
+		BTreeNode *down = find(interior, depth, key);
+		BTreeLeafBase *leaf = _lookup(down, depth - 1, key);
+		if (down != leaf)
+			delete down;
+		return leaf;
 	}
 }
 
+// Descend to the last leaf that can hold a key starting with prefix (along the right edge of the tree to the
+// very last leaf if there's no prefix).
+BTreeLeafBase* BTreeBase::_last_leaf(BTreeNode *node, uint depth, const BTreeKey *prefix) {
+	if (depth == 1)
+		return (BTreeLeafBase *)node;
+	BTreeInterior *interior = (BTreeInterior *)node;
+	uint child = prefix == nullptr ? interior->child_count() - 1 : interior->find_last_child(prefix->bytes);
+	BTreeNode *down = make_node(interior->get_child(child), depth - 1);
+	BTreeLeafBase *leaf = _last_leaf(down, depth - 1, prefix);
+	if (down != leaf)
+		delete down;
+	return leaf;
+}
+
+// All the entries from tmin to tmax.
 Handles* BTreeBase::_range(KeyValue *tmin, KeyValue *tmax, bool return_keys) {
-	Handles *results = new Handles();
-	BTreeLeafBase *start = _lookup(this->root, this->stat->get_height(), tmin);
-	for (auto const& mval : start->get_key_map()) {
-		if (tmax != nullptr && mval.first > *tmax)
-			return results;
-		if (tmin == nullptr || mval.first >= *tmin) {
-			if (return_keys)
-				results->push_back(Handle(mval.first));
-			else
-				results->push_back(Handle(mval.second.h));
-		}
-	}
-	BlockID next_leaf_id = start->get_next_leaf();
-	while (next_leaf_id > 0) {
-		BTreeLeafBase *next_leaf = this->make_leaf(next_leaf_id, false);
-		for (auto const& mval : next_leaf->get_key_map()) {
-			if (tmax != nullptr && mval.first > *tmax)
-				return results;
-			if (return_keys)
-				results->push_back(Handle(mval.first));
-			else
-				results->push_back(Handle(mval.second.h));
-		}
-		next_leaf_id = next_leaf->get_next_leaf();
-	}
-	return results;
+	BTreeCursor cursor(*this, tmin, tmax, return_keys);
+	return cursor.fetch(0);
+}
+
+// Cursor over the entries from tmin to tmax. Caller is responsible for deleting it.
+BTreeCursor *BTreeBase::cursor(const KeyValue *tmin, const KeyValue *tmax, bool return_keys) {
+	return new BTreeCursor(*this, tmin, tmax, return_keys);
+}
+
+// Cursor over the entries from tmax down to tmin. Caller is responsible for deleting it.
+BTreeReverseCursor *BTreeBase::reverse_cursor(const KeyValue *tmin, const KeyValue *tmax, bool return_keys) {
+	return new BTreeReverseCursor(*this, tmin, tmax, return_keys);
 }
 
 // Insert a row with the given handle. Row must exist in relation already.
 void BTreeBase::insert(Handle handle) {
 	ValueDict *row = this->relation.project(handle, &this->key_columns);
-	KeyValue *key = tkey(row);
+	std::unique_ptr<KeyValue> key(tkey(row));
 	delete row;
+	add_entry(key.get(), handle);
+}
 
-	Insertion split = _insert(this->root, this->stat->get_height(), key, handle);
+// Put an entry in the tree (growing it up a level if the root splits) and its key in the Bloom filter.
+void BTreeBase::add_entry(const KeyValue* key, BTreeLeafValue value) {
+	Insertion split = _insert(this->root, this->stat->get_height(), key, value);
 	if (!BTreeNode::insertion_is_none(split))
 		split_root(split);
+	if (!this->bloom.add(BTreeKey::encode(*key), !this->loading) && !this->loading)
+		grow_bloom();
+}
+
+// The Bloom filter is getting too full to screen out many lookups, so build a new one with plenty of room
+// from all the keys now in the tree. It reuses the old one's blocks and adds blocks only for the extra room.
+void BTreeBase::grow_bloom() {
+	std::vector<std::string> keys;
+	for (BTreeCursor entries(*this, nullptr, nullptr, false); !entries.at_end(); entries.next())
+		keys.push_back(BTreeKey::encode(entries.key()));
+	this->bloom.create(keys.size());
+	for (auto const& key : keys)
+		this->bloom.add(key, false);
+	this->bloom.save();
+	this->stat->set_bloom(this->bloom.get_first(), this->bloom.get_blocks());
+	this->stat->save();
 }
 
 // if we split the root grow the tree up one level
@@ -163,6 +304,7 @@ void BTreeBase::split_root(Insertion insertion) {
 	this->stat->set_root_id(root->get_id());
 	this->stat->set_height(this->stat->get_height() + 1);
 	this->stat->save();
+	delete this->root;
 	this->root = root;
 }
 
@@ -174,12 +316,25 @@ Insertion BTreeBase::_insert(BTreeNode *node, uint depth, const KeyValue* key, B
 			return leaf->insert(key, leaf_value);
 		}
 		catch (DbBlockNoRoomError &e) {
-			return leaf->split(make_leaf(0, true), key, leaf_value);
+			forget_leaf(leaf->get_id());
+			BTreeLeafBase *new_leaf = make_leaf(0, true);
+			Insertion insertion = leaf->split(new_leaf, key, leaf_value);
+			delete new_leaf;
+			return insertion;
 		}
 	}
 	else {
 		BTreeInterior *interior = (BTreeInterior *)node;
-		Insertion new_kid = _insert(find(interior, depth, key), depth - 1, key, leaf_value);
+		BTreeNode *down = find(interior, depth, key);
+		Insertion new_kid;
+		try {
+			new_kid = _insert(down, depth - 1, key, leaf_value);
+		}
+		catch (...) {
+			delete down;
+			throw;
+		}
+		delete down;
 		if (!BTreeNode::insertion_is_none(new_kid)) {
 			BlockID nnode = new_kid.first;
 			KeyValue boundary = new_kid.second;
@@ -191,29 +346,179 @@ Insertion BTreeBase::_insert(BTreeNode *node, uint depth, const KeyValue* key, B
 
 // Call the interior node's find method and construct an appropriate BTreeNode at the next level with the response
 BTreeNode *BTreeBase::find(BTreeInterior *node, uint height, const KeyValue* key) {
-	BlockID down = node->find(key);
-	if (height == 2)
-		return make_leaf(down, false);
+	return make_node(node->find(key), height - 1);
+}
+
+// Construct the node at the given depth (depth 1 is the leaf level)
+BTreeNode *BTreeBase::make_node(BlockID id, uint depth) {
+	if (depth == 1)
+		return make_leaf(id, false);
 	else
-		return new BTreeInterior(this->file, down, this->key_profile, false);
+		return new BTreeInterior(this->file, id, this->key_profile, false);
 }
 
 // Delete an index entry
 void BTreeBase::del(Handle handle)
 {
-	KeyValue* d_tkey = &handle.key_value;
-	BTreeLeafBase* leaf = _lookup(root, stat->get_height(), d_tkey);
+	open();
+	std::unique_ptr<KeyValue> key(entry_key(handle));
+	_del(this->root, this->stat->get_height(), key.get());
+	shrink_root();
+}
 
-	LeafMap& leaf_keys = leaf->get_key_map();
-	if (leaf_keys.find(*d_tkey) == leaf_keys.end())
-	{
-		throw DbRelationError("key to be deleted not found in index");
+// Delete a batch of index entries. The keys are sorted and split up among the children on the way down, so
+// every node is saved once however many of the keys it had, and underfull nodes are only fixed up after
+// all their keys are gone.
+void BTreeBase::del(const Handles* handles)
+{
+	open();
+	BTreeKeys keys;
+	for (auto const& handle : *handles) {
+		std::unique_ptr<KeyValue> key(entry_key(handle));
+		keys.push_back(BTreeKey(*key));
+	}
+	if (keys.empty())
+		return;
+	std::sort(keys.begin(), keys.end());
+	_del(this->root, this->stat->get_height(), keys.cbegin(), keys.cend());
+	shrink_root();
+}
+
+// The key of the entry for a row. Caller is responsible for deleting it.
+KeyValue *BTreeBase::entry_key(Handle handle) {
+	const ColumnNames *primary_key = this->relation.get_primary_key();
+	if (!handle.key_value.empty() && primary_key != nullptr && *primary_key == this->key_columns) {
+		// the relation is organized by this key, so the handle is the key
+		return new KeyValue(handle.key_value);
+	}
+	// the row must still be there so we can get its key
+	std::unique_ptr<ValueDict> row(this->relation.project(handle, &this->key_columns));
+	return tkey(row.get());
+}
+
+// Recursive delete. Returns whether the node at this level is left underfull.
+bool BTreeBase::_del(BTreeNode *node, uint depth, const KeyValue* key) {
+	if (depth == 1) {
+		BTreeLeafBase *leaf = (BTreeLeafBase *)node;
+		leaf->del(key);
+		return leaf->is_underfull();
+	}
+	else {
+		BTreeInterior *interior = (BTreeInterior *)node;
+		uint i = interior->find_child(key);
+		BTreeNode *child = make_node(interior->get_child(i), depth - 1);
+		try {
+			if (_del(child, depth - 1, key) && interior->child_count() > 1)
+				rebalance(interior, i, child, depth - 1);
+		}
+		catch (...) {
+			delete child;
+			throw;
+		}
+		delete child;
+		return interior->is_underfull();
+	}
+}
+
+// Recursive delete of the sorted keys from first up to last. Each child gets the run of keys that belong to
+// it, then the children left underfull are fixed up. Returns whether the node at this level is left underfull.
+bool BTreeBase::_del(BTreeNode *node, uint depth, BTreeKeys::const_iterator first, BTreeKeys::const_iterator last) {
+	if (depth == 1) {
+		BTreeLeafBase *leaf = (BTreeLeafBase *)node;
+		for (auto key = first; key != last; key++)
+			leaf->del(&key->value, false);
+		leaf->save();
+		return leaf->is_underfull();
+	}
+
+	BTreeInterior *interior = (BTreeInterior *)node;
+	std::vector<BlockID> underfull;
+	while (first != last) {
+		uint i = interior->find_child(&first->value);
+		auto end = first + 1;
+		while (end != last && interior->find_child(&end->value) == i)
+			end++;
+		BTreeNode *child = make_node(interior->get_child(i), depth - 1);
+		try {
+			if (_del(child, depth - 1, first, end))
+				underfull.push_back(child->get_id());
+		}
+		catch (...) {
+			delete child;
+			throw;
+		}
+		delete child;
+		first = end;
+	}
+
+	// a merge takes out child i, so the next one slides down into its place (unless it merged with child 1)
+	for (uint i = 0; !underfull.empty() && i < interior->child_count() && interior->child_count() > 1; ) {
+		auto it = std::find(underfull.begin(), underfull.end(), interior->get_child(i));
+		if (it == underfull.end()) {
+			i++;
+			continue;
+		}
+		underfull.erase(it);
+		BTreeNode *child = make_node(interior->get_child(i), depth - 1);
+		uint children = interior->child_count();
+		try {
+			if (child->is_underfull())  // (its sibling may have been evened out with it already)
+				rebalance(interior, i, child, depth - 1);
+		}
+		catch (...) {
+			delete child;
+			throw;
+		}
+		delete child;
+		if (interior->child_count() == children || i == 0)
+			i++;
 	}
+	return interior->is_underfull();
+}
+
+// Fix up underfull child i of parent by merging it with a sibling or, if they won't fit
+// together in one block, by evening out the entries between them.
+void BTreeBase::rebalance(BTreeInterior *parent, uint i, BTreeNode *child, uint depth) {
+	// pair the child with its left sibling if it has one, otherwise its right
+	uint right_i = i > 0 ? i : i + 1;
+	BTreeNode *sibling = make_node(parent->get_child(i > 0 ? i - 1 : i + 1), depth);
+	BTreeNode *left = i > 0 ? sibling : child;
+	BTreeNode *right = i > 0 ? child : sibling;
 
-	leaf_keys.erase(*d_tkey);
-	leaf->save();
+	if (depth == 1) {
+		BTreeLeafBase *lleaf = (BTreeLeafBase *)left;
+		BTreeLeafBase *rleaf = (BTreeLeafBase *)right;
+		forget_leaf(lleaf->get_id());
+		forget_leaf(rleaf->get_id());
+		if (lleaf->merge(rleaf))
+			parent->remove_child(right_i);
+		else
+			parent->set_boundary(right_i, lleaf->redistribute(rleaf));
+	}
+	else {
+		BTreeInterior *lnode = (BTreeInterior *)left;
+		BTreeInterior *rnode = (BTreeInterior *)right;
+		KeyValue separator = *parent->get_boundary(right_i);
+		if (lnode->merge(&separator, rnode))
+			parent->remove_child(right_i);
+		else
+			parent->set_boundary(right_i, lnode->redistribute(&separator, rnode));
+	}
+	parent->save();
+	delete sibling;
+}
 
-	//std::cout << "BTreeBase::del(Handle handle) called " << handle << " # elements erased: " << x << std::endl;	//FIXME delete
+// if the root is down to a single child, drop the tree down one level
+void BTreeBase::shrink_root() {
+	while (this->stat->get_height() > 1 && ((BTreeInterior *)this->root)->child_count() == 1) {
+		BlockID only_child = ((BTreeInterior *)this->root)->get_child(0);
+		uint height = this->stat->get_height() - 1;
+		delete this->root;
+		this->root = make_node(only_child, height);
+		this->stat->set_root_id(only_child);
+		this->stat->set_height(height);
+		this->stat->save();
+	}
 }
 
 // Figure out the data types of each key component and encode them in self.key_profile
@@ -224,44 +529,340 @@ void BTreeBase::build_key_profile() {
 	delete key_attributes;
 }
 
+KeyValue *BTreeBase::prefix_key(const ValueDict *key) const {
+	if (key == nullptr)
+		return nullptr;
+	KeyValue *kv = new KeyValue();
+	for (auto& col_name : this->key_columns) {
+		auto it = key->find(col_name);
+		if (it == key->end())
+			break;
+		kv->push_back(it->second);
+	}
+	if (kv->empty()) {
+		delete kv;
+		return nullptr;
+	}
+	return kv;
+}
+
 KeyValue *BTreeBase::tkey(const ValueDict *key) const {
+	if (key == nullptr)
+		return nullptr;
+	KeyValue *kv = new KeyValue();
 	try
 	{
-		KeyValue *kv = new KeyValue();
 		for (auto& col_name : this->key_columns)
 			kv->push_back(key->at(col_name));
 		return kv;
 	}
 	catch (...)
 	{
+		delete kv;
 		return nullptr;
 	}
 }
 
 
+/*************
+ * BTreeCursor
+ *************/
+
+BTreeCursor::BTreeCursor(BTreeBase &tree, const KeyValue *tmin, const KeyValue *tmax, bool return_keys)
+	: tree(tree), leaf(nullptr), entry(), has_max(tmax != nullptr), tmax(), return_keys(return_keys) {
+	if (tmax != nullptr)
+		this->tmax = *tmax;
+	tree.open();
+	this->leaf = tree._lookup(tree.root, tree.stat->get_height(), tmin);
+	LeafMap& key_map = this->leaf->get_key_map();
+	this->entry = tmin == nullptr ? key_map.begin() : key_map.lower_bound(*tmin);
+	skip_empty_leaves();
+}
+
+BTreeCursor::~BTreeCursor() {
+	release_leaf();
+}
+
+// Are we past tmax or out of leaves? Only as much of the key as tmax has is compared.
+bool BTreeCursor::at_end() const {
+	if (this->entry == this->leaf->get_key_map().end())
+		return true;
+	if (!this->has_max)
+		return false;
+	return BTreeKey::compare_prefix(this->entry->first.bytes, this->tmax.bytes) > 0;
+}
+
+// Move to the next entry, following next_leaf when we run off the end of this leaf.
+void BTreeCursor::next() {
+	++this->entry;
+	skip_empty_leaves();
+}
+
+// Get up to limit more entries (all the rest if limit is 0). Call again to pick up where we left off.
+Handles* BTreeCursor::fetch(uint limit) {
+	Handles *handles = new Handles();
+	while (!at_end() && (limit == 0 || handles->size() < limit)) {
+		if (this->return_keys)
+			handles->push_back(Handle(key()));
+		else
+			handles->push_back(this->tree.locator(value()));
+		next();
+	}
+	return handles;
+}
+
+// If we're at the end of the current leaf, swap it for the next one that has anything in it.
+void BTreeCursor::skip_empty_leaves() {
+	while (this->entry == this->leaf->get_key_map().end() && this->leaf->get_next_leaf() != 0) {
+		BlockID next_leaf_id = this->leaf->get_next_leaf();
+		release_leaf();
+		this->leaf = this->tree.make_leaf(next_leaf_id, false);
+		this->entry = this->leaf->get_key_map().begin();
+	}
+}
+
+// Free the current leaf (the root stays with the tree).
+void BTreeCursor::release_leaf() {
+	if (this->leaf != this->tree.root)
+		delete this->leaf;
+	this->leaf = nullptr;
+}
+
+
+/********************
+ * BTreeReverseCursor
+ ********************/
+
+BTreeReverseCursor::BTreeReverseCursor(BTreeBase &tree, const KeyValue *tmin, const KeyValue *tmax,
+	bool return_keys)
+	: tree(tree), leaf(nullptr), entry(), has_min(tmin != nullptr), tmin(), return_keys(return_keys) {
+	if (tmin != nullptr)
+		this->tmin = *tmin;
+	tree.open();
+	if (tmax == nullptr) {
+		this->leaf = tree._last_leaf(tree.root, tree.stat->get_height());
+		this->entry = this->leaf->get_key_map().crbegin();
+	}
+	else {
+		// start from the last key that starts with tmax (as BTreeCursor takes it in)
+		BTreeKey prefix(*tmax);
+		this->leaf = tree._last_leaf(tree.root, tree.stat->get_height(), &prefix);
+		LeafMap &key_map = this->leaf->get_key_map();
+		LeafMap::const_iterator past = key_map.upper_bound(prefix);
+		while (past != key_map.end() && BTreeKey::compare_prefix(past->first.bytes, prefix.bytes) <= 0)
+			++past;
+		this->entry = LeafMap::const_reverse_iterator(past);
+	}
+	skip_empty_leaves();
+}
+
+BTreeReverseCursor::~BTreeReverseCursor() {
+	release_leaf();
+}
+
+// Are we below tmin or out of leaves?
+bool BTreeReverseCursor::at_end() const {
+	if (this->entry == this->leaf->get_key_map().crend())
+		return true;
+	return this->has_min && this->entry->first < this->tmin;
+}
+
+// Move to the previous entry, following prev_leaf when we run off the front of this leaf.
+void BTreeReverseCursor::next() {
+	++this->entry;
+	skip_empty_leaves();
+}
+
+// Get up to limit more entries (all the rest if limit is 0). Call again to pick up where we left off.
+Handles* BTreeReverseCursor::fetch(uint limit) {
+	Handles *handles = new Handles();
+	while (!at_end() && (limit == 0 || handles->size() < limit)) {
+		if (this->return_keys)
+			handles->push_back(Handle(key()));
+		else
+			handles->push_back(this->tree.locator(value()));
+		next();
+	}
+	return handles;
+}
+
+// If we're at the front of the current leaf, swap it for the previous one that has anything in it.
+void BTreeReverseCursor::skip_empty_leaves() {
+	while (this->entry == this->leaf->get_key_map().crend() && this->leaf->get_prev_leaf() != 0) {
+		BlockID prev_leaf_id = this->leaf->get_prev_leaf();
+		release_leaf();
+		this->leaf = this->tree.make_leaf(prev_leaf_id, false);
+		this->entry = this->leaf->get_key_map().crbegin();
+	}
+}
+
+// Free the current leaf (the root stays with the tree).
+void BTreeReverseCursor::release_leaf() {
+	if (this->leaf != this->tree.root)
+		delete this->leaf;
+	this->leaf = nullptr;
+}
+
+
 /************
  * BTreeIndex
  ************/
 
-BTreeIndex::BTreeIndex(DbRelation& relation, Identifier name, ColumnNames key_columns, bool unique)
-	: BTreeBase(relation, name, key_columns, unique) {
+BTreeIndex::BTreeIndex(DbRelation& relation, Identifier name, ColumnNames key_columns, bool unique,
+	ColumnNames include_columns)
+	: BTreeBase(relation, name, key_columns, unique),
+	include_columns(include_columns),
+	locator_columns(),
+	value_columns(),
+	value_attributes() {
+	// rows of a table organized by primary key are found by that key, so the leaves have to carry it
+	if (relation.has_primary_key())
+		this->locator_columns = *relation.get_primary_key();
+	this->value_columns = this->locator_columns;
+	for (auto const& column_name : include_columns)
+		if (std::find(this->value_columns.begin(), this->value_columns.end(), column_name) == this->value_columns.end())
+			this->value_columns.push_back(column_name);
+	ColumnAttributes *attributes = relation.get_column_attributes(this->value_columns);
+	this->value_attributes = *attributes;
+	delete attributes;
 }
 
 BTreeIndex::~BTreeIndex() {
 }
 
 // Construct an appropriate leaf
-BTreeLeafBase *BTreeIndex::make_leaf(BlockID id, bool create) {
-	return new BTreeLeafIndex(this->file, id, this->key_profile, create);
+BTreeLeafBase *BTreeIndex::make_leaf(BlockID id, bool create, bool decode) {
+	if (!this->value_columns.empty())
+		return new BTreeLeafFile(this->file, id, this->key_profile,
+			this->value_columns, this->value_attributes, create, this->locator_columns.empty(), decode);
+	return new BTreeLeafIndex(this->file, id, this->key_profile, create, decode);
+}
+
+// The handle of the row an entry points to: stored as is for a heap table, rebuilt from the primary key otherwise.
+Handle BTreeIndex::locator(const BTreeLeafValue& value) const {
+	if (this->locator_columns.empty())
+		return value.h;
+	KeyValue key;
+	for (auto const& column_name : this->locator_columns)
+		key.push_back(value.vd->at(column_name));
+	return Handle(key);
+}
+
+// Insert a row with the given handle, picking up the locator and included columns, too.
+void BTreeIndex::insert(Handle handle) {
+	if (this->value_columns.empty()) {
+		BTreeBase::insert(handle);
+		return;
+	}
+	ColumnNames column_names = this->key_columns;
+	column_names.insert(column_names.end(), this->value_columns.begin(), this->value_columns.end());
+	ValueDict *row = this->relation.project(handle, &column_names);
+	std::unique_ptr<KeyValue> key(tkey(row));
+	ValueDict *values = new ValueDict();
+	for (auto const& column_name : this->value_columns)
+		(*values)[column_name] = row->at(column_name);
+	delete row;
+
+	add_entry(key.get(), BTreeLeafValue(handle, values));
+}
+
+// Does this index have all the given columns (as key, locator or included columns)?
+bool BTreeIndex::covers(const ColumnNames *column_names) const {
+	for (auto const& column_name : *column_names)
+		if (std::find(this->key_columns.begin(), this->key_columns.end(), column_name) == this->key_columns.end()
+			&& std::find(this->value_columns.begin(), this->value_columns.end(), column_name) == this->value_columns.end())
+			return false;
+	return true;
 }
 
-// Range of values in index
+// Index-only scan of the entries matching where (which must only name covered columns).
+// If where pins down the whole key we go straight to it, otherwise every entry is checked.
+DbCursor *BTreeIndex::cursor(const ValueDict *where) {
+	open();
+	std::unique_ptr<KeyValue> key(tkey(where));
+	BTreeCursor *entries = BTreeBase::cursor(key.get(), key.get(), false);
+	return new BTreeCoveringCursor(*this, entries, where);
+}
+
+// Pull the requested columns out of a handle from an index-only scan.
+ValueDict *BTreeIndex::project(Handle handle, const ColumnNames *column_names) {
+	ValueDict *row = new ValueDict();
+	for (auto const& column_name : *column_names) {
+		auto it = std::find(this->key_columns.begin(), this->key_columns.end(), column_name);
+		if (it != this->key_columns.end()) {
+			(*row)[column_name] = handle.key_value[it - this->key_columns.begin()];
+			continue;
+		}
+		it = std::find(this->value_columns.begin(), this->value_columns.end(), column_name);
+		if (it == this->value_columns.end()) {
+			delete row;
+			throw DbRelationError("column " + column_name + " is not in index " + this->name);
+		}
+		(*row)[column_name] = handle.key_value[this->key_columns.size() + (it - this->value_columns.begin())];
+	}
+	return row;
+}
+
+// The key values followed by the locator and included values.
+KeyValue BTreeIndex::covered_row(const KeyValue& key, const BTreeLeafValue& value) const {
+	KeyValue row = key;
+	for (auto const& column_name : this->value_columns)
+		row.push_back(value.vd->at(column_name));
+	return row;
+}
+
+// Range of values in index, from min_key to max_key on as many leading key columns as each gives
 Handles* BTreeIndex::range(ValueDict* min_key, ValueDict* max_key) {
-	KeyValue *tmin = tkey(min_key);
-	KeyValue *tmax = tkey(max_key);
-	Handles *handles = _range(tmin, tmax, false);
-	delete tmin;
-	delete tmax;
+	std::unique_ptr<KeyValue> tmin(prefix_key(min_key));
+	std::unique_ptr<KeyValue> tmax(prefix_key(max_key));
+	return _range(tmin.get(), tmax.get(), false);
+}
+
+// The first entry, or the last one if last (from a reverse cursor, so just the last leaf is read).
+Handles* BTreeIndex::first(bool last) {
+	std::unique_ptr<DbCursor> entries;
+	if (last)
+		entries.reset(reverse_cursor(nullptr, nullptr, false));
+	else
+		entries.reset(cursor(nullptr, nullptr, false));
+	return entries->fetch(1);
+}
+
+
+/*********************
+ * BTreeCoveringCursor
+ *********************/
+
+BTreeCoveringCursor::BTreeCoveringCursor(BTreeIndex &index, BTreeCursor *entries, const ValueDict *where)
+	: index(index), entries(entries), where() {
+	if (where != nullptr)
+		this->where = *where;
+}
+
+BTreeCoveringCursor::~BTreeCoveringCursor() {
+	delete this->entries;
+}
+
+// Get up to limit more matching rows (all the rest if limit is 0).
+Handles* BTreeCoveringCursor::fetch(uint limit) {
+	ColumnNames where_columns;
+	for (auto const& column : this->where)
+		where_columns.push_back(column.first);
+
+	Handles *handles = new Handles();
+	while (!this->entries->at_end() && (limit == 0 || handles->size() < limit)) {
+		Handle handle = this->entries->value().h;
+		handle.key_value = this->index.covered_row(this->entries->key(), this->entries->value());
+		this->entries->next();
+		if (!this->where.empty()) {
+			ValueDict *row = this->index.project(handle, &where_columns);
+			bool selected = *row == this->where;
+			delete row;
+			if (!selected)
+				continue;
+		}
+		handles->push_back(handle);
+	}
 	return handles;
 }
 
@@ -285,9 +886,9 @@ BTreeFile::~BTreeFile() {
 }
 
 // Construct an appropriate leaf
-BTreeLeafBase *BTreeFile::make_leaf(BlockID id, bool create) {
+BTreeLeafBase *BTreeFile::make_leaf(BlockID id, bool create, bool decode) {
 	return new BTreeLeafFile(this->file, id, this->key_profile,
-		this->non_key_column_names, this->non_key_column_attributes, create);
+		this->non_key_column_names, this->non_key_column_attributes, create, false, decode);
 }
 
 // Range of values in file
@@ -298,20 +899,31 @@ Handles* BTreeFile::range(KeyValue *tmin, KeyValue *tmax) {
 
 // Get the values not in the primary key (Throws std::out_of_range if not found.)
 ValueDict* BTreeFile::lookup_value(ValueDict* key_dict) {
+	std::unique_ptr<KeyValue> key(tkey(key_dict));
+	ValueDict *row = lookup_value(key.get());
+	if (row == nullptr)
+		throw std::out_of_range("key not found in " + this->name);
+	return row;
+}
+
+// Get a copy of the values not in the primary key straight from the leaf, or nullptr if not found.
+// Caller is responsible for deleting it.
+ValueDict* BTreeFile::lookup_value(const KeyValue* key) {
 	open();
-	KeyValue *key = tkey(key_dict);
-	BTreeLeafBase *leaf = _lookup(this->root, this->stat->get_height(), key);
-	BTreeLeafValue value = leaf->find_eq(key);
+	if (!might_contain(key))
+		return nullptr;
+	BTreeLeafBase *leaf = _probe_leaf(key);
+	BTreeLeafValue value;
+	leaf->probe(key, value);
+	if (leaf != this->root)
+		delete leaf;
 	return value.vd;
 }
 
 // Insert a row with the given handle. Row must exist in relation already.
 void BTreeFile::insert_value(ValueDict *row) {
-	KeyValue *key = tkey(row);
-	BTreeLeafValue value(row);
-	Insertion split = _insert(this->root, this->stat->get_height(), key, value);
-	if (!BTreeNode::insertion_is_none(split))
-		split_root(split);
+	std::unique_ptr<KeyValue> key(tkey(row));
+	add_entry(key.get(), BTreeLeafValue(row));
 }
 
 
@@ -377,29 +989,26 @@ void BTreeTable::close()
 Handle BTreeTable::insert(const ValueDict* row)
 {
 	ValueDict* _row = validate(row);
+	KeyValue* key = index->tkey(_row);
+	Handle handle(*key);
+	delete key;
 	index->insert_value(_row);
-
-	return Handle(*(index->tkey(_row)));
+	return handle;
 }
 
 void BTreeTable::update(const Handle handle, const ValueDict* new_values)
 {
-	ValueDict* row = project(handle);
-
-	// create a copy of row (new_row)
-	ValueDict* new_row = new ValueDict;
-	*new_row = *row;
+	std::unique_ptr<ValueDict> row(project(handle));
 
 	for (auto key : *new_values)
 	{
-		new_row->at(key.first) = new_values->at(key.first);
+		row->at(key.first) = new_values->at(key.first);
 	}
 
-	new_row = validate(new_row);
-	KeyValue* new_tkey = index->tkey(new_row);
+	std::unique_ptr<ValueDict> new_row(validate(row.get()));
 
 	index->del(handle);
-	index->insert_value(new_row);
+	index->insert_value(new_row.release());	// the leaf owns it now
 }
 
 void BTreeTable::del(const Handle handle)
@@ -407,6 +1016,11 @@ void BTreeTable::del(const Handle handle)
 	index->del(handle);
 }
 
+void BTreeTable::del(const Handles* handles)
+{
+	index->del(handles);
+}
+
 Handles* BTreeTable::select()
 {
 	return select(nullptr);
@@ -414,46 +1028,36 @@ Handles* BTreeTable::select()
 
 Handles* BTreeTable::select(const ValueDict* where)
 {
-	Handles* ret_handles = new Handles;;
-	KeyValue* min_value = new KeyValue;
-	KeyValue* max_value = new KeyValue;
-	ValueDict* additional_where = new ValueDict;
-
-	bool where_is_primary_key = true;
-	if (where != nullptr) {
-		for (auto w : *where)
+	// point lookup: equality on the whole primary key means at most one row, found with one descent
+	if (where != nullptr && where->size() == primary_key->size())
+	{
+		std::unique_ptr<KeyValue> key(index->tkey(where));
+		if (key != nullptr)
 		{
-			if (std::find(primary_key->begin(), primary_key->end(), w.first) == primary_key->end())
-			{
-				where_is_primary_key = false;
-			}
+			Handles* handles = new Handles;
+			if (index->contains(key.get()))
+				handles->push_back(Handle(*key));
+			return handles;
 		}
 	}
 
-	if (where_is_primary_key) {
-		make_range(where, min_value, max_value, additional_where);
+	// otherwise scan the range of primary keys where pins down (all of them if it doesn't) and filter on the rest
+	KeyValue range_key;
+	ValueDict additional_where;
+	make_range(where, range_key, additional_where);
 
-		Handles* tkeys = index->range(min_value, max_value);
-		for (auto tkey : *tkeys)
-		{
-			if (additional_where == nullptr || selected(tkey, additional_where))
-			{
-				ret_handles->push_back(tkey);
-			}
-		}
-	}
-	// if where is not a pk (select * from bt) then filter
-	else
+	KeyValue* bound = range_key.empty() ? nullptr : &range_key;
+	std::unique_ptr<Handles> tkeys(index->range(bound, bound));
+	if (additional_where.empty())
+		return tkeys.release();
+
+	Handles* ret_handles = new Handles;
+	for (auto const& tkey : *tkeys)
 	{
-		Handles* all_handles = select();
-		for (Handle handle : *all_handles)
+		if (selected(tkey, &additional_where))
 		{
-			if (selected(handle, where))
-			{
-				ret_handles->push_back(handle);
-			}
+			ret_handles->push_back(tkey);
 		}
-
 	}
 	return ret_handles;
 }
@@ -462,15 +1066,9 @@ Handles* BTreeTable::select(Handles *current_selection, const ValueDict* where)
 {
 	Handles* ret_handles = new Handles;
 
-	KeyValue* min_value = new KeyValue;
-	KeyValue* max_value = new KeyValue;
-	ValueDict* additional_where = new ValueDict;
-
-	make_range(where, min_value, max_value, additional_where);
-
-	for (auto tkey : *current_selection)
+	for (auto const& tkey : *current_selection)
 	{
-		if (additional_where == nullptr || selected(tkey, additional_where))
+		if (where == nullptr || selected(tkey, where))
 		{
 			ret_handles->push_back(tkey);
 		}
@@ -479,6 +1077,62 @@ Handles* BTreeTable::select(Handles *current_selection, const ValueDict* where)
 
 }
 
+// Stream the selection straight out of the leaves: the range of primary keys where pins down (all of them if
+// it doesn't), checked against the rest of where as it goes
+DbCursor* BTreeTable::cursor(const ValueDict* where)
+{
+	KeyValue range_key;
+	ValueDict additional_where;
+	make_range(where, range_key, additional_where);
+
+	KeyValue* bound = range_key.empty() ? nullptr : &range_key;
+	DbCursor* range = index->cursor(bound, bound, true);
+	if (additional_where.empty())
+		return range;
+	return new SelectCursor(*this, range, additional_where);
+}
+
+// As above, but a range on the next primary key column after the ones where pins down narrows the scan, too
+DbCursor* BTreeTable::cursor(const ValueDict* where, const ValueDict* min_values, const ValueDict* max_values)
+{
+	return range_cursor(where, min_values, max_values, false);
+}
+
+// As above, but from the last row back to the first
+DbCursor* BTreeTable::reverse_cursor(const ValueDict* where, const ValueDict* min_values, const ValueDict* max_values)
+{
+	return range_cursor(where, min_values, max_values, true);
+}
+
+// The rows where picks out, within any bounds on the next primary key column, in key order (backward if asked)
+DbCursor* BTreeTable::range_cursor(const ValueDict* where, const ValueDict* min_values, const ValueDict* max_values,
+	bool backward)
+{
+	KeyValue range_key;
+	ValueDict additional_where;
+	make_range(where, range_key, additional_where);
+	KeyValue tmin = range_key, tmax = range_key;
+	if (range_key.size() < primary_key->size())
+	{
+		const Identifier &next = primary_key->at(range_key.size());
+		if (min_values != nullptr && min_values->find(next) != min_values->end())
+			tmin.push_back(min_values->at(next));
+		if (max_values != nullptr && max_values->find(next) != max_values->end())
+			tmax.push_back(max_values->at(next));
+	}
+
+	const KeyValue* low = tmin.empty() ? nullptr : &tmin;
+	const KeyValue* high = tmax.empty() ? nullptr : &tmax;
+	DbCursor* range;
+	if (backward)
+		range = index->reverse_cursor(low, high, true);
+	else
+		range = index->cursor(low, high, true);
+	if (additional_where.empty())
+		return range;
+	return new SelectCursor(*this, range, additional_where);
+}
+
 ValueDict* BTreeTable::getValueDict(Handle handle)
 {
 	int count = 0;
@@ -494,26 +1148,34 @@ ValueDict* BTreeTable::getValueDict(Handle handle)
 
 ValueDict* BTreeTable::project(Handle handle)
 {
-	ValueDict* pk_dictionary = getValueDict(handle);
-	ValueDict* p_row_no_pk = index->lookup_value(pk_dictionary);	// everyting but pk
-
-	if (p_row_no_pk->empty())
+	ValueDict* row = find_row(handle.key_value);
+	if (row == nullptr)
 	{
 		throw DbRelationError("Cannot project: invalid handle");
 	}
+	return row;
+}
+
+// The whole row for the given primary key, from a single descent to its leaf (nullptr if there isn't one)
+ValueDict* BTreeTable::find_row(const KeyValue& key)
+{
+	ValueDict* row = index->lookup_value(&key);	// everything but pk
+	if (row == nullptr)
+		return nullptr;
 
 	// add pks to this
-	for (auto thing : *pk_dictionary)
+	int count = 0;
+	for (auto c_name : *primary_key)
 	{
-		(*p_row_no_pk)[thing.first] = thing.second;
+		(*row)[c_name] = key[count];
+		++count;
 	}
-
-	return p_row_no_pk;
+	return row;
 }
 
 ValueDict* BTreeTable::project(Handle handle, const ColumnNames* column_names)
 {
-	ValueDict* full_row = project(handle);
+	std::unique_ptr<ValueDict> full_row(project(handle));
 	ValueDict* result_row = new ValueDict;
 
 	for (auto c_name : *column_names)
@@ -528,7 +1190,7 @@ ValueDict* BTreeTable::project(Handle handle, const ColumnNames* column_names)
 
 ValueDict* BTreeTable::validate(const ValueDict* row) const
 {
-	ValueDict* full_row = new ValueDict;
+	std::unique_ptr<ValueDict> full_row(new ValueDict);
 
 	for (Identifier column_name : column_names)
 	{
@@ -543,13 +1205,13 @@ ValueDict* BTreeTable::validate(const ValueDict* row) const
 		}
 	}
 
-	return full_row;
+	return full_row.release();
 }
 
 // checks if given record succeeds given where clause
 bool BTreeTable::selected(Handle handle, const ValueDict* where)
 {
-	ValueDict* s_row = project(handle, where);
+	std::unique_ptr<ValueDict> s_row(project(handle, where));
 	for (auto w : *where)
 	{
 		if ((*s_row)[w.first] != w.second)
@@ -560,55 +1222,25 @@ bool BTreeTable::selected(Handle handle, const ValueDict* where)
 	return true;
 }
 
-void BTreeTable::make_range(const ValueDict *where,
-	KeyValue *&minval, KeyValue *&maxval, ValueDict *&additional_where)
+// Split where into the leading primary key columns it pins down (stopping at the first key column it
+// doesn't give) and the conditions on everything else.
+void BTreeTable::make_range(const ValueDict *where, KeyValue &tkey, ValueDict &additional_where)
 {
+	tkey.clear();
+	additional_where.clear();
 	if (where == nullptr)
-	{
-		minval = nullptr;
-		maxval = nullptr;
-		additional_where = nullptr;
-	}
-	else
-	{
-		additional_where->clear();
-		additional_where->insert(where->begin(), where->end());
-
-		KeyValue* tkey = new KeyValue;
-
-		for (auto c : *primary_key)
-		{
-
-			if (additional_where->find(c) != additional_where->end())
-			{
-				additional_where->erase(c);
-			}
-
-			if (where->find(c) != where->end())
-			{
-				tkey->push_back(where->at(c));
-			}
-		}
-		if (additional_where->empty())
-		{
-			delete additional_where;
-			additional_where = nullptr;
-		}
+		return;
 
-		if (tkey->size() > 0)
-		{
-			minval = tkey;
-			maxval = tkey;
-		}
-		else
-		{
-			minval = nullptr;
-			maxval = nullptr;
-		}
+	additional_where.insert(where->begin(), where->end());
+	for (auto c : *primary_key)
+	{
+		if (where->find(c) == where->end())
+			return;
+		tkey.push_back(where->at(c));
+		additional_where.erase(c);
 	}
 }
 
-
 bool test_btree() {
 	ColumnNames column_names;
 	column_names.push_back("a");
@@ -676,14 +1308,328 @@ bool test_btree() {
 			delete handles;
 			delete result;
 		}
+
+	// delete nine out of every ten rows, which forces leaves to merge
+	handles = table.select();
+	for (auto const& handle : *handles) {
+		result = table.project(handle);
+		if ((*result)["a"].n % 10 != 0) {
+			index.del(handle);
+			table.del(handle);
+		}
+		delete result;
+	}
+	delete handles;
+	for (int i = 0; i < 1000; i++) {
+		lookup["a"] = i + 100;
+		handles = index.lookup(&lookup);
+		if (handles->size() != (i % 10 == 0 ? 1U : 0U)) {
+			std::cout << "lookup after delete failed " << i << std::endl;
+			return false;
+		}
+		delete handles;
+	}
+
+	// walk the survivors backwards across the leaf chain
+	DbCursor *backward = index.reverse_cursor(nullptr, nullptr, false);
+	handles = backward->fetch(0);
+	delete backward;
+	int32_t previous = 1100;
+	for (auto const& handle : *handles) {
+		result = table.project(handle);
+		if ((*result)["a"].n >= previous) {
+			std::cout << "reverse scan out of order " << (*result)["a"].n << std::endl;
+			return false;
+		}
+		previous = (*result)["a"].n;
+		delete result;
+	}
+	if (handles->size() != 100) {
+		std::cout << "reverse scan missed rows " << handles->size() << std::endl;
+		return false;
+	}
+	delete handles;
+
+	// put the deleted rows back, splitting the leaves the adaptive hash remembered for the survivors
+	for (int i = 0; i < 1000; i++) {
+		if (i % 10 == 0)
+			continue;
+		ValueDict row;
+		row["a"] = Value(i + 100);
+		row["b"] = Value(-i);
+		index.insert(table.insert(&row));
+	}
+	for (uint j = 0; j < 4; j++)
+		for (int i = 0; i < 1000; i++) {
+			lookup["a"] = i + 100;
+			handles = index.lookup(&lookup);
+			if (handles->size() != 1) {
+				std::cout << "lookup after reinsert failed " << i << std::endl;
+				return false;
+			}
+			delete handles;
+		}
+
+	// an index that starts out empty has to grow its Bloom filter as rows come in, without losing any keys
+	ColumnNames b_column;
+	b_column.push_back("b");
+	BTreeIndex by_b(table, "fooindex_b", b_column, true);
+	by_b.create();
+	BlockID bloom_first, grown_first;
+	uint bloom_count, grown_count;
+	by_b.bloom_blocks(bloom_first, bloom_count);
+	for (int i = 0; i < 10000; i++) {
+		ValueDict row;
+		row["a"] = Value(-1);
+		row["b"] = Value(i + 1000);
+		by_b.insert(table.insert(&row));
+	}
+	// the filter grew in place: it still starts in the block it started in
+	by_b.bloom_blocks(grown_first, grown_count);
+	if (grown_count <= bloom_count || grown_first != bloom_first) {
+		std::cout << "Bloom filter didn't grow into its old blocks: " << bloom_count << " blocks at " << bloom_first
+			<< ", then " << grown_count << " at " << grown_first << std::endl;
+		return false;
+	}
+	by_b.close();
+	by_b.open();
+	for (int i = 0; i < 20000; i++) {
+		lookup.clear();
+		lookup["b"] = Value(i + 1000);
+		handles = by_b.lookup(&lookup);
+		if (handles->size() != (i < 10000 ? 1U : 0U)) {
+			std::cout << "lookup after Bloom filter growth failed " << i << std::endl;
+			return false;
+		}
+		delete handles;
+	}
+
+	// take two out of every three of those back out in one batch, which empties and merges whole leaves
+	Handles batch;
+	for (int i = 0; i < 10000; i++) {
+		if (i % 3 == 0)
+			continue;
+		lookup["b"] = Value(i + 1000);
+		handles = by_b.lookup(&lookup);
+		batch.push_back(handles->back());
+		delete handles;
+	}
+	by_b.del(&batch);
+	for (int i = 0; i < 10000; i++) {
+		lookup["b"] = Value(i + 1000);
+		handles = by_b.lookup(&lookup);
+		if (handles->size() != (i % 3 == 0 ? 1U : 0U)) {
+			std::cout << "lookup after batch delete failed " << i << std::endl;
+			return false;
+		}
+		delete handles;
+	}
+	by_b.drop();
+
+	// partial index: only the rows with a = -1
+	BTreeIndex minus_one(table, "fooindex_minus_one", b_column, true);
+	ValueDict predicate;
+	predicate["a"] = Value(-1);
+	minus_one.set_predicate(predicate);
+	minus_one.create();
+	lookup.clear();
+	lookup["b"] = Value(5000);
+	handles = minus_one.lookup(&lookup);
+	if (handles->size() != 1 || !minus_one.includes(handles->back())) {
+		std::cout << "partial index lookup failed" << std::endl;
+		return false;
+	}
+	delete handles;
+	lookup["b"] = Value(-400);
+	handles = minus_one.lookup(&lookup);
+	if (!handles->empty()) {
+		std::cout << "partial index has a row it shouldn't" << std::endl;
+		return false;
+	}
+	delete handles;
+	lookup["a"] = Value(-1);
+	if (!minus_one.applies_to(&lookup) || minus_one.applies_to(nullptr)) {
+		std::cout << "partial index applies_to is wrong" << std::endl;
+		return false;
+	}
+	minus_one.drop();
+
+	handles = table.select();
+	for (auto const& handle : *handles) {
+		result = table.project(handle);
+		if ((*result)["a"].n == -1)
+			table.del(handle);
+		delete result;
+	}
+	delete handles;
+	lookup.clear();
+
+	// encoded keys must sort just like the KeyValues they came from
+	KeyValues samples;
+	samples.push_back(new KeyValue{Value(-5), Value("b")});
+	samples.push_back(new KeyValue{Value(-5), Value("ba")});
+	samples.push_back(new KeyValue{Value(0)});
+	samples.push_back(new KeyValue{Value(0), Value("")});
+	samples.push_back(new KeyValue{Value(7), Value("a")});
+	samples.push_back(new KeyValue{Value(INT32_MAX), Value("a")});
+	for (uint i = 0; i < samples.size(); i++)
+		for (uint j = 0; j < samples.size(); j++)
+			if ((BTreeKey(*samples[i]) < BTreeKey(*samples[j])) != (*samples[i] < *samples[j])) {
+				std::cout << "encoded key order differs at " << i << ", " << j << std::endl;
+				return false;
+			}
+	for (auto sample : samples)
+		delete sample;
+
+	// covering index: b rides along in the leaves, so scans never need the table
+	ColumnNames included;
+	included.push_back("b");
+	BTreeIndex covering(table, "fooindex_ab", column_names, true, included);
+	covering.create();
+	column_names.push_back("b");
+	if (!covering.covers(&column_names)) {
+		std::cout << "covering index does not cover its columns" << std::endl;
+		return false;
+	}
+	ValueDict where;
+	where["b"] = Value(-400);
+	DbCursor *scan = covering.cursor(&where);
+	handles = scan->fetch(0);
+	delete scan;
+	if (handles->size() != 1) {
+		std::cout << "index-only scan found " << handles->size() << " rows" << std::endl;
+		return false;
+	}
+	result = covering.project(handles->back(), &column_names);
+	if ((*result)["a"] != Value(500)) {
+		std::cout << "index-only scan returned the wrong row" << std::endl;
+		return false;
+	}
+	delete result;
+	delete handles;
+	covering.drop();
+
+	// neighboring INT boundaries share their leading bytes, so the root stores less than 4 bytes apiece
+	uint boundaries, bytes;
+	index.root_boundaries(boundaries, bytes);
+	if (boundaries < 2 || bytes >= boundaries * sizeof(int32_t)) {
+		std::cout << "INT boundaries not prefix-compressed: " << boundaries << " in " << bytes << " bytes" << std::endl;
+		return false;
+	}
 	index.drop();
 	table.drop();
+
+	// composite key with prefix bounds: the reverse cursor takes in the same keys as the forward one, last first
+	ColumnNames pair_names;
+	pair_names.push_back("a");
+	pair_names.push_back("b");
+	HeapTable pair_table("__test_btree_pair", pair_names, column_attributes);
+	pair_table.create();
+	for (int a = 0; a < 50; a++)
+		for (int b = 0; b < 60; b++) {
+			ValueDict row;
+			row["a"] = Value(a);
+			row["b"] = Value(b);
+			pair_table.insert(&row);
+		}
+	BTreeIndex by_ab(pair_table, "fooindex_pair", pair_names, true);
+	by_ab.create();
+	KeyValue low{Value(3)}, high{Value(5)};
+	BTreeCursor *forward = by_ab.cursor(&low, &high, true);
+	Handles *ascending = forward->fetch(0);
+	delete forward;
+	backward = by_ab.reverse_cursor(&low, &high, true);
+	handles = backward->fetch(0);
+	delete backward;
+	if (handles->size() != 3 * 60 || ascending->size() != handles->size() ||
+		!std::equal(handles->begin(), handles->end(), ascending->rbegin(),
+			[](const Handle &x, const Handle &y) { return x.key_value == y.key_value; }) ||
+		handles->front().key_value != KeyValue({Value(5), Value(59)})) {
+		std::cout << "reverse cursor with a prefix bound found " << handles->size() << " keys" << std::endl;
+		return false;
+	}
+	delete ascending;
+	delete handles;
+
+	// fetching a few at a time picks up where the last batch stopped, and the batches add up to the range
+	ValueDict min_key, max_key;
+	min_key["a"] = Value(3);
+	max_key["a"] = Value(5);
+	Handles *whole = by_ab.range(&min_key, &max_key);
+	forward = by_ab.cursor(&low, &high, false);
+	Handles pieces;
+	uint batches = 0;
+	while (true) {
+		Handles *batch = forward->fetch(7);
+		bool done = batch->empty();
+		if (batch->size() > 7) {
+			std::cout << "cursor fetch went past its limit: " << batch->size() << std::endl;
+			return false;
+		}
+		pieces.insert(pieces.end(), batch->begin(), batch->end());
+		delete batch;
+		if (done)
+			break;
+		batches++;
+	}
+	delete forward;
+	if (batches != (whole->size() + 6) / 7 || pieces.size() != whole->size() ||
+		!std::equal(pieces.begin(), pieces.end(), whole->begin(), [](const Handle &x, const Handle &y) {
+			return x.block_id == y.block_id && x.record_id == y.record_id;
+		})) {
+		std::cout << "cursor batches don't add up to the range: " << pieces.size() << " of " << whole->size()
+			<< std::endl;
+		return false;
+	}
+	delete whole;
+	by_ab.drop();
+	pair_table.drop();
+
+	// long TEXT keys that differ only in the middle: separators get cut down to where neighbors differ and
+	// the shared start is stored once, and lookups still work from the compressed blocks after reopening
+	ColumnNames text_names;
+	text_names.push_back("s");
+	ColumnAttributes text_attributes;
+	text_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+	HeapTable text_table("__test_btree_text", text_names, text_attributes);
+	text_table.create();
+	const std::string start = "customer-account-number-";
+	auto text_key = [&start](int i) {
+		std::string digits = std::to_string(i);
+		return start + std::string(6 - digits.size(), '0') + digits + "-and-a-long-common-tail";
+	};
+	for (int i = 0; i < 3000; i++) {
+		ValueDict row;
+		row["s"] = Value(text_key(i));
+		text_table.insert(&row);
+	}
+	BTreeIndex by_s(text_table, "fooindex_s", text_names, true);
+	by_s.create();
+	by_s.root_boundaries(boundaries, bytes);
+	if (boundaries < 2 || bytes >= boundaries * 8) {
+		std::cout << "TEXT separators not truncated: " << boundaries << " in " << bytes << " bytes" << std::endl;
+		return false;
+	}
+	by_s.close();
+	by_s.open();
+	for (int i = -1; i <= 3000; i++) {
+		lookup.clear();
+		lookup["s"] = Value(text_key(i < 0 ? 9999 : i));
+		handles = by_s.lookup(&lookup);
+		if (handles->size() != (i >= 0 && i < 3000 ? 1U : 0U)) {
+			std::cout << "TEXT lookup after reopen failed " << i << std::endl;
+			return false;
+		}
+		delete handles;
+	}
+	by_s.drop();
+	text_table.drop();
 	return true;
 }
 
 void run_test_statement(std::string sql) {
 
-	hsql::SQLParserResult *parse = hsql::SQLParser::parseSQLString(sql);
+	hsql::SQLParserResult *parse = SQLExec::parse(sql);
 
 	auto statement = parse->getStatement(0);
 	std::cout << ParseTreeToString::statement(statement) << std::endl;
@@ -729,7 +1675,7 @@ bool test_table()
 	};
 	ColumnNames primary_key = { "id" };
 
-	BTreeTable table = BTreeTable("_test_btable", column_names, column_attributes, primary_key);
+	BTreeTable table("_test_btable", column_names, column_attributes, primary_key);
 	//table.create_if_not_exists();	
 									/* TODO: create_f_not_exists() & table.open() are broken
 									 * for the same reason, what is that reason?
@@ -840,7 +1786,305 @@ bool test_table()
 		return false;
 	}
 
+	// point lookups on the whole primary key
+	ValueDict where = { { "id", Value(7) } };
+	Handles* point = table.select(&where);
+	if (point->size() != 1 || (*table.project(point->back()))["b"].s != rows.at(7)["b"].s)
+	{
+		return false;
+	}
+	delete point;
+	where["id"] = Value(10 * size);
+	point = table.select(&where);
+	if (!point->empty())
+	{
+		return false;
+	}
+	delete point;
+
 	table.drop();
 
+	// secondary index on a non-key column: entries point back at the rows by primary key
+	BTreeTable coded("_test_btable_ix", { "id", "code" },
+		{ ColumnAttribute(ColumnAttribute::INT), ColumnAttribute(ColumnAttribute::INT) }, primary_key);
+	coded.create();
+	for (int id = 0; id < 500; ++id)
+	{
+		ValueDict row = { { "id", Value(id) }, { "code", Value(10000 - id) } };
+		coded.insert(&row);
+	}
+	BTreeIndex by_code(coded, "by_code", { "code" }, true);
+	by_code.create();
+	ValueDict code = { { "code", Value(10000 - 321) } };
+	Handles* found = by_code.lookup(&code);
+	if (found->size() != 1 || found->back().key_value != KeyValue{ Value(321) }
+		|| (*coded.project(found->back()))["code"].n != 10000 - 321)
+	{
+		return false;
+	}
+	ColumnNames id_and_code = { "code", "id" };
+	if (!by_code.covers(&id_and_code))
+	{
+		return false;
+	}
+	by_code.del(found->back());
+	coded.del(found->back());
+	delete found;
+	found = by_code.lookup(&code);
+	if (!found->empty())
+	{
+		return false;
+	}
+	delete found;
+	by_code.drop();
+	coded.drop();
+
 	return true;
 }
+
+
+// Time BTreeInterior::find_child against the linear walk over the boundaries it replaced,
+// for single-INT keys (flat array) and TEXT keys (binary search over encoded keys) at a few fan-outs.
+// Then time leaf lookups on KeyValue against lookups on encoded keys.
+void benchmark_btree() {
+	const uint PROBES = 200000;
+	const uint fanouts[] = {16, 64, 200};
+	for (ColumnAttribute::DataType data_type : {ColumnAttribute::INT, ColumnAttribute::TEXT}) {
+		KeyProfile key_profile;
+		key_profile.push_back(data_type);
+		for (uint fanout : fanouts) {
+			HeapFile file("__bench_btree");
+			file.create();
+			BTreeInterior *node = new BTreeInterior(file, 0, key_profile, true);
+			node->set_first(1);
+			for (uint i = 1; i < fanout; i++) {
+				char text[16];
+				sprintf(text, "key%06u", i * 10);
+				KeyValue boundary;
+				boundary.push_back(data_type == ColumnAttribute::INT ? Value((int32_t)(i * 10)) : Value(text));
+				if (!BTreeNode::insertion_is_none(node->insert(&boundary, i + 1)))
+					break;  // block is full
+			}
+
+			KeyValues probes;
+			for (uint i = 0; i < 1000; i++) {
+				char text[16];
+				uint n = (uint)rand() % (fanout * 10);
+				sprintf(text, "key%06u", n);
+				probes.push_back(new KeyValue(1, data_type == ColumnAttribute::INT ? Value((int32_t)n) : Value(text)));
+			}
+
+			uint boundaries = node->child_count() - 1;
+			u_long linear_sum = 0, binary_sum = 0;
+			auto start = std::chrono::steady_clock::now();
+			for (uint p = 0; p < PROBES; p++) {
+				const KeyValue *key = probes[p % probes.size()];
+				uint i = 0;
+				while (i < boundaries && !(*node->get_boundary(i + 1) > *key))
+					i++;
+				linear_sum += i;
+			}
+			auto middle = std::chrono::steady_clock::now();
+			for (uint p = 0; p < PROBES; p++)
+				binary_sum += node->find_child(probes[p % probes.size()]);
+			auto end = std::chrono::steady_clock::now();
+
+			double linear_ns = std::chrono::duration<double, std::nano>(middle - start).count() / PROBES;
+			double binary_ns = std::chrono::duration<double, std::nano>(end - middle).count() / PROBES;
+			std::cout << "find_child " << (data_type == ColumnAttribute::INT ? "INT " : "TEXT")
+				<< " fan-out " << node->child_count() << ": linear " << linear_ns << " ns, binary " << binary_ns
+				<< " ns" << (linear_sum == binary_sum ? "" : " (MISMATCH)") << std::endl;
+
+			for (auto probe : probes)
+				delete probe;
+			delete node;
+			file.drop();
+		}
+	}
+
+	// leaf lookups: std::map keyed on KeyValue (per-Value compares) vs. on BTreeKey (one memcmp)
+	std::map<KeyValue, int> value_map;
+	LeafMap encoded_map;
+	std::vector<KeyValue> keys;
+	for (int i = 0; i < 200; i++) {
+		char text[16];
+		sprintf(text, "name%04d", i % 20);
+		KeyValue key;
+		key.push_back(Value(text));
+		key.push_back(Value(i));
+		value_map[key] = i;
+		encoded_map[key] = BTreeLeafValue(Handle(1, (RecordID)i));
+		keys.push_back(key);
+	}
+	std::vector<BTreeKey> encoded_keys(keys.begin(), keys.end());
+	u_long value_sum = 0, encoded_sum = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (uint p = 0; p < PROBES; p++)
+		value_sum += value_map.find(keys[p % keys.size()])->second;
+	auto middle = std::chrono::steady_clock::now();
+	for (uint p = 0; p < PROBES; p++)
+		encoded_sum += encoded_map.find(encoded_keys[p % keys.size()])->second.h.record_id;
+	auto end = std::chrono::steady_clock::now();
+	std::cout << "leaf find (TEXT, INT) keys: KeyValue "
+		<< std::chrono::duration<double, std::nano>(middle - start).count() / PROBES << " ns, encoded "
+		<< std::chrono::duration<double, std::nano>(end - middle).count() / PROBES << " ns"
+		<< (value_sum == encoded_sum ? "" : " (MISMATCH)") << std::endl;
+}
+
+// Load a BTREE table with the given number of rows and time primary-key point lookups on it:
+// select on the whole key followed by a project of the row, the way SELECT * ... WHERE id = n runs.
+void benchmark_table(uint rows) {
+	const uint PROBES = 100000;
+	ColumnNames column_names;
+	column_names.push_back("id");
+	column_names.push_back("data");
+	ColumnAttributes column_attributes;
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+	ColumnNames primary_key;
+	primary_key.push_back("id");
+	BTreeTable table("__bench_table", column_names, column_attributes, primary_key);
+	table.create();
+
+	auto start = std::chrono::steady_clock::now();
+	for (uint i = 0; i < rows; i++) {
+		ValueDict row;
+		row["id"] = Value((int32_t)i);
+		row["data"] = Value("row " + std::to_string(i));
+		table.insert(&row);
+	}
+	auto loaded = std::chrono::steady_clock::now();
+	std::cout << "loaded " << rows << " rows in "
+		<< std::chrono::duration<double>(loaded - start).count() << " s" << std::endl;
+
+	u_long found = 0;
+	start = std::chrono::steady_clock::now();
+	for (uint p = 0; p < PROBES; p++) {
+		ValueDict where;
+		where["id"] = Value((int32_t)(((u_long)p * 7919) % rows));
+		Handles *handles = table.select(&where);
+		for (auto const& handle : *handles) {
+			ValueDict *row = table.project(handle);
+			found += row->size() == 2;
+			delete row;
+		}
+		delete handles;
+	}
+	auto end = std::chrono::steady_clock::now();
+	std::cout << "point lookup (select + project) on " << rows << " rows: "
+		<< std::chrono::duration<double, std::micro>(end - start).count() / PROBES << " us"
+		<< (found == PROBES ? "" : " (MISSING ROWS)") << std::endl;
+
+	// lookups of keys that aren't there (mostly turned away by the Bloom filter)
+	found = 0;
+	start = std::chrono::steady_clock::now();
+	for (uint p = 0; p < PROBES; p++) {
+		ValueDict where;
+		where["id"] = Value((int32_t)(rows + p));
+		Handles *handles = table.select(&where);
+		found += handles->size();
+		delete handles;
+	}
+	end = std::chrono::steady_clock::now();
+	std::cout << "missing-key lookup on " << rows << " rows: "
+		<< std::chrono::duration<double, std::micro>(end - start).count() / PROBES << " us"
+		<< (found == 0 ? "" : " (PHANTOM ROWS)") << std::endl;
+
+	// the same lookups again over a hot set of keys, with and without the adaptive hash
+	const uint HOT = 1000;
+	for (int adaptive = 0; adaptive < 2; adaptive++) {
+		table.set_adaptive_hash(adaptive == 1);
+		found = 0;
+		start = std::chrono::steady_clock::now();
+		for (uint p = 0; p < PROBES; p++) {
+			ValueDict where;
+			where["id"] = Value((int32_t)(((u_long)(p % HOT) * 7919) % rows));
+			Handles *handles = table.select(&where);
+			for (auto const& handle : *handles) {
+				ValueDict *row = table.project(handle);
+				found += row->size() == 2;
+				delete row;
+			}
+			delete handles;
+		}
+		end = std::chrono::steady_clock::now();
+		std::cout << "hot point lookup on " << HOT << " keys, adaptive hash " << (adaptive ? "on: " : "off: ")
+			<< std::chrono::duration<double, std::micro>(end - start).count() / PROBES << " us"
+			<< (found == PROBES ? "" : " (MISSING ROWS)") << std::endl;
+	}
+
+	// delete a run of rows one at a time, then the next run as one batch
+	const uint RUN = rows / 10 < 10000 ? rows / 10 : 10000;
+	for (int batched = 0; batched < 2; batched++) {
+		Handles run;
+		for (uint i = batched * RUN; i < (batched + 1) * RUN; i++)
+			run.push_back(Handle(KeyValue(1, Value((int32_t)i))));
+		start = std::chrono::steady_clock::now();
+		if (batched)
+			table.del(&run);
+		else
+			for (auto const& handle : run)
+				table.del(handle);
+		end = std::chrono::steady_clock::now();
+		std::cout << "delete " << RUN << " rows " << (batched ? "in one batch: " : "one at a time: ")
+			<< std::chrono::duration<double, std::micro>(end - start).count() / RUN << " us per row" << std::endl;
+	}
+	table.drop();
+}
+
+// Soak the BTreeTable read path with the given number of lookups and check that it doesn't leak: once warmed up,
+// the heap in use (malloc's count of bytes handed out and not yet freed) has to hold flat, give or take 64 KB.
+bool benchmark_table_soak(uint lookups) {
+	const uint ROWS = 10000;
+	ColumnNames column_names;
+	column_names.push_back("id");
+	column_names.push_back("data");
+	ColumnAttributes column_attributes;
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+	ColumnNames primary_key;
+	primary_key.push_back("id");
+	BTreeTable table("__soak_table", column_names, column_attributes, primary_key);
+	table.create();
+	for (uint i = 0; i < ROWS; i++) {
+		ValueDict row;
+		row["id"] = Value((int32_t)i);
+		row["data"] = Value("row " + std::to_string(i));
+		table.insert(&row);
+	}
+
+	// point lookups, lookups filtered on a non-key column, and projections, all through the read path
+	ColumnNames data_only;
+	data_only.push_back("data");
+	u_long found = 0;
+	size_t baseline = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (uint p = 0; p < lookups; p++) {
+		if (p == lookups / 10)
+			baseline = mallinfo2().uordblks;
+		int32_t id = (int32_t)(((u_long)p * 7919) % ROWS);
+		ValueDict where;
+		where["id"] = Value(id);
+		if (p % 4 == 3)
+			where["data"] = Value("row " + std::to_string(id));
+		Handles *handles = table.select(&where);
+		for (auto const& handle : *handles) {
+			ValueDict *row = p % 2 ? table.project(handle, &data_only) : table.project(handle);
+			found += row->size() > 0;
+			delete row;
+		}
+		delete handles;
+	}
+	auto end = std::chrono::steady_clock::now();
+	size_t in_use = mallinfo2().uordblks;
+	table.drop();
+
+	std::cout << "soak: " << lookups << " lookups at "
+		<< std::chrono::duration<double, std::micro>(end - start).count() / lookups << " us, heap in use "
+		<< baseline << " bytes after warm-up, " << in_use << " at end" << std::endl;
+	if (found != lookups) {
+		std::cout << "soak: missing rows" << std::endl;
+		return false;
+	}
+	return in_use <= baseline + 64 * 1024;
+}
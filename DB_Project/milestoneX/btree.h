@@ -1,6 +1,10 @@
 #pragma once
 
 #include "BTreeNode.h"
+#include <unordered_map>
+
+class BTreeCursor;
+class BTreeReverseCursor;
 
 class BTreeBase : public DbIndex {
 public:
@@ -14,39 +18,167 @@ public:
     virtual void close();
 
     virtual Handles* lookup(ValueDict* key);
+    virtual bool contains(const KeyValue* key);
+    virtual uint lookup_cost();
 
     virtual void insert(Handle handle);
     virtual void del(Handle handle);
+    virtual void del(const Handles* handles);  // saves each node it changes just once
 
     virtual KeyValue *tkey(const ValueDict *key) const; // pull out the key values from the ValueDict in order
+    KeyValue *prefix_key(const ValueDict *key) const;  // the same for as many leading key columns as it has
+    virtual BTreeCursor *cursor(const KeyValue *tmin, const KeyValue *tmax, bool return_keys);
+    virtual BTreeReverseCursor *reverse_cursor(const KeyValue *tmin, const KeyValue *tmax, bool return_keys);
+
+    // adaptive hash: keys looked up over and over get remembered with their leaf, so the next lookup skips
+    // the descent (on by default)
+    void set_adaptive_hash(bool on);
+
+    // the number of boundaries in the root and the bytes they take up on its block (both 0 for a leaf root)
+    void root_boundaries(uint &boundaries, uint &bytes);
+    void bloom_blocks(BlockID &first, uint &blocks);  // the first block of the Bloom filter and how many it has
 
 protected:
+    friend class BTreeCursor;
+    friend class BTreeReverseCursor;
+
     static const BlockID STAT = 1;
+    static const uint ADAPTIVE_THRESHOLD = 3;  // lookups of a key before it goes in the adaptive hash
+    static const uint ADAPTIVE_MAX = 4096;  // keys in the adaptive hash before it starts over
     bool closed;
     BTreeStat *stat;
     BTreeNode *root;
     HeapFile file;
     KeyProfile key_profile;
+    BTreeBloom bloom;
+    bool loading;  // bulk load in progress: Bloom filter blocks get written once, at the end
+    bool adaptive;
+    std::unordered_map<std::string, BlockID> adaptive_leaves;  // encoded key -> leaf it is in
+    std::unordered_map<std::string, uint> adaptive_counts;  // encoded key -> lookups so far
+
+    void forget_leaf(BlockID leaf_id);
+    bool might_contain(const KeyValue* key) const { return this->bloom.might_contain(BTreeKey::encode(*key)); }
+    void add_entry(const KeyValue* key, BTreeLeafValue value);
+    void grow_bloom();
 
     virtual void build_key_profile();
     virtual BTreeLeafBase *_lookup(BTreeNode *node, uint height, const KeyValue* key);
+    virtual BTreeLeafBase *_last_leaf(BTreeNode *node, uint height, const BTreeKey *prefix = nullptr);
     virtual Insertion _insert(BTreeNode *node, uint height, const KeyValue* key, BTreeLeafValue handle);
     virtual void split_root(Insertion insertion);
+    virtual bool _del(BTreeNode *node, uint depth, const KeyValue* key);
+    virtual bool _del(BTreeNode *node, uint depth, BTreeKeys::const_iterator first, BTreeKeys::const_iterator last);
+    virtual KeyValue *entry_key(Handle handle);
+    virtual void rebalance(BTreeInterior *parent, uint i, BTreeNode *child, uint depth);
+    virtual void shrink_root();
     virtual BTreeNode *find(BTreeInterior *node, uint height, const KeyValue* key);
+    virtual BTreeNode *make_node(BlockID id, uint depth);
+    virtual BTreeLeafBase *_probe_leaf(const KeyValue* key);
     Handles* _range(KeyValue *tmin, KeyValue *tmax, bool return_keys);
-    virtual BTreeLeafBase *make_leaf(BlockID id, bool create) = 0;
+    virtual BTreeLeafBase *make_leaf(BlockID id, bool create, bool decode = true) = 0;
+    virtual Handle locator(const BTreeLeafValue& value) const { return value.h; }  // the row an entry points to
+};
+
+
+// Walks the leaves from tmin to tmax (inclusive, nullptr for no limit) in key order, holding on to just
+// one leaf at a time. Entries can be taken one by one (at_end/key/value/next) or in batches with fetch.
+// tmin and tmax may give just the leading key columns: tmax then takes in every key that starts with it.
+class BTreeCursor : public DbCursor {
+public:
+    BTreeCursor(BTreeBase &tree, const KeyValue *tmin, const KeyValue *tmax, bool return_keys);
+    virtual ~BTreeCursor();
+
+    bool at_end() const;
+    const KeyValue& key() const { return this->entry->first.value; }
+    const BTreeLeafValue& value() const { return this->entry->second; }
+    void next();
+
+    virtual Handles* fetch(uint limit);
+
+protected:
+    BTreeBase &tree;
+    BTreeLeafBase *leaf;
+    LeafMap::const_iterator entry;
+    bool has_max;
+    BTreeKey tmax;
+    bool return_keys;
+
+    void skip_empty_leaves();
+    void release_leaf();
+};
+
+
+// Same as BTreeCursor, but from tmax back down to tmin, following the prev_leaf links.
+class BTreeReverseCursor : public DbCursor {
+public:
+    BTreeReverseCursor(BTreeBase &tree, const KeyValue *tmin, const KeyValue *tmax, bool return_keys);
+    virtual ~BTreeReverseCursor();
+
+    bool at_end() const;
+    const KeyValue& key() const { return this->entry->first.value; }
+    const BTreeLeafValue& value() const { return this->entry->second; }
+    void next();
+
+    virtual Handles* fetch(uint limit);
+
+protected:
+    BTreeBase &tree;
+    BTreeLeafBase *leaf;
+    LeafMap::const_reverse_iterator entry;
+    bool has_min;
+    BTreeKey tmin;
+    bool return_keys;
+
+    void skip_empty_leaves();
+    void release_leaf();
 };
 
 
 class BTreeIndex : public BTreeBase {
 public:
-    BTreeIndex(DbRelation& relation, Identifier name, ColumnNames key_columns, bool unique);
+    // include_columns are extra (non-key) columns carried in the leaves so more queries can skip the relation
+    BTreeIndex(DbRelation& relation, Identifier name, ColumnNames key_columns, bool unique,
+               ColumnNames include_columns = ColumnNames());
     virtual ~BTreeIndex();
 
     virtual Handles* range(ValueDict* min_key, ValueDict* max_key);
+    virtual Handles* first(bool last);
+    virtual bool supports_range() const { return true; }
+    virtual void insert(Handle handle);
+
+    virtual bool covers(const ColumnNames* column_names) const;
+    virtual DbCursor* cursor(const ValueDict* where);
+    using BTreeBase::cursor;
+    virtual ValueDict* project(Handle handle, const ColumnNames* column_names);
+    using DbIndex::project;
+
+protected:
+    friend class BTreeCoveringCursor;
+
+    ColumnNames include_columns;
+    ColumnNames locator_columns;  // primary key of a relation organized by it (its rows' handles are keys)
+    ColumnNames value_columns;  // what the leaves carry besides the key: locator then included columns
+    ColumnAttributes value_attributes;
+
+    virtual BTreeLeafBase *make_leaf(BlockID id, bool create, bool decode = true);
+    virtual Handle locator(const BTreeLeafValue& value) const;
+    KeyValue covered_row(const KeyValue& key, const BTreeLeafValue& value) const;
+};
+
+
+// Index-only scan over a BTreeIndex. Each handle's key_value is the whole covered row: the key columns
+// followed by the locator and included columns. Use BTreeIndex::project to turn them into ValueDicts.
+class BTreeCoveringCursor : public DbCursor {
+public:
+    BTreeCoveringCursor(BTreeIndex &index, BTreeCursor *entries, const ValueDict *where);
+    virtual ~BTreeCoveringCursor();
+
+    virtual Handles* fetch(uint limit);
 
 protected:
-    virtual BTreeLeafBase *make_leaf(BlockID id, bool create);
+    BTreeIndex &index;
+    BTreeCursor *entries;
+    ValueDict where;
 };
 
 
@@ -62,13 +194,14 @@ public:
 
     virtual Handles* range(KeyValue *tmin, KeyValue *tmax);
     virtual ValueDict *lookup_value(ValueDict *key);
+    virtual ValueDict *lookup_value(const KeyValue *key);
     virtual void insert_value(ValueDict *row);
 
 protected:
     ColumnNames non_key_column_names;
     ColumnAttributes non_key_column_attributes;
 
-    virtual BTreeLeafBase *make_leaf(BlockID id, bool create);
+    virtual BTreeLeafBase *make_leaf(BlockID id, bool create, bool decode = true);
 };
 
 
@@ -76,7 +209,7 @@ class BTreeTable : public DbRelation {
 public:
     BTreeTable(Identifier table_name, ColumnNames column_names, ColumnAttributes column_attributes,
                const ColumnNames& primary_key);
-    virtual ~BTreeTable() {}
+    virtual ~BTreeTable() { delete index; }
 
     virtual void create();
     virtual void create_if_not_exists();
@@ -88,11 +221,16 @@ public:
     virtual Handle insert(const ValueDict* row);
     virtual void update(const Handle handle, const ValueDict* new_values);
     virtual void del(const Handle handle);
+    virtual void del(const Handles* handles);
 
     virtual Handles* select();
     virtual Handles* select(const ValueDict* where);
     virtual Handles* select(Handles *current_selection, const ValueDict* where);
+    virtual DbCursor* cursor(const ValueDict* where);
+    virtual DbCursor* cursor(const ValueDict* where, const ValueDict* min_values, const ValueDict* max_values);
+    virtual DbCursor* reverse_cursor(const ValueDict* where, const ValueDict* min_values, const ValueDict* max_values);
 	ValueDict* getValueDict(Handle handle);
+    void set_adaptive_hash(bool on) { index->set_adaptive_hash(on); }
 
 	virtual ValueDict* project(Handle handle);
     virtual ValueDict* project(Handle handle, const ColumnNames* column_names);
@@ -101,10 +239,16 @@ public:
 protected:
     BTreeFile *index;
 
+    virtual ValueDict* find_row(const KeyValue& key);
     virtual ValueDict* validate(const ValueDict* row) const;
     virtual bool selected(Handle handle, const ValueDict* where);
-    virtual void make_range(const ValueDict *where, KeyValue *&minval, KeyValue *&maxval, ValueDict *&additional_where);
+    virtual void make_range(const ValueDict *where, KeyValue &tkey, ValueDict &additional_where);
+    DbCursor* range_cursor(const ValueDict* where, const ValueDict* min_values, const ValueDict* max_values,
+                           bool backward);
 };
 
 bool test_btree();
 bool test_table();
+void benchmark_btree();
+void benchmark_table(uint rows);
+bool benchmark_table_soak(uint lookups);
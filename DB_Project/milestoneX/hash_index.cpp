@@ -0,0 +1,481 @@
+
+#include "hash_index.h"
+#include <memory>
+
+/************
+ * HashIndex
+ ************/
+
+HashIndex::HashIndex(DbRelation& relation, Identifier name, ColumnNames key_columns, bool unique)
+	: DbIndex(relation, name, key_columns, unique),
+	file(relation.get_table_name() + "-" + name),
+	overflow(relation.get_table_name() + "-" + name + "-overflow"),
+	closed(true),
+	locator_profile(),
+	locator_columns(),
+	level(0),
+	split(0),
+	entries(0),
+	entry_bytes(0),
+	overflow_blocks(0),
+	free_overflow(0) {
+	// rows of a table organized by primary key are found by that key, so the entries have to carry it
+	if (relation.has_primary_key()) {
+		this->locator_columns = *relation.get_primary_key();
+		ColumnAttributes *attributes = relation.get_column_attributes(this->locator_columns);
+		for (auto& attribute : *attributes)
+			this->locator_profile.push_back(attribute.get_data_type());
+		delete attributes;
+	}
+}
+
+HashIndex::~HashIndex() {
+}
+
+// Create the index: the statistics block, the initial buckets, and an entry for every row in the relation.
+void HashIndex::create() {
+	this->file.create();
+	this->overflow.create();
+	this->closed = false;
+	this->level = this->split = this->entries = this->entry_bytes = this->overflow_blocks = 0;
+	this->free_overflow = 0;
+	for (uint i = 0; i < INITIAL_BUCKETS; i++) {
+		SlottedPage *block = this->file.get_new();
+		BlockID next = 0;
+		Dbt dbt(&next, sizeof(next));
+		block->add(&dbt);
+		this->file.put(block);
+		delete block;
+	}
+	save_stat();
+
+	Handles *handles = nullptr;
+	try {
+		handles = this->relation.select(this->predicate.empty() ? nullptr : &this->predicate);
+		for (auto const &handle : *handles)
+			insert(handle);
+		delete handles;
+	}
+	catch (...) {
+		delete handles;
+		drop();
+		throw;
+	}
+}
+
+// Drop the index.
+void HashIndex::drop() {
+	this->file.drop();
+	this->overflow.drop();
+	this->closed = true;
+}
+
+// Open existing index.
+void HashIndex::open() {
+	if (this->closed) {
+		this->file.open();
+		this->overflow.open();
+		load_stat();
+		this->closed = false;
+	}
+}
+
+// Closes the index.
+void HashIndex::close() {
+	this->file.close();
+	this->overflow.close();
+	this->closed = true;
+}
+
+// Find all the rows whose columns are equal to key. Only the key's bucket is read.
+Handles* HashIndex::lookup(ValueDict* key_values) {
+	open();
+	std::string key = key_bytes(key_values);
+	uint32_t h = hash(key);
+	uint32_t b = bucket(h);
+	Handles *handles = new Handles();
+	BlockID overflow_id = 0;
+	do {
+		std::unique_ptr<SlottedPage> block(get_block(b, overflow_id));
+		std::unique_ptr<RecordIDs> record_ids(block->ids());
+		for (auto const& record_id : *record_ids) {
+			if (record_id == NEXT)
+				continue;
+			std::unique_ptr<Dbt> dbt(block->get(record_id));
+			if (entry_matches(dbt.get(), h, key))
+				handles->push_back(entry_handle(dbt.get()));
+		}
+		std::unique_ptr<Dbt> next(block->get(NEXT));
+		overflow_id = *(BlockID *)next->get_data();
+	} while (overflow_id != 0);
+	return handles;
+}
+
+// Insert an entry for the row with the given handle. Row must exist in relation already.
+void HashIndex::insert(Handle handle) {
+	open();
+	std::unique_ptr<ValueDict> row(this->relation.project(handle, &this->key_columns));
+	std::string key = key_bytes(row.get());
+	if (this->unique) {
+		std::unique_ptr<Handles> existing(lookup(row.get()));
+		if (!existing->empty())
+			throw DbRelationError("Duplicate keys are not allowed in unique index");
+	}
+	std::string e = entry(key, handle);
+	if (e.size() > MAX_ENTRY)
+		throw DbRelationError("key too big for hash index " + this->name);
+	add_entry(bucket(hash(key)), e);
+	this->entries++;
+	this->entry_bytes += (uint32_t)e.size();
+
+	// grow by one bucket when the entries would fill the buckets past FILL_PERCENT
+	const u_long capacity = DB_BLOCK_SZ - 4 * 2 - sizeof(BlockID);  // per bucket, less the header and NEXT
+	if ((u_long)(this->entry_bytes + 4 * this->entries) * 100 > capacity * bucket_count() * FILL_PERCENT)
+		split_next();
+	save_stat();
+}
+
+// Delete the entry for the row with the given handle. The row must still be in the relation.
+void HashIndex::del(Handle handle) {
+	open();
+	std::unique_ptr<ValueDict> row(this->relation.project(handle, &this->key_columns));
+	std::string key = key_bytes(row.get());
+	std::string e = entry(key, handle);
+	uint32_t b = bucket(hash(key));
+	BlockID overflow_id = 0;
+	do {
+		std::unique_ptr<SlottedPage> block(get_block(b, overflow_id));
+		std::unique_ptr<RecordIDs> record_ids(block->ids());
+		for (auto const& record_id : *record_ids) {
+			if (record_id == NEXT)
+				continue;
+			std::unique_ptr<Dbt> dbt(block->get(record_id));
+			if (dbt->get_size() == e.size() && memcmp(dbt->get_data(), e.data(), e.size()) == 0) {
+				block->del(record_id);
+				put_block(block.get(), overflow_id);
+				this->entries--;
+				this->entry_bytes -= (uint32_t)e.size();
+				save_stat();
+				return;
+			}
+		}
+		std::unique_ptr<Dbt> next(block->get(NEXT));
+		overflow_id = *(BlockID *)next->get_data();
+	} while (overflow_id != 0);
+}
+
+// Expected number of blocks read by an equality lookup: the bucket and its share of the overflow blocks.
+uint HashIndex::lookup_cost() {
+	open();
+	return 1 + this->overflow_blocks / bucket_count();
+}
+
+// Read the statistics block.
+void HashIndex::load_stat() {
+	std::unique_ptr<SlottedPage> block(this->file.get(1));
+	uint32_t *values[] = { &this->level, &this->split, &this->entries, &this->entry_bytes,
+		&this->overflow_blocks, &this->free_overflow };
+	for (RecordID record_id = LEVEL; record_id <= FREE_OVERFLOW; record_id++) {
+		std::unique_ptr<Dbt> dbt(block->get(record_id));
+		*values[record_id - LEVEL] = *(uint32_t *)dbt->get_data();
+	}
+}
+
+// Write the statistics block.
+void HashIndex::save_stat() {
+	std::unique_ptr<SlottedPage> block(this->file.get(1));
+	uint32_t values[] = { this->level, this->split, this->entries, this->entry_bytes,
+		this->overflow_blocks, this->free_overflow };
+	block->clear();
+	for (auto& value : values) {
+		Dbt dbt(&value, sizeof(value));
+		block->add(&dbt);
+	}
+	this->file.put(block.get());
+}
+
+// FNV-1a over the encoded key.
+uint32_t HashIndex::hash(const std::string& key) {
+	uint32_t h = 2166136261U;
+	for (auto const& c : key) {
+		h ^= (uint8_t)c;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+// Which bucket a hash goes in: buckets before the split pointer have already been split, so they use
+// the next level's hash.
+uint32_t HashIndex::bucket(uint32_t hash) const {
+	uint32_t b = hash % (INITIAL_BUCKETS << this->level);
+	if (b < this->split)
+		b = hash % (INITIAL_BUCKETS << (this->level + 1));
+	return b;
+}
+
+// A block of a bucket's chain: its first block if overflow_id is 0, otherwise that overflow block.
+SlottedPage* HashIndex::get_block(uint32_t bucket, BlockID overflow_id) {
+	if (overflow_id == 0)
+		return this->file.get(bucket + 2);
+	return this->overflow.get(overflow_id);
+}
+
+// Write a block from a bucket's chain back to the right file.
+void HashIndex::put_block(SlottedPage* block, BlockID overflow_id) {
+	if (overflow_id == 0)
+		this->file.put(block);
+	else
+		this->overflow.put(block);
+}
+
+// An empty overflow block (with its NEXT record set to 0), reused from the free list if there is one.
+BlockID HashIndex::new_overflow() {
+	BlockID next = 0;
+	Dbt dbt(&next, sizeof(next));
+	std::unique_ptr<SlottedPage> block;
+	if (this->free_overflow != 0) {
+		block.reset(this->overflow.get(this->free_overflow));
+		std::unique_ptr<Dbt> link(block->get(NEXT));
+		this->free_overflow = *(BlockID *)link->get_data();
+		block->clear();
+	}
+	else {
+		block.reset(this->overflow.get_new());
+	}
+	this->overflow_blocks++;
+	block->add(&dbt);
+	this->overflow.put(block.get());
+	return block->get_block_id();
+}
+
+// The encoded key columns from row (see BTreeKey::encode), which is what gets hashed and compared.
+std::string HashIndex::key_bytes(const ValueDict* row) const {
+	KeyValue key;
+	for (auto const& column_name : this->key_columns)
+		key.push_back(row->at(column_name));
+	return BTreeKey::encode(key);
+}
+
+// An entry is the hash, the key's length and bytes, and then the row's locator: its block and record
+// for a heap table, or its encoded primary key.
+std::string HashIndex::entry(const std::string& key, Handle handle) const {
+	uint32_t h = hash(key);
+	uint16_t size = (uint16_t)key.size();
+	std::string e((char *)&h, sizeof(h));
+	e.append((char *)&size, sizeof(size));
+	e.append(key);
+	if (this->locator_columns.empty()) {
+		e.append((char *)&handle.block_id, sizeof(BlockID));
+		e.append((char *)&handle.record_id, sizeof(RecordID));
+	}
+	else {
+		e.append(BTreeKey::encode(handle.key_value));
+	}
+	return e;
+}
+
+// The handle of the row an entry points to.
+Handle HashIndex::entry_handle(const Dbt* entry) const {
+	const char *bytes = (const char *)entry->get_data();
+	uint16_t size = *(uint16_t *)(bytes + sizeof(uint32_t));
+	const char *locator = bytes + sizeof(uint32_t) + sizeof(uint16_t) + size;
+	if (this->locator_columns.empty())
+		return Handle(*(BlockID *)locator, *(RecordID *)(locator + sizeof(BlockID)));
+	std::string encoded(locator, bytes + entry->get_size() - locator);
+	return Handle(BTreeKey::decode(encoded, this->locator_profile));
+}
+
+// Is this entry for the given key? The hash is checked first since it is nearly always enough to say no.
+bool HashIndex::entry_matches(const Dbt* entry, uint32_t hash, const std::string& key) {
+	const char *bytes = (const char *)entry->get_data();
+	if (*(uint32_t *)bytes != hash)
+		return false;
+	uint16_t size = *(uint16_t *)(bytes + sizeof(uint32_t));
+	return size == key.size() && memcmp(bytes + sizeof(uint32_t) + sizeof(uint16_t), key.data(), size) == 0;
+}
+
+// Put an entry in the first block of the bucket's chain with room for it, adding an overflow block if none has.
+void HashIndex::add_entry(uint32_t bucket, const std::string& entry) {
+	Dbt dbt((void *)entry.data(), (u_int32_t)entry.size());
+	BlockID overflow_id = 0;
+	while (true) {
+		std::unique_ptr<SlottedPage> block(get_block(bucket, overflow_id));
+		try {
+			block->add(&dbt);
+			put_block(block.get(), overflow_id);
+			return;
+		}
+		catch (DbBlockNoRoomError &e) {
+			std::unique_ptr<Dbt> next(block->get(NEXT));
+			BlockID next_id = *(BlockID *)next->get_data();
+			if (next_id == 0) {
+				next_id = new_overflow();
+				block->put(NEXT, Dbt(&next_id, sizeof(next_id)));
+				put_block(block.get(), overflow_id);
+			}
+			overflow_id = next_id;
+		}
+	}
+}
+
+// Split the bucket at the split pointer: its entries are rehashed with the next level's hash and either
+// stay or move to the new bucket at the end. Its overflow blocks go back on the free list and are
+// handed out again as the two buckets need them.
+void HashIndex::split_next() {
+	uint32_t old_bucket = this->split;
+	uint32_t new_bucket = bucket_count();
+
+	// take all the entries out of the old bucket's chain
+	std::vector<std::string> moving;
+	BlockID overflow_id = 0;
+	do {
+		std::unique_ptr<SlottedPage> block(get_block(old_bucket, overflow_id));
+		std::unique_ptr<RecordIDs> record_ids(block->ids());
+		for (auto const& record_id : *record_ids) {
+			if (record_id == NEXT)
+				continue;
+			std::unique_ptr<Dbt> dbt(block->get(record_id));
+			moving.push_back(std::string((char *)dbt->get_data(), dbt->get_size()));
+		}
+		std::unique_ptr<Dbt> next(block->get(NEXT));
+		BlockID next_id = *(BlockID *)next->get_data();
+		block->clear();
+		if (overflow_id == 0) {
+			BlockID none = 0;
+			Dbt dbt(&none, sizeof(none));
+			block->add(&dbt);
+		}
+		else {
+			Dbt dbt(&this->free_overflow, sizeof(BlockID));
+			block->add(&dbt);
+			this->free_overflow = overflow_id;
+			this->overflow_blocks--;
+		}
+		put_block(block.get(), overflow_id);
+		overflow_id = next_id;
+	} while (overflow_id != 0);
+
+	// the new bucket is the next block of the file
+	std::unique_ptr<SlottedPage> block(this->file.get_new());
+	if (block->get_block_id() != new_bucket + 2)
+		throw DbRelationError("hash index " + this->name + " buckets out of order");
+	BlockID none = 0;
+	Dbt next(&none, sizeof(none));
+	block->add(&next);
+	this->file.put(block.get());
+
+	// advance the split pointer before redistributing so bucket() uses the next level's hash for old_bucket
+	if (++this->split == (INITIAL_BUCKETS << this->level)) {
+		this->level++;
+		this->split = 0;
+	}
+	for (auto const& e : moving)
+		add_entry(bucket(*(uint32_t *)e.data()), e);
+}
+
+
+bool test_hash_index() {
+	ColumnNames column_names;
+	column_names.push_back("a");
+	column_names.push_back("b");
+	ColumnAttributes column_attributes;
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+	HeapTable table("__test_hash", column_names, column_attributes);
+	table.create();
+	const int N = 3000;
+	for (int i = 0; i < N; i++) {
+		ValueDict row;
+		row["a"] = Value(i % 1000);  // three rows for each a
+		row["b"] = Value("row " + std::to_string(i));
+		table.insert(&row);
+	}
+	ColumnNames key_columns;
+	key_columns.push_back("a");
+	HashIndex index(table, "hashfoo", key_columns, false);
+	index.create();
+	if (index.bucket_count() <= HashIndex::INITIAL_BUCKETS) {
+		std::cout << "hash index never split" << std::endl;
+		return false;
+	}
+	for (int a = 0; a < 1000; a += 37) {
+		ValueDict key;
+		key["a"] = Value(a);
+		Handles *handles = index.lookup(&key);
+		bool ok = handles->size() == 3;
+		for (auto const& handle : *handles) {
+			ValueDict *row = table.project(handle);
+			ok = ok && (*row)["a"].n == a;
+			delete row;
+		}
+		delete handles;
+		if (!ok) {
+			std::cout << "hash lookup " << a << " failed" << std::endl;
+			return false;
+		}
+	}
+	ValueDict missing;
+	missing["a"] = Value(N);
+	Handles *handles = index.lookup(&missing);
+	bool found = !handles->empty();
+	delete handles;
+	if (found) {
+		std::cout << "hash lookup of missing key found something" << std::endl;
+		return false;
+	}
+
+	// delete the rows with a == 5 and see them go
+	ValueDict five;
+	five["a"] = Value(5);
+	handles = index.lookup(&five);
+	for (auto const& handle : *handles) {
+		index.del(handle);
+		table.del(handle);
+	}
+	delete handles;
+	handles = index.lookup(&five);
+	found = !handles->empty();
+	delete handles;
+	if (found) {
+		std::cout << "hash delete failed" << std::endl;
+		return false;
+	}
+
+	// reopen and check we get the same answers from disk
+	index.close();
+	ValueDict six;
+	six["a"] = Value(6);
+	handles = index.lookup(&six);
+	found = handles->size() == 3;
+	delete handles;
+	index.drop();
+	if (!found) {
+		table.drop();
+		std::cout << "hash lookup after reopen failed" << std::endl;
+		return false;
+	}
+
+	// a key too big for any block is refused rather than chaining overflow blocks forever
+	ColumnNames b_column;
+	b_column.push_back("b");
+	HashIndex b_index(table, "hashbar", b_column, false);
+	b_index.create();
+	ValueDict big;
+	big["a"] = Value(N);
+	big["b"] = Value(std::string(HashIndex::MAX_ENTRY, 'x'));
+	Handle big_handle = table.insert(&big);
+	bool refused = false;
+	try {
+		b_index.insert(big_handle);
+	}
+	catch (DbRelationError &e) {
+		refused = true;
+	}
+	b_index.drop();
+	table.drop();
+	if (!refused) {
+		std::cout << "hash index took an oversized key" << std::endl;
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "BTreeNode.h"
+
+// Linear hash index (Litwin). Bucket b's first block is block b+2 of the index file (block 1 holds
+// the statistics), so finding a bucket never needs a directory. Buckets that fill up chain on to
+// overflow blocks in a second file. When the entries outgrow the buckets, the bucket at the split
+// pointer is split in two, one bucket at a time, so the table grows smoothly.
+// Entries are found by the hash of the key, then checked against the key itself, so equality lookups
+// read one bucket (plus its overflow, if any). Duplicate keys are allowed unless the index is unique.
+class HashIndex : public DbIndex {
+public:
+    static const uint INITIAL_BUCKETS = 4;
+    static const uint FILL_PERCENT = 75;  // split when the entries would fill the buckets this full
+    static const uint MAX_ENTRY = DB_BLOCK_SZ - 1 - sizeof(BlockID) - 4 * 3;  // fits in a block beside NEXT
+
+    HashIndex(DbRelation& relation, Identifier name, ColumnNames key_columns, bool unique);
+    virtual ~HashIndex();
+
+    virtual void create();
+    virtual void drop();
+
+    virtual void open();
+    virtual void close();
+
+    virtual Handles* lookup(ValueDict* key_values);
+
+    virtual void insert(Handle handle);
+    virtual void del(Handle handle);
+    using DbIndex::del;
+
+    virtual uint lookup_cost();
+
+    uint bucket_count() const { return (INITIAL_BUCKETS << this->level) + this->split; }
+
+protected:
+    // records in the statistics block
+    static const RecordID LEVEL = 1;
+    static const RecordID SPLIT = 2;
+    static const RecordID ENTRIES = 3;
+    static const RecordID ENTRY_BYTES = 4;
+    static const RecordID OVERFLOW_BLOCKS = 5;
+    static const RecordID FREE_OVERFLOW = 6;
+    // first record of every bucket block: the next overflow block in the chain (0 at the end)
+    static const RecordID NEXT = 1;
+
+    HeapFile file;
+    HeapFile overflow;
+    bool closed;
+    KeyProfile locator_profile;
+    ColumnNames locator_columns;  // primary key of a relation organized by it (its rows' handles are keys)
+    uint32_t level;
+    uint32_t split;
+    uint32_t entries;
+    uint32_t entry_bytes;
+    uint32_t overflow_blocks;  // in some bucket's chain, not on the free list
+    BlockID free_overflow;  // overflow blocks no longer in any chain, linked through their NEXT records
+
+    void load_stat();
+    void save_stat();
+    static uint32_t hash(const std::string& key);
+    uint32_t bucket(uint32_t hash) const;
+    SlottedPage* get_block(uint32_t bucket, BlockID overflow_id);
+    void put_block(SlottedPage* block, BlockID overflow_id);
+    BlockID new_overflow();
+
+    std::string key_bytes(const ValueDict* row) const;
+    std::string entry(const std::string& key, Handle handle) const;
+    Handle entry_handle(const Dbt* entry) const;
+    static bool entry_matches(const Dbt* entry, uint32_t hash, const std::string& key);
+    void add_entry(uint32_t bucket, const std::string& entry);
+    void split_next();
+};
+
+bool test_hash_index();
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <algorithm>
 #include "heap_storage.h"
 
 typedef uint16_t u16;
@@ -97,6 +98,11 @@ u16 SlottedPage::size() const {
     return count;
 }
 
+// Bytes still available for new records (and their headers) in the block
+u16 SlottedPage::unused_bytes() const {
+    return this->end_free - (u16)(4 * (this->num_records + 1));
+}
+
 
 // Get the size and offset for given id. For id of zero, it is the block header.
 void SlottedPage::get_header(u16 &size, u16 &loc, RecordID id) const {
@@ -117,8 +123,8 @@ void SlottedPage::put_header(RecordID id, u16 size, u16 loc) {
 // Calculate if we have room to store a record with given size. The size should include the 4 bytes
 // for the header, too, if this is an add.
 bool SlottedPage::has_room(u16 size) const {
-	u16 available = this->end_free - (u16)(4 * (this->num_records+2));
-	return size <= available;
+	int available = this->end_free - 4 * (this->num_records+2);  // can go negative when nearly full
+	return available >= 0 && size <= available;
 }
 
 // If start < end, then remove data from offset start up to but not including offset end by sliding data
@@ -263,6 +269,24 @@ void HeapFile::db_open(uint flags) {
     this->closed = false;
 }
 
+// Hand out up to limit more handles (0 for all the rest), moving on to the next block as each runs out.
+Handles* HeapFileCursor::fetch(uint limit) {
+	Handles* handles = new Handles();
+	while (limit == 0 || handles->size() < limit) {
+		if (this->record_ids == nullptr || this->position >= this->record_ids->size()) {
+			if (this->block_id >= this->file.get_last_block_id())
+				break;
+			delete this->record_ids;
+			SlottedPage* block = this->file.get(++this->block_id);
+			this->record_ids = block->ids();
+			this->position = 0;
+			delete block;
+			continue;
+		}
+		handles->push_back(Handle(this->block_id, (*this->record_ids)[this->position++]));
+	}
+	return handles;
+}
 
 /*
  * *******************
@@ -373,6 +397,15 @@ Handles* HeapTable::select(Handles *current_selection, const ValueDict* where) {
     return handles;
 }
 
+// Stream the selection a block at a time, so a caller that stops early never reads the rest of the file.
+DbCursor* HeapTable::cursor(const ValueDict* where) {
+    open();
+    DbCursor* all = new HeapFileCursor(this->file);
+    if (where == nullptr || where->empty())
+        return all;
+    return new SelectCursor(*this, all, *where);
+}
+
 // Return a sequence of all values for handle.
 ValueDict* HeapTable::project(Handle handle) {
 	return project(handle, &this->column_names);
@@ -380,22 +413,51 @@ ValueDict* HeapTable::project(Handle handle) {
 
 // Return a sequence of values for handle given by column_names.
 ValueDict* HeapTable::project(Handle handle, const ColumnNames* column_names) {
+    std::vector<bool> wanted = wanted_columns(column_names);
 	BlockID block_id = handle.block_id;
 	RecordID record_id = handle.record_id;
     SlottedPage* block = file.get(block_id);
     Dbt* data = block->get(record_id);
-    ValueDict* row = unmarshal(data);
+    ValueDict* row = unmarshal(data, wanted);
     delete data;
     delete block;
-    if (column_names->empty())
-    	return row;
-    ValueDict* result = new ValueDict();
+    return row;
+}
+
+// Project each of a batch of handles, working out which columns to decode just once and reading a block just
+// once for a run of handles in it.
+ValueDicts* HeapTable::project(Handles *handles, const ColumnNames* column_names) {
+    std::vector<bool> wanted = wanted_columns(column_names);
+    ValueDicts* rows = new ValueDicts();
+    SlottedPage* block = nullptr;
+    for (auto const& handle: *handles) {
+        if (block == nullptr || block->get_block_id() != handle.block_id) {
+            delete block;
+            block = file.get(handle.block_id);
+        }
+        Dbt* data = block->get(handle.record_id);
+        rows->push_back(unmarshal(data, wanted));
+        delete data;
+    }
+    delete block;
+    return rows;
+}
+
+// Project each of a batch of handles, all columns.
+ValueDicts* HeapTable::project(Handles *handles) {
+    return project(handles, &this->column_names);
+}
+
+// Which of the table's columns (in column_names order) column_names asks for; an empty one asks for them all.
+std::vector<bool> HeapTable::wanted_columns(const ColumnNames* column_names) const {
+    std::vector<bool> wanted(this->column_names.size(), column_names->empty());
     for (auto const& column_name: *column_names) {
-        if (row->find(column_name) == row->end())
+        auto column = std::find(this->column_names.begin(), this->column_names.end(), column_name);
+        if (column == this->column_names.end())
             throw DbRelationError("table does not have column named '" + column_name + "'");
-        (*result)[column_name] = (*row)[column_name];
+        wanted[column - this->column_names.begin()] = true;
     }
-    return result;
+    return wanted;
 }
 
 // Check if the given row is acceptable to insert. Raise ValueError if not.
@@ -481,42 +543,54 @@ Dbt* HeapTable::marshal(const ValueDict* row) const {
 }
 
 ValueDict* HeapTable::unmarshal(Dbt* data) const {
+    return unmarshal(data, std::vector<bool>(this->column_names.size(), true));
+}
+
+// Just the wanted columns of the row: the others are stepped over by their widths (INT and BOOLEAN are fixed,
+// TEXT has its length in front), never decoded, and it stops after the last wanted one.
+ValueDict* HeapTable::unmarshal(Dbt* data, const std::vector<bool> &wanted) const {
     ValueDict *row = new ValueDict();
     Value value;
     char *bytes = (char*)data->get_data();
     uint offset = 0;
-    uint col_num = 0;
-    for (auto const& column_name: this->column_names) {
-    	ColumnAttribute ca = this->column_attributes[col_num++];
+    uint remaining = (uint) std::count(wanted.begin(), wanted.end(), true);
+    for (uint col_num = 0; remaining > 0; col_num++) {
+        ColumnAttribute ca = this->column_attributes[col_num];
+        bool want = wanted[col_num];
         value.data_type = ca.get_data_type();
-    	if (ca.get_data_type() == ColumnAttribute::DataType::INT) {
-    		value.n = *(int32_t*)(bytes + offset);
-    		offset += sizeof(int32_t);
-    	} else if (ca.get_data_type() == ColumnAttribute::DataType::TEXT) {
-    		u16 size = *(u16*)(bytes + offset);
-    		offset += sizeof(u16);
-    		char buffer[DB_BLOCK_SZ];
-    		memcpy(buffer, bytes+offset, size);
-    		buffer[size] = '\0';
-    		value.s = std::string(buffer);  // assume ascii for now
+        if (ca.get_data_type() == ColumnAttribute::DataType::INT) {
+            if (want)
+                value.n = *(int32_t*)(bytes + offset);
+            offset += sizeof(int32_t);
+        } else if (ca.get_data_type() == ColumnAttribute::DataType::TEXT) {
+            u16 size = *(u16*)(bytes + offset);
+            offset += sizeof(u16);
+            if (want)
+                value.s.assign(bytes + offset, size);  // assume ascii for now
             offset += size;
         } else if (ca.get_data_type() == ColumnAttribute::DataType::BOOLEAN) {
-            value.n = *(uint8_t*)(bytes + offset);
+            if (want)
+                value.n = *(uint8_t*)(bytes + offset);
             offset += sizeof(uint8_t);
-    	} else {
+        } else {
             throw DbRelationError("Only know how to unmarshal INT, TEXT, or BOOLEAN");
-    	}
-		(*row)[column_name] = value;
+        }
+        if (want) {
+            (*row)[this->column_names[col_num]] = value;
+            remaining--;
+        }
     }
     return row;
 }
 
 // See if the row at the given handle satisfies the given where clause
 bool HeapTable::selected(Handle handle, const ValueDict* where) {
-    if (where == nullptr)
+    if (where == nullptr || where->empty())
         return true;
     ValueDict* row = this->project(handle, where);
-    return *row == *where;
+    bool ret = *row == *where;
+    delete row;
+    return ret;
 }
 
 
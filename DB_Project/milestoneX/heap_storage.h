@@ -34,6 +34,7 @@ public:
 	virtual RecordIDs* ids(void) const;
     virtual void clear();
 	virtual u_int16_t size() const;
+	virtual u_int16_t unused_bytes() const;
 
 protected:
 	uint16_t num_records;
@@ -79,6 +80,23 @@ protected:
     virtual uint32_t get_block_count();
 };
 
+/**
+ * Cursor over every record of a heap file, reading a block only once the handles before it are used up.
+ */
+class HeapFileCursor : public DbCursor {
+public:
+	HeapFileCursor(HeapFile &file) : file(file), block_id(0), record_ids(nullptr), position(0) {}
+	virtual ~HeapFileCursor() { delete record_ids; }
+
+	virtual Handles* fetch(uint limit);
+
+protected:
+	HeapFile &file;
+	BlockID block_id;  // the block record_ids are from
+	RecordIDs *record_ids;
+	u_long position;  // next one of record_ids to hand out
+};
+
 /**
  * Heap storage engine.
  */
@@ -102,9 +120,13 @@ public:
 	virtual Handles* select();
 	virtual Handles* select(const ValueDict* where);
 	virtual Handles* select(Handles *current_selection, const ValueDict* where);
+	virtual DbCursor* cursor(const ValueDict* where);
+	using DbRelation::cursor;
 
 	virtual ValueDict* project(Handle handle);
 	virtual ValueDict* project(Handle handle, const ColumnNames* column_names);
+	virtual ValueDicts* project(Handles *handles);
+	virtual ValueDicts* project(Handles *handles, const ColumnNames* column_names);
     using DbRelation::project;
 
 protected:
@@ -113,6 +135,8 @@ protected:
 	virtual Handle append(const ValueDict* row);
 	virtual Dbt* marshal(const ValueDict* row) const;
 	virtual ValueDict* unmarshal(Dbt* data) const;
+	virtual ValueDict* unmarshal(Dbt* data, const std::vector<bool> &wanted) const;
+	std::vector<bool> wanted_columns(const ColumnNames* column_names) const;
 	virtual bool selected(Handle handle, const ValueDict* where);
 };
 
@@ -2,6 +2,7 @@
 #include "schema_tables.h"
 #include "ParseTreeToString.h"
 #include "btree.h"
+#include "hash_index.h"
 
 
 void initialize_schema_tables() {
@@ -14,6 +15,9 @@ void initialize_schema_tables() {
 	Indices indices;
 	indices.create_if_not_exists();
 	indices.close();
+	Statistics statistics;
+	statistics.create_if_not_exists();
+	statistics.close();
 }
 
 // Not terribly useful since the parser weeds most of these out
@@ -45,6 +49,7 @@ bool is_acceptable_data_type(std::string dt) {
  */
 const Identifier Tables::TABLE_NAME = "_tables";
 Columns* Tables::columns_table = nullptr;
+Statistics* Tables::statistics_table = nullptr;
 std::map<Identifier, DbRelation*> Tables::table_cache;
 
 // get the column name for _tables column
@@ -74,6 +79,9 @@ Tables::Tables() : HeapTable(TABLE_NAME, COLUMN_NAMES(), COLUMN_ATTRIBUTES()) {
 	if (Tables::columns_table == nullptr)
 		columns_table = new Columns();
 	Tables::table_cache[columns_table->TABLE_NAME] = columns_table;
+	if (Tables::statistics_table == nullptr)
+		statistics_table = new Statistics();
+	Tables::table_cache[statistics_table->TABLE_NAME] = statistics_table;
 }
 
 // Create the file and also, manually add schema tables.
@@ -87,6 +95,8 @@ void Tables::create() {
 	insert(&row);
 	row["table_name"] = Value("_indices");
 	insert(&row);
+	row["table_name"] = Value("_statistics");
+	insert(&row);
 }
 
 // Manually check that table_name is unique.
@@ -185,6 +195,7 @@ DbRelation& Tables::get_table(Identifier table_name) {
 		table = new BTreeTable(table_name, column_names, column_attributes, *primary_key);
 	else
 		throw DbRelationError("Unknown storage engine: " + storage_engine);
+	table->set_statistics(Tables::statistics_table->get_statistics(*table));
 	Tables::table_cache[table_name] = table;
 	return *table;
 }
@@ -266,6 +277,24 @@ void Columns::create() {
 	row["column_name"] = Value("is_unique");
 	row["data_type"] = Value("BOOLEAN");
 	insert(&row);
+	row["column_name"] = Value("predicate_value");
+	row["data_type"] = Value("TEXT");
+	insert(&row);
+
+	row["table_name"] = Value("_statistics");
+	row["column_name"] = Value("table_name");
+	insert(&row);
+	row["column_name"] = Value("column_name");
+	insert(&row);
+	row["column_name"] = Value("upper_bound");
+	insert(&row);
+	row["column_name"] = Value("bucket");
+	row["data_type"] = Value("INT");
+	insert(&row);
+	row["column_name"] = Value("row_count");
+	insert(&row);
+	row["column_name"] = Value("distinct_count");
+	insert(&row);
 }
 
 // Manually check that (table_name, column_name) is unique.
@@ -311,6 +340,7 @@ ColumnNames& Indices::COLUMN_NAMES() {
 		cn.push_back("column_name");
 		cn.push_back("index_type");
 		cn.push_back("is_unique");
+		cn.push_back("predicate_value");
 	}
 	return cn;
 }
@@ -329,6 +359,8 @@ ColumnAttributes& Indices::COLUMN_ATTRIBUTES() {
 		cas.push_back(ca);  // index_type
 		ca.set_data_type(ColumnAttribute::BOOLEAN);
 		cas.push_back(ca);  // is_unique
+		ca.set_data_type(ColumnAttribute::TEXT);
+		cas.push_back(ca);  // predicate_value
 	}
 	return cas;
 }
@@ -337,6 +369,49 @@ ColumnAttributes& Indices::COLUMN_ATTRIBUTES() {
 Indices::Indices() : HeapTable(TABLE_NAME, COLUMN_NAMES(), COLUMN_ATTRIBUTES()) {
 }
 
+// Open the table, creating it if it isn't there. A catalog from before partial indexes has no predicate_value
+// column, so its rows are read with the old layout and put back with an empty predicate_value, and the column
+// is added to _columns.
+void Indices::create_if_not_exists() {
+	HeapTable::create_if_not_exists();
+	Columns columns;
+	ValueDict where;
+	where["table_name"] = Value(TABLE_NAME);
+	where["column_name"] = Value("predicate_value");
+	Handles* handles = columns.select(&where);
+	bool current = !handles->empty();
+	delete handles;
+	if (current)
+		return;
+
+	ColumnNames old_names(COLUMN_NAMES().begin(), COLUMN_NAMES().end() - 1);
+	ColumnAttributes old_attributes(COLUMN_ATTRIBUTES().begin(), COLUMN_ATTRIBUTES().end() - 1);
+	HeapTable old(TABLE_NAME, old_names, old_attributes);
+	close();
+	old.open();
+	handles = old.select();
+	ValueDicts* rows = old.project(handles);
+	for (auto const& handle : *handles)
+		old.del(handle);
+	delete handles;
+	old.close();
+	open();
+	for (auto const& row : *rows) {
+		(*row)["predicate_value"] = Value("");
+		HeapTable::insert(row);
+		delete row;
+	}
+	delete rows;
+
+	ValueDict column;
+	column["table_name"] = Value(TABLE_NAME);
+	column["column_name"] = Value("predicate_value");
+	column["data_type"] = Value("TEXT");
+	column["primary_key_seq"] = Value(0);
+	columns.insert(&column);
+	columns.close();
+}
+
 // Manually check constraints -- unique on (table, index, column)
 Handle Indices::insert(const ValueDict* row) {
 	// Check that datatype is acceptable
@@ -349,8 +424,10 @@ Handle Indices::insert(const ValueDict* row) {
 	ValueDict where;
 	where["table_name"] = row->at("table_name");
 	where["index_name"] = row->at("index_name");
-	if (row->at("seq_in_index").n > 1)
+	if (row->at("seq_in_index").n != 1)
 	where["column_name"] = row->at("column_name");  // check for duplicate columns on the same index
+	if (row->at("seq_in_index").n == 0)
+		where["seq_in_index"] = Value(0);  // (but the predicate can be on key columns)
 	Handles* handles = select(&where);
 	bool unique = handles->empty();
 	delete handles;
@@ -375,66 +452,78 @@ void Indices::del(Handle handle) {
 	HeapTable::del(handle);
 }
 
-// Return a list of column names and column attributes for given table.
+// Return the key column names (and any included columns and predicate) for given index.
+// Included columns are stored with a negative seq_in_index: -1 for the first, -2 for the second, and so on.
+// A partial index's predicate is stored with seq_in_index 0, one row per column, with the value it must
+// have as text in predicate_value.
 void Indices::get_columns(Identifier table_name, Identifier index_name,
-	ColumnNames &column_names, bool &is_hash, bool &is_unique) {
+	ColumnNames &column_names, ColumnNames &include_columns, ValueDict &predicate, bool &is_hash, bool &is_unique) {
 	// SELECT * FROM _indices WHERE table_name = <table_name> AND index_name = <index_name>
 	ValueDict where;
 	where["table_name"] = table_name;
 	where["index_name"] = index_name;
 	Handles* handles = select(&where);
 
-	Identifier colnames[DbIndex::MAX_COMPOSITE];
-	uint size = 0;
+	Identifier colnames[DbIndex::MAX_COMPOSITE], includes[DbIndex::MAX_COMPOSITE];
+	uint size = 0, include_size = 0;
 	for (auto const& handle : *handles) {
 		ValueDict *row = project(handle);
 
 		Identifier column_name = (*row)["column_name"].s;
-		uint which = (uint)(*row)["seq_in_index"].n;
-		colnames[which - 1] = column_name;  // seq_in_index is 1-based
-		if (which > size)
-			size = which;
+		int seq = (*row)["seq_in_index"].n;
+		if (seq == 0) {
+			predicate[column_name] = (*row)["predicate_value"];
+		}
+		else if (seq < 0) {
+			uint which = (uint)-seq;
+			includes[which - 1] = column_name;
+			if (which > include_size)
+				include_size = which;
+		}
+		else {
+			uint which = (uint)seq;
+			colnames[which - 1] = column_name;  // seq_in_index is 1-based
+			if (which > size)
+				size = which;
+		}
 		is_unique = (*row)["is_unique"].n != 0;
 		is_hash = (*row)["index_type"].s == "HASH";
 		delete row;
 	}
 	for (uint i = 0; i < size; i++)
 		column_names.push_back(colnames[i]);
+	for (uint i = 0; i < include_size; i++)
+		include_columns.push_back(includes[i]);
 	delete handles;
 }
 
-// FIXME - use this for now until we have BTreeIndex and HashIndex
-class DummyIndex : public DbIndex {
-public:
-	DummyIndex(DbRelation& rel, Identifier idx, ColumnNames key, bool unq) : DbIndex(rel, idx, key, unq) {}
-	void create() {}
-	void drop() {}
-	void open() {}
-	void close() {}
-	Handles* lookup(ValueDict* key_values) { return nullptr; }
-	void insert(Handle handle) {}
-	void del(Handle handle) {}
-};
-
-
 // Return a table for given table_name.
 DbIndex& Indices::get_index(DbRelation &table, Identifier index_name) {
 	// if they are asking about an index we've once constructed, then just return that one
-	std::pair<Identifier, Identifier> cache_key(table_name, index_name);
+	std::pair<Identifier, Identifier> cache_key(table.get_table_name(), index_name);
 	if (Indices::index_cache.find(cache_key) != Indices::index_cache.end())
 		return  *Indices::index_cache[cache_key];
 
-	// otherwise assume it is a DummyIndex (for now)
-	ColumnNames column_names;
+	// otherwise construct it from what the catalog says about it
+	ColumnNames column_names, include_columns;
+	ValueDict predicate;
 	bool is_hash, is_unique;
-	get_columns(table_name, index_name, column_names, is_hash, is_unique);
+	get_columns(table.get_table_name(), index_name, column_names, include_columns, predicate, is_hash, is_unique);
 	DbIndex* index;
 	if (is_hash) {
-		index = new DummyIndex(table, index_name, column_names, is_unique);  // FIXME - change to HashIndex
+		index = new HashIndex(table, index_name, column_names, is_unique);
 	}
 	else {
-		index = new BTreeIndex(table, index_name, column_names, is_unique);
+		index = new BTreeIndex(table, index_name, column_names, is_unique, include_columns);
+	}
+	for (auto& column : predicate) {
+		ColumnNames predicate_column(1, column.first);
+		ColumnAttributes *attributes = table.get_column_attributes(predicate_column);
+		if (attributes->at(0).get_data_type() == ColumnAttribute::INT)
+			column.second = Value((int32_t)std::stol(column.second.s));
+		delete attributes;
 	}
+	index->set_predicate(predicate);
 	Indices::index_cache[cache_key] = index;
 	return *index;
 }
@@ -453,3 +542,132 @@ IndexNames Indices::get_index_names(Identifier table_name) {
 	delete handles;
 	return ret;
 }
+
+
+/*
+ * *******************************
+ * Statistics class implementation
+ * *******************************
+ */
+const Identifier Statistics::TABLE_NAME = "_statistics";
+const uint Statistics::HISTOGRAM_BUCKETS = 10;
+
+// get the column name for _statistics columns
+ColumnNames& Statistics::COLUMN_NAMES() {
+	static ColumnNames cn;
+	if (cn.empty()) {
+		cn.push_back("table_name");
+		cn.push_back("column_name");
+		cn.push_back("bucket");
+		cn.push_back("upper_bound");
+		cn.push_back("row_count");
+		cn.push_back("distinct_count");
+	}
+	return cn;
+}
+
+// get the column attribute for _statistics columns
+ColumnAttributes& Statistics::COLUMN_ATTRIBUTES() {
+	static ColumnAttributes cas;
+	if (cas.empty()) {
+		ColumnAttribute ca(ColumnAttribute::TEXT);
+		cas.push_back(ca);  // table_name
+		cas.push_back(ca);  // column_name
+		ca.set_data_type(ColumnAttribute::INT);
+		cas.push_back(ca);  // bucket
+		ca.set_data_type(ColumnAttribute::TEXT);
+		cas.push_back(ca);  // upper_bound
+		ca.set_data_type(ColumnAttribute::INT);
+		cas.push_back(ca);  // row_count
+		cas.push_back(ca);  // distinct_count
+	}
+	return cas;
+}
+
+// ctor - we have a fixed table structure
+Statistics::Statistics() : HeapTable(TABLE_NAME, COLUMN_NAMES(), COLUMN_ATTRIBUTES()) {
+}
+
+// Bounds are kept as text, like a partial index's predicate values.
+static Value from_text(const std::string &text, ColumnAttribute::DataType data_type) {
+	if (data_type == ColumnAttribute::INT)
+		return Value((int32_t)std::stol(text));
+	if (data_type == ColumnAttribute::BOOLEAN)
+		return Value(text == "1");
+	return Value(text);
+}
+
+static std::string to_text(const Value &value) {
+	if (value.data_type == ColumnAttribute::TEXT)
+		return value.s;
+	return std::to_string(value.n);
+}
+
+// Put the table's statistics back together from its rows, in bucket order.
+TableStatistics *Statistics::get_statistics(const DbRelation &table) {
+	ValueDict where;
+	where["table_name"] = Value(table.get_table_name());
+	Handles* handles = select(&where);
+	if (handles->empty()) {
+		delete handles;
+		return nullptr;
+	}
+	const ColumnNames &column_names = table.get_column_names();
+	ColumnAttributes column_attributes = table.get_column_attributes();
+	std::map<Identifier, std::map<int, ValueDict*>> buckets;
+	for (auto const& handle : *handles) {
+		ValueDict *row = project(handle);
+		buckets[row->at("column_name").s][row->at("bucket").n] = row;
+	}
+	delete handles;
+
+	TableStatistics *ret = new TableStatistics();
+	for (auto const& column : buckets) {
+		auto it = std::find(column_names.begin(), column_names.end(), column.first);
+		ColumnAttribute::DataType data_type = column_attributes[it - column_names.begin()].get_data_type();
+		ColumnStatistics &statistics = ret->columns[column.first];
+		for (auto const& bucket : column.second) {
+			ValueDict *row = bucket.second;
+			if (bucket.first == 0) {
+				ret->row_count = (u_long)row->at("row_count").n;
+				statistics.distinct_count = (u_long)row->at("distinct_count").n;
+				if (ret->row_count > 0)
+					statistics.min = from_text(row->at("upper_bound").s, data_type);
+			}
+			else {
+				statistics.bounds.push_back(from_text(row->at("upper_bound").s, data_type));
+				statistics.bucket_rows.push_back((u_long)row->at("row_count").n);
+				statistics.bucket_distinct.push_back((u_long)row->at("distinct_count").n);
+			}
+			delete row;
+		}
+	}
+	return ret;
+}
+
+// Replace whatever was there for the table with these.
+void Statistics::set_statistics(const DbRelation &table, const TableStatistics &statistics) {
+	ValueDict row;
+	row["table_name"] = Value(table.get_table_name());
+	Handles* handles = select(&row);
+	for (auto const& handle : *handles)
+		del(handle);
+	delete handles;
+
+	for (auto const& column : statistics.columns) {
+		const ColumnStatistics &column_statistics = column.second;
+		row["column_name"] = Value(column.first);
+		row["bucket"] = Value(0);
+		row["upper_bound"] = Value(statistics.row_count > 0 ? to_text(column_statistics.min) : "");
+		row["row_count"] = Value((int32_t)statistics.row_count);
+		row["distinct_count"] = Value((int32_t)column_statistics.distinct_count);
+		insert(&row);
+		for (uint i = 0; i < column_statistics.bounds.size(); i++) {
+			row["bucket"] = Value((int32_t)(i + 1));
+			row["upper_bound"] = Value(to_text(column_statistics.bounds[i]));
+			row["row_count"] = Value((int32_t)column_statistics.bucket_rows[i]);
+			row["distinct_count"] = Value((int32_t)column_statistics.bucket_distinct[i]);
+			insert(&row);
+		}
+	}
+}
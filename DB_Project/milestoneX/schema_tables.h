@@ -5,6 +5,7 @@
 
 void initialize_schema_tables();
 class Columns; // forward declare
+class Statistics;
 
 // The table that stores the metadata for all other tables.
 // For now, we are not indexing anything, so a query requires sequential scan of table.
@@ -15,6 +16,7 @@ protected:
     static ColumnNames& COLUMN_NAMES();
     static ColumnAttributes& COLUMN_ATTRIBUTES();
     static Columns* columns_table;
+    static Statistics* statistics_table;
 
 public:
     static void get_columns(Identifier table_name, ColumnNames &column_names, ColumnAttributes &column_attributes,
@@ -61,16 +63,38 @@ protected:
 
 public:
     virtual void get_columns(Identifier table_name, Identifier index_name,
-                             ColumnNames &column_names, bool &is_hash, bool &is_unique);
+                             ColumnNames &column_names, ColumnNames &include_columns,
+                             ValueDict &predicate, bool &is_hash, bool &is_unique);
     virtual DbIndex& get_index(DbRelation &table, Identifier index_name);
     virtual IndexNames get_index_names(Identifier table_name);
 
     Indices();
     virtual ~Indices() {}
 
+    virtual void create_if_not_exists();
     virtual Handle insert(const ValueDict* row);
     virtual void del(Handle handle);
 
 private:
     static std::map<std::pair<Identifier,Identifier>,DbIndex*> index_cache;
 };
+
+
+// The table that stores what ANALYZE found out about each column of a table. Bucket 0 has the table's row count,
+// the column's distinct count and (as text) its minimum; buckets 1 on are the histogram, each with its upper
+// bound, row count and distinct count.
+class Statistics : public HeapTable {
+public:
+    static const Identifier TABLE_NAME;
+    static const uint HISTOGRAM_BUCKETS;
+protected:
+    static ColumnNames& COLUMN_NAMES();
+    static ColumnAttributes& COLUMN_ATTRIBUTES();
+
+public:
+    Statistics();
+    virtual ~Statistics() {}
+
+    virtual TableStatistics *get_statistics(const DbRelation &table);  // nullptr if it hasn't been analyzed
+    virtual void set_statistics(const DbRelation &table, const TableStatistics &statistics);  // replacing any
+};
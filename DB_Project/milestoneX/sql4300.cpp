@@ -13,6 +13,9 @@
 #include "ParseTreeToString.h"
 #include "SQLExec.h"
 #include "btree.h"
+#include "EvalExpr.h"
+#include "EvalPlan.h"
+#include "hash_index.h"
 
 const bool RUN_TEST = false;
 
@@ -95,11 +98,26 @@ int main(int argc, char *argv[]) {
 			std::cout << "test_heap_storage: " << (test_heap_storage() ? "ok" : "failed") << std::endl;
 			std::cout << "test_btree: " << (test_btree() ? "ok" : "failed") << std::endl;	//TODO uncommment
 			std::cout << "test_table: " << (test_table() ? "ok" : "failed") << std::endl;
+			std::cout << "test_hash_index: " << (test_hash_index() ? "ok" : "failed") << std::endl;
+			std::cout << "test_sql_exec: " << (test_sql_exec() ? "ok" : "failed") << std::endl;
+			continue;
+		}
+		if (query == "benchmark" || query.compare(0, 10, "benchmark ") == 0) {
+			// benchmark [rows]: rows for the BTREE table benchmark
+			uint rows = query.size() > 10 ? (uint)strtoul(query.c_str() + 10, nullptr, 10) : 20000;
+			if (rows == 0) {
+				std::cout << "usage: benchmark [rows]" << std::endl;
+				continue;
+			}
+			benchmark_btree();
+			benchmark_expressions();
+			benchmark_table(rows);
+			std::cout << "benchmark_table_soak: " << (benchmark_table_soak(1000000) ? "ok" : "failed") << std::endl;
 			continue;
 		}
 
 		// parse and execute
-		hsql::SQLParserResult *parse = hsql::SQLParser::parseSQLString(query);
+		hsql::SQLParserResult *parse = SQLExec::parse(query);
 		if (!parse->isValid()) {
 			std::cout << "invalid SQL: " << query << std::endl;
 			std::cout << parse->errorMsg() << std::endl;
@@ -140,5 +158,6 @@ void initialize_environment(char *envHome) {
 		exit(1);
 	}
 	_DB_ENV = env;
+	EvalPlan::remove_temp_files(envHome);
 	initialize_schema_tables();
 }
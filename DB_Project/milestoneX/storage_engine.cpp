@@ -31,6 +31,126 @@ bool Value::operator<(const Value &other) const {
     return this->n < other.n;
 }
 
+// Hand out the next batch from the list.
+Handles* HandlesCursor::fetch(uint limit) {
+    u_long end = this->handles->size();
+    if (limit > 0 && this->position + limit < end)
+        end = this->position + limit;
+    Handles *ret = new Handles(this->handles->begin() + this->position, this->handles->begin() + end);
+    this->position = end;
+    return ret;
+}
+
+// Fetch from the selection and keep what matches, until we have limit of them or it runs out. Never asks
+// for more than are still wanted, so we don't read past what's needed.
+Handles* SelectCursor::fetch(uint limit) {
+    Handles *ret = new Handles();
+    while (limit == 0 || ret->size() < limit) {
+        Handles *handles = this->selection->fetch(limit == 0 ? 0 : limit - (uint) ret->size());
+        if (handles->empty()) {
+            delete handles;
+            break;
+        }
+        Handles *selected = this->relation.select(handles, &this->where);
+        ret->insert(ret->end(), selected->begin(), selected->end());
+        delete selected;
+        delete handles;
+    }
+    return ret;
+}
+
+// Cut the values, as they come in order, into buckets of about the same number of rows, each running on past
+// its share until the value changes.
+void ColumnStatistics::build(u_long count, uint buckets, const std::function<bool(Value&)> &next) {
+    this->distinct_count = 0;
+    this->bounds.clear();
+    this->bucket_rows.clear();
+    this->bucket_distinct.clear();
+    u_long per_bucket = (count + buckets - 1) / buckets;
+    u_long rows = 0, distinct = 0;
+    Value value, last;
+    auto close_bucket = [&]() {
+        this->bounds.push_back(last);
+        this->bucket_rows.push_back(rows);
+        this->bucket_distinct.push_back(distinct);
+        this->distinct_count += distinct;
+        rows = distinct = 0;
+    };
+    while (next(value)) {
+        if (this->bucket_rows.empty() && rows == 0)
+            this->min = value;
+        else if (value != last && rows >= per_bucket)
+            close_bucket();
+        if (rows == 0 || value != last)
+            distinct++;
+        rows++;
+        last = value;
+    }
+    if (rows > 0)
+        close_bucket();
+}
+
+// The rows in value's bucket, spread evenly over that bucket's distinct values.
+double ColumnStatistics::equal_fraction(const Value &value) const {
+    u_long rows = 0;
+    for (auto const& n : this->bucket_rows)
+        rows += n;
+    if (rows == 0 || value < this->min)
+        return 0.0;
+    for (uint i = 0; i < this->bounds.size(); i++)
+        if (!(this->bounds[i] < value))
+            return (double) this->bucket_rows[i] / this->bucket_distinct[i] / rows;
+    return 0.0;
+}
+
+// Add up the buckets inside the range, and the part of any bucket it cuts: for INT, as much of the bucket as the
+// range covers, assuming the values are spread out evenly; otherwise, half of it.
+double ColumnStatistics::range_fraction(const Value *low, const Value *high) const {
+    u_long rows = 0;
+    double in_range = 0.0;
+    for (uint i = 0; i < this->bounds.size(); i++) {
+        rows += this->bucket_rows[i];
+        // the bucket's values are from first (inclusive, for the first bucket) or after first, up to last
+        const Value &first = i == 0 ? this->min : this->bounds[i - 1], &last = this->bounds[i];
+        bool after_low = low == nullptr || !(first < *low);
+        bool before_high = high == nullptr || !(*high < last);
+        if ((high != nullptr && (i == 0 ? *high < first : !(first < *high))) || (low != nullptr && last < *low))
+            continue;  // no overlap
+        if (after_low && before_high) {
+            in_range += this->bucket_rows[i];
+        } else if (last.data_type == ColumnAttribute::INT) {
+            int64_t from = i == 0 ? first.n : (int64_t) first.n + 1, to = last.n;
+            int64_t overlap_from = low == nullptr ? from : std::max<int64_t>(from, low->n);
+            int64_t overlap_to = high == nullptr ? to : std::min<int64_t>(to, high->n);
+            in_range += (double) this->bucket_rows[i] * (overlap_to - overlap_from + 1) / (to - from + 1);
+        } else {
+            in_range += this->bucket_rows[i] / 2.0;
+        }
+    }
+    return rows == 0 ? 0.0 : in_range / rows;
+}
+
+// Take over the statistics, replacing any from before.
+void DbRelation::set_statistics(TableStatistics *statistics) {
+    this->statistics.reset(statistics);
+}
+
+// By default, delete them one at a time.
+void DbRelation::del(const Handles* handles) {
+    for (auto const& handle: *handles)
+        del(handle);
+}
+
+// By default, just build the whole selection and hand it out from there.
+DbCursor* DbRelation::cursor(const ValueDict* where) {
+    return new HandlesCursor(select(where));
+}
+
+DbCursor* DbRelation::reverse_cursor(const ValueDict* where, const ValueDict* min_values,
+                                     const ValueDict* max_values) {
+    throw DbRelationError("table " + this->table_name + " keeps its rows in no order to reverse");
+}
+
 // Get only selected column attributes
 ColumnAttributes* DbRelation::get_column_attributes(const ColumnNames &select_column_names) const {
     ColumnAttributes *ret = new ColumnAttributes();
@@ -81,3 +201,43 @@ ValueDicts* DbRelation::project(Handles *handles, const ValueDict* where) {
         ret->push_back(project(handle, &t));
     return ret;
 }
+
+// Do a projection for each of a list of handles from an index-only scan
+ValueDicts* DbIndex::project(Handles *handles, const ColumnNames *column_names) {
+    ValueDicts *ret = new ValueDicts();
+    for (auto const& handle: *handles)
+        ret->push_back(project(handle, column_names));
+    return ret;
+}
+
+// By default, delete them one at a time.
+void DbIndex::del(const Handles* handles) {
+    for (auto const& handle: *handles)
+        del(handle);
+}
+
+// Is the row one this index has (or should have) an entry for? Always, unless it's a partial index.
+bool DbIndex::includes(Handle handle) {
+    if (this->predicate.empty())
+        return true;
+    ValueDict *row = this->relation.project(handle, &this->predicate);
+    bool ret = true;
+    for (auto const& column: this->predicate)
+        if (row->at(column.first) != column.second)
+            ret = false;
+    delete row;
+    return ret;
+}
+
+// Can a search for where use this index? A partial index is only good for searches that stay inside its
+// predicate, i.e. where has the same condition on every predicate column.
+bool DbIndex::applies_to(const ValueDict* where) const {
+    for (auto const& column: this->predicate) {
+        if (where == nullptr)
+            return false;
+        auto it = where->find(column.first);
+        if (it == where->end() || it->second != column.second)
+            return false;
+    }
+    return true;
+}
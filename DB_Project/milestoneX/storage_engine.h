@@ -12,7 +12,9 @@
 #pragma once
 
 #include <exception>
+#include <functional>
 #include <map>
+#include <memory>
 #include <utility>
 #include <vector>
 #include "db_cxx.h"
@@ -129,6 +131,69 @@ public:
 	explicit DbRelationError(std::string s) : runtime_error(s) {}
 };
 
+// A selection that hands out its handles a batch at a time, so the caller can stop early
+// without the whole result ever being built.
+class DbCursor {
+public:
+    virtual ~DbCursor() {}
+
+    virtual Handles* fetch(uint limit) = 0;  // up to limit more handles (0 means all the rest); empty when done
+};
+
+// Cursor over a selection that has already been fully built. Takes ownership of handles.
+class HandlesCursor : public DbCursor {
+public:
+    HandlesCursor(Handles *handles) : handles(handles), position(0) {}
+    virtual ~HandlesCursor() { delete handles; }
+
+    virtual Handles* fetch(uint limit);
+
+protected:
+    Handles *handles;
+    u_long position;
+};
+
+class DbRelation;
+
+// Cursor over the handles from another cursor whose rows also match where, checked a batch at a time as
+// they're fetched. Takes ownership of the other cursor.
+class SelectCursor : public DbCursor {
+public:
+    SelectCursor(DbRelation &relation, DbCursor *selection, const ValueDict &where)
+            : relation(relation), selection(selection), where(where) {}
+    virtual ~SelectCursor() { delete selection; }
+
+    virtual Handles* fetch(uint limit);
+
+protected:
+    DbRelation &relation;
+    DbCursor *selection;
+    ValueDict where;
+};
+
+// What ANALYZE found out about a column: how many distinct values it has and an equi-depth histogram of them.
+// Bucket i holds bucket_rows[i] rows (with bucket_distinct[i] distinct values) whose values are greater than
+// bounds[i-1] and at most bounds[i]; the first bucket starts at min. The buckets hold about the same number of
+// rows, except that all the rows with the same value go in the same bucket.
+class ColumnStatistics {
+public:
+    u_long distinct_count = 0;
+    Value min;
+    std::vector<Value> bounds;
+    std::vector<u_long> bucket_rows, bucket_distinct;
+
+    // from all count of the column's values, which next hands out in order (and then gives false)
+    void build(u_long count, uint buckets, const std::function<bool(Value&)> &next);
+    double equal_fraction(const Value &value) const;  // the fraction of rows with this value
+    double range_fraction(const Value *low, const Value *high) const;  // ... from low to high (either may be null)
+};
+
+class TableStatistics {
+public:
+    u_long row_count = 0;
+    std::map<Identifier, ColumnStatistics> columns;
+};
+
 class DbRelation {
 public:
     DbRelation(Identifier table_name, ColumnNames column_names, ColumnAttributes column_attributes ) :
@@ -156,10 +221,19 @@ public:
 	virtual Handle insert(const ValueDict* row) = 0;
 	virtual void update(const Handle handle, const ValueDict* new_values) = 0;
 	virtual void del(const Handle handle) = 0;
+    virtual void del(const Handles* handles);  // same as deleting each one (but may be quicker)
 
 	virtual Handles* select() = 0;
 	virtual Handles* select(const ValueDict* where) = 0;
     virtual Handles* select(Handles* current_selection, const ValueDict* where) = 0;
+    virtual DbCursor* cursor(const ValueDict* where);
+    // the same, but the scan may be narrowed to columns' inclusive bounds, too (by default they're not used, so
+    // the caller still has to check them)
+    virtual DbCursor* cursor(const ValueDict* where, const ValueDict* min_values, const ValueDict* max_values) {
+        return cursor(where);
+    }
+    // the same, from the last row back to the first in the order the relation keeps (if it keeps one)
+    virtual DbCursor* reverse_cursor(const ValueDict* where, const ValueDict* min_values, const ValueDict* max_values);
 
 	virtual ValueDict* project(Handle handle) = 0;
 	virtual ValueDict* project(Handle handle, const ColumnNames* column_names) = 0;
@@ -172,14 +246,18 @@ public:
     virtual const ColumnAttributes get_column_attributes() const { return column_attributes; }
     virtual ColumnAttributes* get_column_attributes(const ColumnNames &select_column_names) const;
     virtual Identifier get_table_name() const { return table_name; }
-    virtual bool has_primary_key() const { return this->primary_key == nullptr; }
+    virtual bool has_primary_key() const { return this->primary_key != nullptr; }
     virtual const ColumnNames *get_primary_key() const { return this->primary_key; }
+    // what ANALYZE last found out about the table (nullptr if it hasn't been analyzed); the table owns them
+    virtual const TableStatistics *get_statistics() const { return this->statistics.get(); }
+    virtual void set_statistics(TableStatistics *statistics);
 
 protected:
 	Identifier table_name;
 	ColumnNames column_names;
 	ColumnAttributes column_attributes;
     ColumnNames *primary_key;
+    std::unique_ptr<TableStatistics> statistics;
 };
 
 class DbIndex {
@@ -197,16 +275,44 @@ public:
     virtual void close() = 0;
 
     virtual Handles* lookup(ValueDict* key_values) = 0;
+    // entries from min_key to max_key (inclusive), each giving values for some leading key columns
     virtual Handles* range(ValueDict* min_key, ValueDict* max_key) {
         throw DbRelationError("range index query not supported");
     }
+    // the first entry in key order (the last, if last), or none if the index is empty
+    virtual Handles* first(bool last) {
+        throw DbRelationError("range index query not supported");
+    }
+    virtual bool supports_range() const { return false; }
 
     virtual void insert(Handle handle) = 0;
     virtual void del(Handle handle) = 0;
+    virtual void del(const Handles* handles);  // same as deleting each one (but may be quicker)
+
+    virtual const ColumnNames& get_key_columns() const { return key_columns; }
+    virtual bool is_unique() const { return unique; }
+    virtual uint lookup_cost() = 0;  // expected number of blocks read by a lookup
+
+    // index-only scans: if the index holds every column asked for, rows can come straight from it
+    virtual bool covers(const ColumnNames* column_names) const { return false; }
+    virtual DbCursor* cursor(const ValueDict* where) {
+        throw DbRelationError("index-only scan not supported");
+    }
+    virtual ValueDict* project(Handle handle, const ColumnNames* column_names) {
+        throw DbRelationError("index-only scan not supported");
+    }
+    virtual ValueDicts* project(Handles *handles, const ColumnNames* column_names);
+
+    // partial index: only rows where each predicate column equals its value get an entry (empty for all rows)
+    virtual void set_predicate(const ValueDict& predicate) { this->predicate = predicate; }
+    virtual const ValueDict& get_predicate() const { return predicate; }
+    virtual bool includes(Handle handle);  // does (or should) the index have an entry for this row?
+    virtual bool applies_to(const ValueDict* where) const;  // are all the rows matching where in the index?
 
 protected:
     DbRelation& relation;
     Identifier name;
     ColumnNames key_columns;
     bool unique;
+    ValueDict predicate;
 };